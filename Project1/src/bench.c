@@ -0,0 +1,577 @@
+/*
+ * File: bench.c
+ * Desc: Measurement mode of the client, drives a server with a generated workload
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ipk.h"
+
+/* number of distinct expressions every client cycles through */
+#define BENCH_EXPRESSIONS 64
+
+/* maximum depth of a generated expression */
+#define BENCH_DEPTH 4
+
+/* a UDP response not received within this time is counted as an error */
+#define BENCH_UDP_TIMEOUT_MS 1000
+
+static const char *mode_names[] = {"TCP", "UDP", "SHM"};
+
+struct bench_client {
+	const struct bench_opts *opts;
+	pthread_t tid;
+	unsigned int seed;
+	int requests;
+	int messages;
+	int errors;
+	unsigned long long *latencies;
+	unsigned long long *wires;
+	int stamped;
+	int hardware;
+	unsigned int sent;
+	char expressions[BENCH_EXPRESSIONS][MAX_INPUT_SIZE / 4];
+};
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Appends a random expression and returns its value. The operators are picked so that no
+ * intermediate result is negative, overflows or divides by zero, which the server would reject.
+ * The top level expression is never a bare literal.
+ */
+static long long
+gen_expr(char **pos, int depth, int top, unsigned int *seed)
+{
+	long long left, right;
+	char op, *op_pos;
+	int len;
+
+	if (!top && ((depth <= 1) || (rand_r(seed) % 3 == 0))) {
+		left = 1 + rand_r(seed) % 999;
+		len = sprintf(*pos, "%lld", left);
+		*pos += len;
+		return left;
+	}
+
+	*(*pos)++ = '(';
+	op_pos = (*pos)++;
+	*(*pos)++ = ' ';
+	left = gen_expr(pos, depth - 1, 0, seed);
+	*(*pos)++ = ' ';
+	right = gen_expr(pos, depth - 1, 0, seed);
+	*(*pos)++ = ')';
+
+	op = "+-*/"[rand_r(seed) % 4];
+	if (((op == '*') && right && (left > INT_MAX / right)) || ((op == '-') && (left < right)) ||
+			((op == '+') && (left > INT_MAX - right))) {
+		op = '/';
+	}
+	if ((op == '/') && !right) {
+		op = '*';
+	}
+	*op_pos = op;
+
+	switch (op) {
+	case '+':
+		return left + right;
+	case '-':
+		return left - right;
+	case '*':
+		return left * right;
+	default:
+		return left / right;
+	}
+}
+
+/*
+ * Receives a single line into buf, the bytes following it are kept in buf for the next call.
+ * Returns the length of the line including LF, 0 if the server disconnected, -1 on error.
+ */
+static int
+recv_line(int sock, char *buf, int *buffered)
+{
+	char *lf;
+	ssize_t received;
+	int len;
+
+	while (!(lf = memchr(buf, '\n', *buffered))) {
+		if (*buffered >= MAX_INPUT_SIZE) {
+			return -1;
+		}
+
+		received = busy_recvfrom(sock, buf + *buffered, MAX_INPUT_SIZE - *buffered, NULL, NULL);
+		if (received <= 0) {
+			return received;
+		}
+		*buffered += received;
+	}
+
+	len = lf - buf + 1;
+	return len;
+}
+
+/* drops a line received by recv_line or a frame received by frame_recv from the buffer */
+static void
+consume_line(char *buf, int *buffered, int len)
+{
+	memmove(buf, buf + len, *buffered - len);
+	*buffered -= len;
+}
+
+/*
+ * Takes the time the message with the given id spent between leaving the client and its response arriving,
+ * as stamped by the kernel or the NIC. The datagrams are numbered, the bytes of a TCP stream are numbered instead.
+ */
+static void
+bench_wire(struct bench_client *client, int sock, unsigned int id)
+{
+	struct stamp sent;
+	long long wire;
+	int hardware;
+
+	if (!client->opts->timestamps || stamp_tx(sock, id, &sent)) {
+		return;
+	}
+
+	wire = stamp_diff(&sent, &stamp_rx, &hardware);
+	if (wire >= 0) {
+		client->wires[client->stamped++] = wire;
+		client->hardware += hardware;
+	}
+	memset(&stamp_rx, 0, sizeof stamp_rx);
+}
+
+/* the number of queries of the message starting with the given one */
+static int
+bench_count(struct bench_client *client, int first)
+{
+	int count = client->requests - first;
+
+	return (count < client->opts->batch) ? count : client->opts->batch;
+}
+
+static int
+bench_tcp(struct bench_client *client, int sock)
+{
+	char buf[MAX_INPUT_SIZE], request[MAX_BATCH * (MAX_INPUT_SIZE / 4 + 1) + 16];
+	const char *prefix = "RESULT ";
+	unsigned long long start;
+	int i, j, len, count, buffered = 0;
+
+	/* handshake */
+	if (send(sock, "HELLO\n", strlen("HELLO\n"), 0) != (ssize_t)strlen("HELLO\n")) {
+		return -1;
+	}
+	client->sent += strlen("HELLO\n");
+	len = recv_line(sock, buf, &buffered);
+	if ((len <= 0) || strncmp(buf, "HELLO\n", len)) {
+		return -1;
+	}
+	consume_line(buf, &buffered, len);
+
+	for (i = 0; i < client->requests; i += count) {
+		count = bench_count(client, i);
+		if (client->opts->batch > 1) {
+			/* the last batch may be shorter, it is still sent as a batch */
+			len = sprintf(request, "SOLVEN");
+			for (j = 0; j < count; j++) {
+				len += sprintf(request + len, " %s", client->expressions[(i + j) % BENCH_EXPRESSIONS]);
+			}
+			request[len++] = '\n';
+			prefix = "RESULTN ";
+		} else {
+			len = snprintf(request, sizeof request, "SOLVE %s\n", client->expressions[i % BENCH_EXPRESSIONS]);
+		}
+
+		start = now_ns();
+		if (send(sock, request, len, 0) != len) {
+			return -1;
+		}
+
+		client->sent += len;
+
+		len = recv_line(sock, buf, &buffered);
+		client->latencies[client->messages++] = now_ns() - start;
+		if (len <= 0) {
+			/* the server terminated the connection */
+			client->errors += client->requests - i;
+			return -1;
+		}
+		bench_wire(client, sock, client->sent - 1);
+
+		if (strncmp(buf, prefix, strlen(prefix))) {
+			client->errors += count;
+		}
+		consume_line(buf, &buffered, len);
+	}
+
+	send(sock, "BYE\n", strlen("BYE\n"), 0);
+	recv_line(sock, buf, &buffered);
+	return 0;
+}
+
+/* the TCP session with binary frames, every query is a frame and so is every result */
+static int
+bench_binary(struct bench_client *client, int sock)
+{
+	char buf[MAX_FRAME_SIZE], request[MAX_FRAME_SIZE];
+	const char *query;
+	unsigned long long start;
+	int i, len, buffered = 0;
+
+	if (send(sock, BIN_HELLO, strlen(BIN_HELLO), 0) != (ssize_t)strlen(BIN_HELLO)) {
+		return -1;
+	}
+	client->sent += strlen(BIN_HELLO);
+	len = recv_line(sock, buf, &buffered);
+	if ((len <= 0) || strncmp(buf, BIN_HELLO, len)) {
+		return -1;
+	}
+	consume_line(buf, &buffered, len);
+
+	for (i = 0; i < client->requests; i++) {
+		query = client->expressions[i % BENCH_EXPRESSIONS];
+		len = frame_query(request, query, strlen(query));
+
+		start = now_ns();
+		if (send(sock, request, len, 0) != len) {
+			return -1;
+		}
+
+		client->sent += len;
+
+		len = frame_recv(sock, buf, sizeof buf, &buffered);
+		client->latencies[client->messages++] = now_ns() - start;
+		if (len <= 0) {
+			client->errors += client->requests - i;
+			return -1;
+		}
+		bench_wire(client, sock, client->sent - 1);
+
+		if ((buf[0] != BIN_RESULT) && (buf[0] != BIN_INTEGER)) {
+			client->errors++;
+		}
+		consume_line(buf, &buffered, len);
+	}
+
+	memset(request, 0, BIN_HEADER_SIZE);
+	request[0] = BIN_BYE;
+	send(sock, request, BIN_HEADER_SIZE, 0);
+	frame_recv(sock, buf, sizeof buf, &buffered);
+	return 0;
+}
+
+/* prepares the datagram of the queries from the given one on, returns its length and the number of its queries */
+static int
+bench_datagram(struct bench_client *client, int first, int limit, char request[MAX_INPUT_SIZE], int *count)
+{
+	const char *query;
+	int len = 0, next;
+
+	if (client->opts->batch == 1) {
+		memset(request, 0, MAX_INPUT_SIZE);
+		strcpy(request, client->expressions[first % BENCH_EXPRESSIONS]);
+		len = strlen(request) + 2;
+		str_to_bin(request);
+		*count = 1;
+		return len;
+	}
+
+	/* as many queries as fit */
+	for (*count = 0; *count < bench_count(client, first); (*count)++) {
+		query = client->expressions[(first + *count) % BENCH_EXPRESSIONS];
+		next = batch_add(request, len, limit, query, strlen(query));
+		if (next < 0) {
+			break;
+		}
+		len = next;
+	}
+
+	return len;
+}
+
+/* the number of the failed queries of a datagram with count queries */
+static int
+bench_failed(struct bench_client *client, const char *response, int received, int count)
+{
+	const char *payload;
+	int i, pos = 2, payload_len, status, failed = 0;
+
+	if (client->opts->batch == 1) {
+		return (received < 3) || response[1];
+	}
+
+	if ((received < 2) || (response[0] != BATCH_RESPONSE) || ((unsigned char)response[1] != count)) {
+		return count;
+	}
+
+	for (i = 0; i < count; i++) {
+		status = batch_item(response, received, &pos, &payload, &payload_len);
+		if (status < 0) {
+			return failed + count - i;
+		}
+		failed += status;
+	}
+
+	return failed;
+}
+
+static int
+bench_udp(struct bench_client *client, int sock, struct sockaddr_storage *sin, socklen_t sinlen)
+{
+	char request[MAX_INPUT_SIZE], response[MAX_INPUT_SIZE];
+	unsigned long long start;
+	struct timeval timeout;
+	ssize_t to_send, received;
+	int i, count;
+
+	/* a lost datagram must not block the client forever */
+	timeout.tv_sec = BENCH_UDP_TIMEOUT_MS / 1000;
+	timeout.tv_usec = (BENCH_UDP_TIMEOUT_MS % 1000) * 1000;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout)) {
+		return -1;
+	}
+
+	for (i = 0; i < client->requests; i += count) {
+		to_send = bench_datagram(client, i, MAX_INPUT_SIZE - 1, request, &count);
+
+		start = now_ns();
+		if (sendto(sock, request, to_send, 0, (struct sockaddr *)sin, sinlen) != to_send) {
+			return -1;
+		}
+
+		received = busy_recvfrom(sock, response, sizeof response, NULL, NULL);
+		client->latencies[client->messages++] = now_ns() - start;
+		client->errors += bench_failed(client, response, received, count);
+		if (received > 0) {
+			bench_wire(client, sock, client->sent);
+		}
+		client->sent++;
+	}
+
+	return 0;
+}
+
+/* the same requests as in UDP, but through the rings of the shared memory */
+static int
+bench_shm(struct bench_client *client, int sock)
+{
+	char request[MAX_INPUT_SIZE], response[MAX_INPUT_SIZE];
+	struct shm_client shm;
+	unsigned long long start;
+	int i, len, count, received;
+
+	if (shm_connect(sock, &shm)) {
+		return -1;
+	}
+
+	for (i = 0; i < client->requests; i += count) {
+		len = bench_datagram(client, i, SHM_SLOT_SIZE - sizeof(uint32_t), request, &count);
+
+		start = now_ns();
+		received = shm_request(&shm, request, len, response, BENCH_UDP_TIMEOUT_MS);
+		client->latencies[client->messages++] = now_ns() - start;
+		client->errors += bench_failed(client, response, received, count);
+	}
+
+	shm_disconnect(&shm);
+	return 0;
+}
+
+/* a single client of the measurement, runs in its own thread */
+static void *
+bench_client_run(void *arg)
+{
+	struct bench_client *client = arg;
+	const struct bench_opts *opts = client->opts;
+	struct sockaddr_storage sin;
+	socklen_t sinlen;
+	int sock = -1, ret;
+
+	if (init_client(opts->host, opts->port, opts->mode, &sock, &sin, &sinlen)) {
+		client->errors = client->requests;
+		return NULL;
+	}
+
+	if (opts->timestamps && stamp_enable(sock)) {
+		client->errors = client->requests;
+		close(sock);
+		return NULL;
+	}
+
+	if ((opts->mode == IP_TCP) && opts->binary) {
+		ret = bench_binary(client, sock);
+	} else if (opts->mode == IP_TCP) {
+		ret = bench_tcp(client, sock);
+	} else if (opts->mode == IP_UDP) {
+		ret = bench_udp(client, sock, &sin, sinlen);
+	} else {
+		ret = bench_shm(client, sock);
+	}
+
+	if (ret && !client->errors) {
+		ERR("Client failed to communicate with the server.");
+		client->errors = 1;
+	}
+
+	close(sock);
+	return NULL;
+}
+
+static int
+compare_latency(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+percentile_us(const unsigned long long *sorted, int count, double p)
+{
+	int idx;
+
+	idx = (int)(p * (count - 1) + 0.5);
+	return sorted[idx] / 1e3;
+}
+
+/*
+ * Runs the measurement, every client sends its share of the requests one after another
+ * and the latency of every request is recorded. Prints the throughput and the latency percentiles.
+ * With batches the throughput counts the queries and the latencies are those of the whole messages.
+ * With the timestamps the wire latencies, from the request leaving to the response arriving as stamped
+ * by the kernel or the NIC, are printed as well, they leave out the scheduling of the client.
+ */
+int
+run_bench(const struct bench_opts *opts)
+{
+	struct bench_client *clients;
+	unsigned long long *latencies, *wires = NULL, start, elapsed;
+	int i, j, total = 0, messages = 0, stamped = 0, hardware = 0, errors = 0, failed = 0, ret = 0;
+	char *pos;
+
+	if (opts->concurrency < 1) {
+		ERR("Invalid concurrency.");
+		return 1;
+	}
+
+	if ((opts->batch < 1) || (opts->batch > MAX_BATCH)) {
+		ERR("Invalid batch size.");
+		return 1;
+	}
+
+	if (opts->binary && ((opts->mode != IP_TCP) || (opts->batch > 1))) {
+		ERR("Binary frames are only sent over TCP and without batches.");
+		return 1;
+	}
+
+	if (opts->timestamps && ((opts->mode == IP_SHM) || !strncmp(opts->host, UNIX_PREFIX, strlen(UNIX_PREFIX)))) {
+		ERR("The timestamps are only taken over TCP and UDP.");
+		return 1;
+	}
+
+	clients = calloc(opts->concurrency, sizeof *clients);
+	latencies = calloc(opts->requests, sizeof *latencies);
+	if (opts->timestamps) {
+		wires = calloc(opts->requests, sizeof *wires);
+	}
+	if (!clients || !latencies || (opts->timestamps && !wires)) {
+		ERR("Memory allocation error.");
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* split the requests and generate the workload of every client from the seed */
+	for (i = 0; i < opts->concurrency; i++) {
+		clients[i].opts = opts;
+		clients[i].seed = opts->seed + i;
+		clients[i].requests = opts->requests / opts->concurrency + (i < opts->requests % opts->concurrency);
+		clients[i].latencies = latencies + total;
+		clients[i].wires = wires ? wires + total : NULL;
+		total += clients[i].requests;
+
+		for (j = 0; j < BENCH_EXPRESSIONS; j++) {
+			pos = clients[i].expressions[j];
+			gen_expr(&pos, BENCH_DEPTH, 1, &clients[i].seed);
+			*pos = '\0';
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < opts->concurrency; i++) {
+		if (pthread_create(&clients[i].tid, NULL, bench_client_run, &clients[i])) {
+			ERR("Creating a client thread failed.");
+			failed = 1;
+			break;
+		}
+	}
+
+	for (j = 0; j < i; j++) {
+		pthread_join(clients[j].tid, NULL);
+		errors += clients[j].errors;
+
+		/* a client has less latencies than requests with batches, they are moved right after the previous ones */
+		memmove(latencies + messages, clients[j].latencies, clients[j].messages * sizeof *latencies);
+		messages += clients[j].messages;
+		if (wires) {
+			memmove(wires + stamped, clients[j].wires, clients[j].stamped * sizeof *wires);
+			stamped += clients[j].stamped;
+			hardware += clients[j].hardware;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	if (failed || !messages) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	qsort(latencies, messages, sizeof *latencies, compare_latency);
+
+	printf("mode=%s concurrency=%d batch=%d requests=%d errors=%d rps=%.1f p50_us=%.1f p90_us=%.1f p99_us=%.1f max_us=%.1f",
+			mode_names[opts->mode], opts->concurrency, opts->batch, total, errors, total / (elapsed / 1e9),
+			percentile_us(latencies, messages, 0.5), percentile_us(latencies, messages, 0.9),
+			percentile_us(latencies, messages, 0.99), latencies[messages - 1] / 1e3);
+
+	if (stamped) {
+		/* the messages, which were not stamped on both ends, are left out */
+		qsort(wires, stamped, sizeof *wires, compare_latency);
+		printf(" stamped=%d clock=%s wire_p50_us=%.1f wire_p90_us=%.1f wire_p99_us=%.1f wire_max_us=%.1f",
+				stamped, !hardware ? "software" : (hardware == stamped) ? "hardware" : "mixed",
+				percentile_us(wires, stamped, 0.5), percentile_us(wires, stamped, 0.9),
+				percentile_us(wires, stamped, 0.99), wires[stamped - 1] / 1e3);
+	} else if (opts->timestamps) {
+		printf(" stamped=0");
+	}
+	printf("\n");
+
+	if (errors) {
+		ret = 1;
+	}
+
+cleanup:
+	free(clients);
+	free(latencies);
+	free(wires);
+	return ret;
+}
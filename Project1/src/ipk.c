@@ -5,23 +5,39 @@
  * Login: xjanot04
 */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <strings.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ipk.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define BUSY_POLL_RELAX() __builtin_ia32_pause()
+#else
+#define BUSY_POLL_RELAX()
+#endif
+
 volatile int exit_application = 0;
 
+int busy_poll = 0;
+
 static void
 sigint_handler(int signum)
 {
@@ -36,63 +52,384 @@ help_print()
 	printf("Usage: ./ipkcpc -h <host> -p <port> -m <mode>\n");
 	printf("A simple network client.\n");
 	printf("Example: ./ipkcpc -h example.com -p 830 -m TCP\n");
+	printf("Example: ./ipkcpc -h unix:/tmp/ipkpd.sock -m UDP\n");
+	printf("Example: ./ipkcpc -h unix:/tmp/ipkpd.shm -m SHM\n");
 	printf("Available options:\n");
 	printf("\t--help \t\t\tDisplays this message.\n");
-	printf("\t--host [-h] \t\tSpecify the host to connect to.\n");
-	printf("\t--port [-p] \t\tSpecify the port to use.\n");
-	printf("\t--mode [-m] \t\tSelect the mode to use, either TCP or UDP.\n");
+	printf("\t--host [-h] \t\tSpecify the host to connect to, unix:<path> for a unix socket.\n");
+	printf("\t--port [-p] \t\tSpecify the port to use, not needed for a unix socket.\n");
+	printf("\t--mode [-m] \t\tSelect the mode to use, TCP, UDP or SHM (shared memory, unix:<path> only).\n");
+	printf("\t--bench [-b] \t\tMeasure the server with the given number of generated requests.\n");
+	printf("\t--concurrency [-c] \tNumber of parallel clients in the measurement (default 1).\n");
+	printf("\t--seed [-s] \t\tSeed of the generated requests (default 1).\n");
+	printf("\t--binary [-B] \t\tUse the binary frames of the TCP mode, the lines are translated to them and back.\n");
+	printf("\t--batch [-n] \t\tSend up to the given number of queries in a single message, UDP, SHM and measurement only.\n");
+	printf("\t--busy-poll [-y] \tPoll the socket for the given microseconds and spin on it rather than sleep.\n");
+	printf("\t--replay [-r] \t\tSend the requests of a log captured by the server (ipkpd --capture) again.\n");
+	printf("\t--speed [-x] \t\tReplay the given times faster than captured, 0 sends the requests as fast as possible.\n");
+	printf("\t--timestamps [-t] \tMeasure the wire latency from the kernel or NIC timestamps as well, TCP and UDP only.\n");
+}
+
+/*
+ * Receives like recvfrom(). With busy polling the socket is read without blocking until something comes,
+ * the CPU is paused between the first tries and yielded between the next ones, then the receive blocks.
+ * The stamps of the received data, if the socket has them enabled, are kept in stamp_rx.
+ */
+ssize_t
+busy_recvfrom(int sock, void *buf, size_t len, struct sockaddr *sa, socklen_t *salen)
+{
+	static int spins = -1;
+	struct iovec iov = {.iov_base = buf, .iov_len = len};
+	struct msghdr msg = {.msg_name = sa, .msg_namelen = salen ? *salen : 0, .msg_iov = &iov, .msg_iovlen = 1};
+	ssize_t received;
+	int spin;
+
+	if (busy_poll && (spins < 0)) {
+		/* spinning on a single CPU would only keep the server from running */
+		spins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? BUSY_POLL_SPINS : 0;
+	}
+
+	for (spin = 0; busy_poll && (spin < spins + BUSY_POLL_YIELDS); spin++) {
+		received = stamp_recvmsg(sock, &msg, MSG_DONTWAIT);
+		if ((received >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+			goto done;
+		}
+
+		if (spin < spins) {
+			BUSY_POLL_RELAX();
+		} else {
+			sched_yield();
+		}
+	}
+
+	received = stamp_recvmsg(sock, &msg, 0);
+
+done:
+	if (salen) {
+		*salen = msg.msg_namelen;
+	}
+	return received;
+}
+
+/*
+ * Returns the current monotonic time in milliseconds.
+ */
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Sets or clears the O_NONBLOCK flag of a socket.
+ */
+static int
+set_nonblocking(int sock, int enable)
+{
+	int flags;
+
+	flags = fcntl(sock, F_GETFL);
+	if (flags == -1) {
+		return 1;
+	}
+
+	if (enable) {
+		flags |= O_NONBLOCK;
+	} else {
+		flags &= ~O_NONBLOCK;
+	}
+
+	return fcntl(sock, F_SETFL, flags) == -1;
+}
+
+/*
+ * Reorders the resolved addresses so that the address families alternate,
+ * starting with the family of the first (most preferred) address.
+ * Returns the number of addresses stored in addrs.
+ */
+static int
+interleave_addrs(struct addrinfo *res, struct addrinfo *addrs[MAX_CONNECT_ATTEMPTS])
+{
+	struct addrinfo *ai, *first[MAX_CONNECT_ATTEMPTS], *second[MAX_CONNECT_ATTEMPTS];
+	int n_first = 0, n_second = 0, i = 0, j = 0, count = 0;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_family == res->ai_family) {
+			if (n_first < MAX_CONNECT_ATTEMPTS) {
+				first[n_first++] = ai;
+			}
+		} else if (n_second < MAX_CONNECT_ATTEMPTS) {
+			second[n_second++] = ai;
+		}
+	}
+
+	while ((count < MAX_CONNECT_ATTEMPTS) && ((i < n_first) || (j < n_second))) {
+		if (i < n_first) {
+			addrs[count++] = first[i++];
+		}
+		if ((count < MAX_CONNECT_ATTEMPTS) && (j < n_second)) {
+			addrs[count++] = second[j++];
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Races non-blocking connection attempts to all the resolved addresses. A new attempt
+ * is started every CONNECT_ATTEMPT_DELAY_MS, or immediately once all the pending ones
+ * have failed. The first attempt to succeed wins and the rest are closed.
+ * Returns the connected (blocking) socket or -1 if no address was reachable in time.
+ */
+static int
+race_connect(struct addrinfo *res, struct sockaddr_storage *sin, socklen_t *sinlen)
+{
+	struct addrinfo *addrs[MAX_CONNECT_ATTEMPTS];
+	int socks[MAX_CONNECT_ATTEMPTS];
+	int count, started = 0, pending = 0, winner = -1, maxfd, i, err;
+	long long deadline, next_attempt, now, wait;
+	socklen_t errlen;
+	fd_set writefds;
+	struct timeval timeout;
+
+	count = interleave_addrs(res, addrs);
+	deadline = now_ms() + CONNECT_TIMEOUT_MS;
+	next_attempt = now_ms();
+
+	while ((winner < 0) && ((started < count) || pending)) {
+		now = now_ms();
+		if (now >= deadline) {
+			break;
+		}
+
+		/* start the next attempt if it is due or if nothing is in flight */
+		if ((started < count) && ((now >= next_attempt) || !pending)) {
+			i = started++;
+			socks[i] = socket(addrs[i]->ai_family, addrs[i]->ai_socktype, addrs[i]->ai_protocol);
+			if ((socks[i] < 0) || set_nonblocking(socks[i], 1)) {
+				if (socks[i] >= 0) {
+					close(socks[i]);
+				}
+				socks[i] = -1;
+				continue;
+			}
+
+			if (!connect(socks[i], addrs[i]->ai_addr, addrs[i]->ai_addrlen)) {
+				winner = i;
+				break;
+			} else if (errno != EINPROGRESS) {
+				close(socks[i]);
+				socks[i] = -1;
+				continue;
+			}
+
+			pending++;
+			next_attempt = now + CONNECT_ATTEMPT_DELAY_MS;
+		}
+
+		/* wait until an attempt completes, the next one is due or time runs out */
+		FD_ZERO(&writefds);
+		maxfd = -1;
+		for (i = 0; i < started; i++) {
+			if (socks[i] >= 0) {
+				FD_SET(socks[i], &writefds);
+				if (socks[i] > maxfd) {
+					maxfd = socks[i];
+				}
+			}
+		}
+
+		wait = deadline - now;
+		if ((started < count) && (next_attempt - now < wait)) {
+			wait = next_attempt - now;
+		}
+		if (wait < 0) {
+			wait = 0;
+		}
+		timeout.tv_sec = wait / 1000;
+		timeout.tv_usec = (wait % 1000) * 1000;
+
+		if (select(maxfd + 1, NULL, &writefds, NULL, &timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (i = 0; i < started; i++) {
+			if ((socks[i] < 0) || !FD_ISSET(socks[i], &writefds)) {
+				continue;
+			}
+
+			/* the attempt finished, find out how */
+			errlen = sizeof err;
+			if (getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+				close(socks[i]);
+				socks[i] = -1;
+				pending--;
+				continue;
+			}
+
+			winner = i;
+			break;
+		}
+	}
+
+	/* close the losers */
+	for (i = 0; i < started; i++) {
+		if ((i != winner) && (socks[i] >= 0)) {
+			close(socks[i]);
+		}
+	}
+
+	if (winner < 0) {
+		return -1;
+	}
+
+	/* the rest of the client works with a blocking socket */
+	if (set_nonblocking(socks[winner], 0)) {
+		close(socks[winner]);
+		return -1;
+	}
+
+	memcpy(sin, addrs[winner]->ai_addr, addrs[winner]->ai_addrlen);
+	*sinlen = addrs[winner]->ai_addrlen;
+	return socks[winner];
+}
+
+/*
+ * Connects to a server on a unix socket. A datagram socket is bound to an autogenerated
+ * abstract address, so that the server has an address to respond to. The SHM mode connects
+ * a stream socket, the server passes the shared memory over it.
+ */
+static int
+init_unix_client(const char *path, protocol_type mode, int *sock, struct sockaddr_storage *sin, socklen_t *sinlen)
+{
+	struct sockaddr_un *sa = (struct sockaddr_un *)sin;
+	sa_family_t family = AF_UNIX;
+
+	if (strlen(path) >= sizeof sa->sun_path) {
+		ERR("Unix socket path too long.");
+		return 1;
+	}
+
+	memset(sin, 0, sizeof *sin);
+	sa->sun_family = AF_UNIX;
+	strcpy(sa->sun_path, path);
+	*sinlen = sizeof *sa;
+
+	*sock = socket(AF_UNIX, (mode == IP_UDP) ? SOCK_DGRAM : SOCK_STREAM, 0);
+	if (*sock < 0) {
+		ERR("Creating a socket failed.");
+		return 1;
+	}
+
+	if (mode != IP_UDP) {
+		if (connect(*sock, (struct sockaddr *)sa, *sinlen)) {
+			ERR("Couldn't connect to \"%s\" (%s).", path, strerror(errno));
+			goto error;
+		}
+	} else if (bind(*sock, (struct sockaddr *)&family, sizeof family)) {
+		/* binding just the family makes the kernel pick a unique address */
+		ERR("Binding the socket failed (%s).", strerror(errno));
+		goto error;
+	}
+
+	return 0;
+
+error:
+	close(*sock);
+	*sock = -1;
+	return 1;
 }
 
 /*
  * Initialization of socket and other structures needed for connection.
  */
 int
-init_client(const char *host, int port, protocol_type mode, int *sock, struct sockaddr_in *sin)
+init_client(const char *host, int port, protocol_type mode, int *sock, struct sockaddr_storage *sin, socklen_t *sinlen)
 {
-	int ret = 0;
-	struct hostent *server;
+	int ret = 0, prefer = 1;
+	struct addrinfo hints, *res = NULL, *ai;
+	char service[16];
 
 	assert(sock);
 	assert(sin);
+	assert(sinlen);
 
-	if (mode == IP_TCP) {
-		*sock = socket(AF_INET, SOCK_STREAM, 0);
-	} else {
-		*sock = socket(AF_INET, SOCK_DGRAM, 0);
+	*sock = -1;
+
+	/* a co-located server is reached without the network stack */
+	if (!strncmp(host, UNIX_PREFIX, strlen(UNIX_PREFIX))) {
+		return init_unix_client(host + strlen(UNIX_PREFIX), mode, sock, sin, sinlen);
+	} else if (mode == IP_SHM) {
+		ERR("The SHM mode needs a unix:<path> host.");
+		return 1;
 	}
 
-	if (*sock < 0) {
-		ERR("Creating a socket failed.");
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = (mode == IP_TCP) ? SOCK_STREAM : SOCK_DGRAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	snprintf(service, sizeof service, "%d", port);
+
+	ret = getaddrinfo(host, service, &hints, &res);
+	if (ret) {
+		ERR("Unable to get host \"%s\" (%s).", host, gai_strerror(ret));
 		ret = 1;
 		goto cleanup;
 	}
 
-	server = gethostbyname(host);
-	if (!server) {
-		ERR("Unable to get host \"%s\".", host);
-		ret = 1;
+	if (mode == IP_TCP) {
+		*sock = race_connect(res, sin, sinlen);
+		if (*sock < 0) {
+			ERR("Couldn't connect to \"%s\".", host);
+			ret = 1;
+		}
 		goto cleanup;
 	}
 
-	bzero((char *) sin, sizeof *sin);
-	sin->sin_family = AF_INET;
-	bcopy((char *) server->h_addr_list[0], (char *) &sin->sin_addr.s_addr, server->h_length);
-	sin->sin_port = htons(port);
+	/* there is no handshake to race in UDP, use the first address a socket can be created for */
+	for (ai = res; ai; ai = ai->ai_next) {
+		*sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (*sock >= 0) {
+			memcpy(sin, ai->ai_addr, ai->ai_addrlen);
+			*sinlen = ai->ai_addrlen;
+			break;
+		}
+	}
 
-	if ((mode == IP_TCP) && (connect(*sock, (struct sockaddr *)sin, sizeof *sin) != 0)) {
-		ERR("Couldn't connect to \"%s\".", host);
+	if (*sock < 0) {
+		ERR("Creating a socket failed.");
 		ret = 1;
 		goto cleanup;
 	}
 
 cleanup:
+	if (!ret && busy_poll) {
+		/* the kernel polls the device queue instead of waiting for its interrupt */
+		if (setsockopt(*sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof busy_poll)) {
+			ERR("Setting busy polling failed (%s), polling the socket only.", strerror(errno));
+		}
+#ifdef SO_PREFER_BUSY_POLL
+		setsockopt(*sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof prefer);
+#else
+		(void) prefer;
+#endif
+	}
+	if (res) {
+		freeaddrinfo(res);
+	}
 	return ret;
 }
 
 /*
  * Converts textual representation to the binary variant.
  */
-static void
+void
 str_to_bin(char request[MAX_INPUT_SIZE])
 {
 	char copy[MAX_INPUT_SIZE] = {0};
@@ -115,7 +452,7 @@ str_to_bin(char request[MAX_INPUT_SIZE])
  * Converts textual representation to the binary variant.
  * Returns 0 if the response is ok, 1 if an error occurred.
  */
-static int
+int
 bin_to_str(char resp[MAX_INPUT_SIZE])
 {
 	int ret = 0;
@@ -134,32 +471,325 @@ bin_to_str(char resp[MAX_INPUT_SIZE])
 	return ret;
 }
 
+/*
+ * Appends a query to a batch request of len bytes, an empty request is started first.
+ * Returns the new length of the request, or -1 if the query does not fit into limit bytes.
+ */
+int
+batch_add(char *request, int len, int limit, const char *query, int query_len)
+{
+	if (!len) {
+		request[0] = BATCH_REQUEST;
+		request[1] = 0;
+		len = 2;
+	}
+
+	if (((unsigned char)request[1] == MAX_BATCH) || (query_len > 255) || (len + 1 + query_len > limit)) {
+		return -1;
+	}
+
+	request[1]++;
+	request[len] = query_len;
+	memcpy(request + len + 1, query, query_len);
+	return len + 1 + query_len;
+}
+
+/*
+ * Gets the item of a batch response at *pos, which is moved past it.
+ * Returns its status, 0 if the query was solved, 1 if it failed, or -1 if the response is too short.
+ */
+int
+batch_item(const char *response, int len, int *pos, const char **payload, int *payload_len)
+{
+	if (*pos + 2 > len) {
+		return -1;
+	}
+
+	*payload_len = (unsigned char)response[*pos + 1];
+	*payload = response + *pos + 2;
+	if (*pos + 2 + *payload_len > len) {
+		return -1;
+	}
+
+	*pos += 2 + *payload_len;
+	return response[*pos - 2 - *payload_len] ? 1 : 0;
+}
+
+/* sends a batch of the UDP or SHM mode and prints the results of its queries, just like one by one */
+static int
+batch_send(int sock, struct sockaddr *sin, socklen_t sinlen, struct shm_client *shm, const char *request, int len)
+{
+	char response[MAX_INPUT_SIZE];
+	const char *payload;
+	int received, count, pos = 2, payload_len, status;
+
+	if (shm->region) {
+		received = shm_request(shm, request, len, response, -1);
+	} else if (sendto(sock, request, len, 0, sin, sinlen) != len) {
+		ERR("Error sending a message.");
+		return 1;
+	} else {
+		received = recvfrom(sock, response, MAX_INPUT_SIZE, 0, NULL, NULL);
+	}
+	if (received < 0) {
+		ERR("Receiving message failed.");
+		return 1;
+	}
+
+	if ((received < 2) || (response[0] != BATCH_RESPONSE)) {
+		/* the whole batch was refused */
+		if (received < 3) {
+			ERR("Unexpected response.");
+			return 1;
+		}
+		printf("ERR:%.*s\n", (unsigned char)response[2], response + 3);
+		return 0;
+	}
+
+	for (count = (unsigned char)response[1]; count; count--) {
+		status = batch_item(response, received, &pos, &payload, &payload_len);
+		if (status < 0) {
+			ERR("Truncated batch response.");
+			return 1;
+		}
+		printf("%s:%.*s\n", status ? "ERR" : "OK", payload_len, payload);
+	}
+
+	return 0;
+}
+
+/* the UDP or SHM mode with batches, up to batch lines of the input are sent in a single request */
+static int
+batch_loop(int sock, struct sockaddr *sin, socklen_t sinlen, struct shm_client *shm, int batch)
+{
+	char line[MAX_INPUT_SIZE], request[MAX_INPUT_SIZE];
+	int len = 0, query_len, limit, next;
+
+	/* a batch has to fit into a datagram, or into a slot of the shared memory */
+	limit = shm->region ? (int)(SHM_SLOT_SIZE - sizeof(uint32_t)) : MAX_INPUT_SIZE - 1;
+
+	while (!exit_application && fgets(line, MAX_INPUT_SIZE, stdin)) {
+		query_len = strcspn(line, "\n");
+		if (!query_len) {
+			continue;
+		}
+		if (query_len > 255) {
+			query_len = 255;
+		}
+
+		next = batch_add(request, len, limit, line, query_len);
+		if (next < 0) {
+			/* the batch is full, the query goes into the next one */
+			if (batch_send(sock, sin, sinlen, shm, request, len)) {
+				return 1;
+			}
+			next = batch_add(request, 0, limit, line, query_len);
+		}
+		len = next;
+
+		if ((unsigned char)request[1] == batch) {
+			if (batch_send(sock, sin, sinlen, shm, request, len)) {
+				return 1;
+			}
+			len = 0;
+		}
+	}
+
+	if (len && batch_send(sock, sin, sinlen, shm, request, len)) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Writes a query into a frame of MAX_FRAME_SIZE bytes. The literals which fit into 63 bits are written
+ * as binary integers, so the server does not parse their digits. Returns the length of the frame.
+ */
+int
+frame_query(char *frame, const char *query, int len)
+{
+	int i = 0, digits, pos = BIN_HEADER_SIZE;
+	uint64_t value;
+	uint32_t length;
+
+	while (i < len) {
+		for (digits = 0; (i + digits < len) && (query[i + digits] >= '0') && (query[i + digits] <= '9'); digits++);
+
+		if (!digits || (digits > 18)) {
+			/* a longer literal stays in decimal */
+			if (!digits) {
+				digits = 1;
+			}
+			memcpy(frame + pos, query + i, digits);
+			pos += digits;
+			i += digits;
+			continue;
+		}
+
+		for (value = 0; digits; digits--, i++) {
+			value = value * 10 + (query[i] - '0');
+		}
+		frame[pos++] = (char)BIN_LITERAL;
+		value = htobe64(value);
+		memcpy(frame + pos, &value, sizeof value);
+		pos += sizeof value;
+	}
+
+	frame[0] = BIN_SOLVE;
+	length = htonl(pos - BIN_HEADER_SIZE);
+	memcpy(frame + 1, &length, sizeof length);
+	return pos;
+}
+
+/*
+ * Receives a whole frame into buf, the bytes following it are kept in buf for the next call.
+ * Returns the length of the frame including its header, 0 if the server disconnected, -1 on error.
+ */
+int
+frame_recv(int sock, char *buf, int size, int *buffered)
+{
+	ssize_t received;
+	uint32_t length;
+	int len = BIN_HEADER_SIZE;
+
+	while (*buffered < len) {
+		received = busy_recvfrom(sock, buf + *buffered, size - *buffered, NULL, NULL);
+		if (received <= 0) {
+			return received;
+		}
+		*buffered += received;
+
+		if (len == BIN_HEADER_SIZE && (*buffered >= BIN_HEADER_SIZE)) {
+			memcpy(&length, buf + 1, sizeof length);
+			len += ntohl(length);
+			if (len > size) {
+				return -1;
+			}
+		}
+	}
+
+	return len;
+}
+
+/* prints a frame the way the server would answer in text */
+static void
+frame_print(const char *frame, int len)
+{
+	uint64_t value;
+
+	if ((frame[0] == BIN_INTEGER) && (len == BIN_HEADER_SIZE + (int)sizeof value)) {
+		memcpy(&value, frame + BIN_HEADER_SIZE, sizeof value);
+		printf("RESULT %llu\n", (unsigned long long)be64toh(value));
+	} else if (frame[0] == BIN_RESULT) {
+		printf("RESULT %.*s\n", len - BIN_HEADER_SIZE, frame + BIN_HEADER_SIZE);
+	} else if (frame[0] == BIN_BYE) {
+		printf("BYE\n");
+	}
+}
+
+/* the TCP mode with binary frames, the lines are sent as frames and the frames are printed as lines */
+static int
+binary_loop(int sock)
+{
+	char line[MAX_INPUT_SIZE], frame[MAX_FRAME_SIZE], buf[MAX_FRAME_SIZE];
+	int len, buffered = 0;
+
+	while (!exit_application && fgets(line, MAX_INPUT_SIZE, stdin)) {
+		if (line[0] == '\n') {
+			continue;
+		}
+
+		if (!strcmp(line, "HELLO\n")) {
+			/* the hello is the only line, it chooses the frames */
+			if ((send(sock, BIN_HELLO, strlen(BIN_HELLO), 0) != (ssize_t)strlen(BIN_HELLO)) ||
+					(busy_recvfrom(sock, buf, MAX_FRAME_SIZE, NULL, NULL) <= 0)) {
+				ERR("Error exchanging the hello.");
+				return 1;
+			}
+			if (strncmp(buf, BIN_HELLO, strlen(BIN_HELLO))) {
+				/* refused */
+				printf("BYE\n");
+				return 0;
+			}
+			printf("HELLO\n");
+			continue;
+		}
+
+		if (!strcmp(line, "BYE\n")) {
+			memset(frame, 0, BIN_HEADER_SIZE);
+			frame[0] = BIN_BYE;
+			len = BIN_HEADER_SIZE;
+		} else if (!strncmp(line, "SOLVE ", strlen("SOLVE "))) {
+			len = frame_query(frame, line + strlen("SOLVE "), strcspn(line + strlen("SOLVE "), "\n"));
+		} else {
+			ERR("Only HELLO, SOLVE and BYE can be sent as frames.");
+			return 1;
+		}
+
+		if (send(sock, frame, len, 0) != len) {
+			ERR("Error sending a message.");
+			return 1;
+		}
+
+		len = frame_recv(sock, buf, MAX_FRAME_SIZE, &buffered);
+		if (len <= 0) {
+			ERR("Receiving message failed.");
+			return 1;
+		}
+		frame_print(buf, len);
+		if (buf[0] == BIN_BYE) {
+			return 0;
+		}
+		memmove(buf, buf + len, buffered - len);
+		buffered -= len;
+	}
+
+	return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
 	int ret = 0, opt = 0, port = 0, sock = -1, mode = 0;
 	const char *host = NULL;
-	struct sockaddr_in sin, *sin_p;
+	struct sockaddr_storage sin;
+	struct sockaddr *sin_p;
 	char send_buf[MAX_INPUT_SIZE] = {0};
 	char recv_buf[MAX_INPUT_SIZE] = {0};
 	ssize_t sent, received, to_send;
-	socklen_t addrlen;
+	socklen_t addrlen, sinlen;
+	struct shm_client shm = {.region = NULL, .server_event = -1, .client_event = -1};
+	struct bench_opts bench = {
+		.concurrency = 1,
+		.batch = 1,
+		.seed = 1,
+		.speed = 1
+	};
 
 	struct option options[] = {
 		{"help", 	no_argument, 		NULL,	'H'},
 		{"host",	required_argument,	NULL,	'h'},
 		{"port",	required_argument,	NULL,	'p'},
 		{"mode",	required_argument,	NULL,	'm'},
+		{"bench",	required_argument,	NULL,	'b'},
+		{"concurrency",	required_argument,	NULL,	'c'},
+		{"seed",	required_argument,	NULL,	's'},
+		{"batch",	required_argument,	NULL,	'n'},
+		{"busy-poll",	required_argument,	NULL,	'y'},
+		{"replay",	required_argument,	NULL,	'r'},
+		{"speed",	required_argument,	NULL,	'x'},
+		{"binary",	no_argument,		NULL,	'B'},
+		{"timestamps",	no_argument,		NULL,	't'},
 		{NULL,		0,					NULL,	0}
 	};
 
-	if (argc != 7) {
+	if (argc < 5) {
 		help_print();
 		goto cleanup;
 	}
 
 	/* parse args */
-	while ((opt = getopt_long(argc, argv, "Hh:p:m:", options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "Hh:p:m:b:c:s:n:By:r:x:t", options, NULL)) != -1) {
 		switch(opt) {
 		case 'H':
 			help_print();
@@ -180,34 +810,106 @@ main(int argc, char *argv[])
 				mode = IP_TCP;
 			} else if (!strcmp(optarg, "UDP")) {
 				mode = IP_UDP;
+			} else if (!strcmp(optarg, "SHM")) {
+				mode = IP_SHM;
 			} else {
-				ERR("Only TCP or UDP modes are allowed.");
+				ERR("Only TCP, UDP or SHM modes are allowed.");
+				ret = 1;
+				goto cleanup;
+			}
+			break;
+		case 'b':
+			bench.requests = atoi(optarg);
+			break;
+		case 'c':
+			bench.concurrency = atoi(optarg);
+			break;
+		case 's':
+			bench.seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'B':
+			bench.binary = 1;
+			break;
+		case 'n':
+			bench.batch = atoi(optarg);
+			if ((bench.batch < 1) || (bench.batch > MAX_BATCH)) {
+				ERR("The batch size has to be between 1 and %d.", MAX_BATCH);
 				ret = 1;
 				goto cleanup;
 			}
 			break;
+		case 'y':
+			busy_poll = atoi(optarg);
+			break;
+		case 'r':
+			bench.replay = optarg;
+			break;
+		case 'x':
+			bench.speed = strtod(optarg, NULL);
+			break;
+		case 't':
+			bench.timestamps = 1;
+			break;
 		default:
 			ret = 1;
 			break;
 		}
 	}
 
+	if (!host || (!port && strncmp(host, UNIX_PREFIX, strlen(UNIX_PREFIX)))) {
+		help_print();
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (bench.replay) {
+		/* replay mode, the requests come from a log captured by a server */
+		bench.host = host;
+		bench.port = port;
+		ret = run_replay(&bench);
+		goto cleanup;
+	}
+
+	if (bench.requests > 0) {
+		/* measurement mode, the requests are generated instead of read */
+		bench.host = host;
+		bench.port = port;
+		bench.mode = mode;
+		ret = run_bench(&bench);
+		goto cleanup;
+	}
+
 	/* initialize the socket for connection */
-	if (init_client(host, port, mode, &sock, &sin)) {
+	if (init_client(host, port, mode, &sock, &sin, &sinlen)) {
 		ERR("Initializing client failed.");
 		ret = 1;
 		goto cleanup;
 	}
 
+	/* get the shared memory of the session */
+	if ((mode == IP_SHM) && shm_connect(sock, &shm)) {
+		ret = 1;
+		goto cleanup;
+	}
+
 	/* set the signal handler */
 	signal(SIGINT, sigint_handler);
 
 	if (mode == IP_TCP) {
 		sin_p = NULL;
 	} else {
-		sin_p = &sin;
+		sin_p = (struct sockaddr *)&sin;
+	}
+	addrlen = sinlen;
+
+	if ((mode == IP_TCP) && bench.binary) {
+		ret = binary_loop(sock);
+		goto cleanup;
+	} else if ((mode != IP_TCP) && (bench.batch > 1)) {
+		/* a TCP client sends its lines as they are, SOLVEN included */
+		ret = batch_loop(sock, sin_p, sinlen, &shm, bench.batch);
+		goto cleanup;
 	}
-	addrlen = sizeof sin;
 
 	while (!exit_application && (fgets(send_buf, MAX_INPUT_SIZE, stdin) != NULL)) {
 		if (send_buf[0] == '\n') {
@@ -221,34 +923,44 @@ main(int argc, char *argv[])
 			to_send = strlen(send_buf) + 2;
 		}
 
-		if (mode == IP_UDP) {
+		if (mode != IP_TCP) {
 			/* convert to the correct format */
 			str_to_bin(send_buf);
 		}
 
-		sent = sendto(sock, send_buf, to_send, 0, (const struct sockaddr *)sin_p, addrlen);
-		if (sent != to_send) {
-			ERR("Error sending a message.");
-			ret = 1;
-			goto cleanup;
-		}
-
-		received = recvfrom(sock, recv_buf, MAX_INPUT_SIZE, 0, (struct sockaddr *)sin_p, &addrlen);
-		if ((received == 0) && (mode == IP_TCP)) {
-			/* connection terminated, send bye */
-			sent = send(sock, "BYE", strlen("BYE"), 0);
-			if (sent != (int)strlen("BYE")) {
-				ERR("Error receiving a message.");
+		if (mode == IP_SHM) {
+			/* the shared memory carries the same messages as a datagram */
+			received = shm_request(&shm, send_buf, to_send, recv_buf, -1);
+			if (received < 0) {
+				ERR("Receiving message failed.");
 				ret = 1;
+				goto cleanup;
+			}
+		} else {
+			sent = sendto(sock, send_buf, to_send, 0, sin_p, addrlen);
+			if (sent != to_send) {
+				ERR("Error sending a message.");
+				ret = 1;
+				goto cleanup;
+			}
+	
+			received = busy_recvfrom(sock, recv_buf, MAX_INPUT_SIZE, sin_p, &addrlen);
+			if ((received == 0) && (mode == IP_TCP)) {
+				/* connection terminated, send bye */
+				sent = send(sock, "BYE", strlen("BYE"), 0);
+				if (sent != (int)strlen("BYE")) {
+					ERR("Error receiving a message.");
+					ret = 1;
+				}
+				goto cleanup;
+			} else if (received < 0) {
+				ERR("Receiving message failed.");
+				ret = 1;
+				goto cleanup;
 			}
-			goto cleanup;
-		} else if (received < 0) {
-			ERR("Receiving message failed.");
-			ret = 1;
-			goto cleanup;
 		}
 
-		if (mode == IP_UDP) {
+		if (mode != IP_TCP) {
 			/* convert response back to readable format */
 			if (!bin_to_str(recv_buf)) {
 				printf("OK:%s\n", recv_buf);
@@ -283,6 +995,7 @@ main(int argc, char *argv[])
 	}
 
 cleanup:
+	shm_disconnect(&shm);
 	if (sock >= 0) {
 		close(sock);
 	}
@@ -9,6 +9,9 @@
 #define _IPK_H_
 
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
 
 #define ERR(format, ...) fprintf(stderr, "[ERR]: " format "\n", ##__VA_ARGS__);
 
@@ -16,9 +19,187 @@
 
 #define MAX_PORT 65535
 
+/* the opcodes of the batch datagrams, carrying many queries in one */
+#define BATCH_REQUEST 2
+
+#define BATCH_RESPONSE 3
+
+/* maximum number of queries in a single batch */
+#define MAX_BATCH 64
+
+/* the binary frames of the TCP mode chosen by the hello, they have to match the ones of the server */
+#define BIN_HELLO "HELLO BIN\n"
+
+#define BIN_HEADER_SIZE 5
+
+#define BIN_SOLVE 0
+
+#define BIN_RESULT 1
+
+#define BIN_BYE 2
+
+#define BIN_INTEGER 3
+
+#define BIN_LITERAL 0xff
+
+/* a binary literal takes 9 bytes, so a query of a line may grow up to five times in its frame */
+#define MAX_FRAME_SIZE (5 * MAX_INPUT_SIZE + BIN_HEADER_SIZE)
+
+/* a host with this prefix is a path of a unix socket */
+#define UNIX_PREFIX "unix:"
+
+/* delay between starting two connection attempts to different addresses (RFC 8305) */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+/* upper bound on the time spent connecting to the server */
+#define CONNECT_TIMEOUT_MS 5000
+
+/* maximum number of resolved addresses that are tried */
+#define MAX_CONNECT_ATTEMPTS 16
+
+/* the layout of the shared memory, it has to match the one of the server */
+#define SHM_HELLO "SHM\n"
+
+#define SHM_MAGIC 0x49504b53
+
+#define SHM_RING_SLOTS 64
+
+#define SHM_SLOT_SIZE 512
+
+#define SHM_CACHE_LINE 64
+
+/* number of polls of the response ring before going to sleep, only with more than one CPU */
+#define SHM_SPIN 4096
+
+/* then the CPU is yielded this many times, which lets the other side run without a wakeup */
+#define SHM_YIELDS 8
+
+/* a busy polled socket found empty is read again this many times, only with more than one CPU */
+#define BUSY_POLL_SPINS 4096
+
+/* then the CPU is yielded this many times, before the client blocks in the receive */
+#define BUSY_POLL_YIELDS 64
+
+/* the log captured by the server, it has to match the one of the server */
+#define CAPTURE_MAGIC "IPKCAP1\n"
+
+#define CAPTURE_OPEN 0
+
+#define CAPTURE_DATA 1
+
+#define CAPTURE_CLOSE 2
+
+/* the most connections and UDP clients of a log replayed at once */
+#define REPLAY_MAX_FLOWS 1024
+
+/* once the log is sent, the responses are waited for until none comes for this long */
+#define REPLAY_DRAIN_MS 1000
+
+/* a NIC may stamp a sent message after its response came, the stamp is waited for this long */
+#define STAMP_TX_WAIT_MS 1
+
 typedef enum {
 	IP_TCP,
-	IP_UDP
+	IP_UDP,
+	IP_SHM
 } protocol_type;
 
+struct shm_slot {
+	uint32_t len;
+	char data[SHM_SLOT_SIZE - sizeof(uint32_t)];
+};
+
+struct shm_ring {
+	_Alignas(SHM_CACHE_LINE) atomic_uint head;
+	_Alignas(SHM_CACHE_LINE) atomic_uint tail;
+	_Alignas(SHM_CACHE_LINE) struct shm_slot slots[SHM_RING_SLOTS];
+};
+
+struct shm_region {
+	uint32_t magic;
+	uint32_t size;
+	_Alignas(SHM_CACHE_LINE) atomic_int server_waiting;
+	_Alignas(SHM_CACHE_LINE) atomic_int client_waiting;
+	struct shm_ring requests;
+	struct shm_ring responses;
+};
+
+/* the header of a record of the log, the fields are little endian and the time is in nanoseconds */
+struct capture_record {
+	uint64_t time;
+	uint32_t conn;
+	uint16_t len;
+	uint8_t mode;
+	uint8_t event;
+};
+
+/* the stamps of a message in nanoseconds, the software one in CLOCK_REALTIME, 0 if it was not stamped */
+struct stamp {
+	unsigned long long sw;
+	unsigned long long hw;
+};
+
+/* a session with a server over the shared memory */
+struct shm_client {
+	int sock;
+	int server_event;
+	int client_event;
+	int spin;
+	struct shm_region *region;
+};
+
+/* parameters of the measurement mode */
+struct bench_opts {
+	const char *host;
+	int port;
+	protocol_type mode;
+	int requests;
+	int concurrency;
+	int batch;
+	int binary;
+	int timestamps;
+	unsigned int seed;
+	const char *replay;
+	double speed;
+};
+
+/* microseconds the kernel polls a socket for, busy polling is off with 0 */
+extern int busy_poll;
+
+ssize_t busy_recvfrom(int sock, void *buf, size_t len, struct sockaddr *sa, socklen_t *salen);
+
+extern _Thread_local struct stamp stamp_rx;
+
+int stamp_enable(int sock);
+
+ssize_t stamp_recvmsg(int sock, struct msghdr *msg, int flags);
+
+int stamp_tx(int sock, unsigned int id, struct stamp *stamp);
+
+long long stamp_diff(const struct stamp *sent, const struct stamp *received, int *hardware);
+
+int init_client(const char *host, int port, protocol_type mode, int *sock, struct sockaddr_storage *sin, socklen_t *sinlen);
+
+void str_to_bin(char request[MAX_INPUT_SIZE]);
+
+int bin_to_str(char resp[MAX_INPUT_SIZE]);
+
+int batch_add(char *request, int len, int limit, const char *query, int query_len);
+
+int batch_item(const char *response, int len, int *pos, const char **payload, int *payload_len);
+
+int frame_query(char *frame, const char *query, int len);
+
+int frame_recv(int sock, char *buf, int size, int *buffered);
+
+int run_bench(const struct bench_opts *opts);
+
+int run_replay(const struct bench_opts *opts);
+
+int shm_connect(int sock, struct shm_client *shm);
+
+int shm_request(struct shm_client *shm, const char *request, int len, char response[MAX_INPUT_SIZE], int timeout_ms);
+
+void shm_disconnect(struct shm_client *shm);
+
 #endif
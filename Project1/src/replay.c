@@ -0,0 +1,283 @@
+/*
+ * File: replay.c
+ * Desc: Replay mode of the client, sends the requests captured by a server again
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ipk.h"
+
+extern volatile int exit_application;
+
+/* a captured TCP connection or all the datagrams of a single UDP client */
+struct replay_flow {
+	uint32_t conn;
+	protocol_type mode;
+	struct sockaddr_storage sin;
+	socklen_t sinlen;
+};
+
+/* the flows which are open, the socket of a flow is in the poll set at the same index */
+struct replay {
+	const struct bench_opts *opts;
+	struct replay_flow flows[REPLAY_MAX_FLOWS];
+	struct pollfd fds[REPLAY_MAX_FLOWS];
+	int count;
+	long records;
+	long sent;
+	long errors;
+	unsigned long long received;
+	unsigned long long max_lag;
+	char request[UINT16_MAX + 1];
+	char response[UINT16_MAX + 1];
+};
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+flow_close(struct replay *r, int i)
+{
+	close(r->fds[i].fd);
+
+	/* the last flow takes the place of the closed one */
+	r->count--;
+	r->flows[i] = r->flows[r->count];
+	r->fds[i] = r->fds[r->count];
+}
+
+/* finds the open flow of a record, a new one is connected if create is set, returns its index or -1 */
+static int
+flow_get(struct replay *r, uint32_t conn, protocol_type mode, int create)
+{
+	int i, sock;
+
+	for (i = 0; i < r->count; i++) {
+		if ((r->flows[i].conn == conn) && (r->flows[i].mode == mode)) {
+			return i;
+		}
+	}
+
+	if (!create) {
+		return -1;
+	} else if (r->count == REPLAY_MAX_FLOWS) {
+		ERR("Too many flows replayed at once.");
+		return -1;
+	}
+
+	if (init_client(r->opts->host, r->opts->port, mode, &sock, &r->flows[i].sin, &r->flows[i].sinlen)) {
+		return -1;
+	}
+
+	r->flows[i].conn = conn;
+	r->flows[i].mode = mode;
+	r->fds[i].fd = sock;
+	r->fds[i].events = POLLIN;
+	r->count++;
+	return i;
+}
+
+/* reads and drops the responses which came until the given time, returns -1 on error */
+static int
+replay_wait(struct replay *r, unsigned long long until)
+{
+	struct timespec ts;
+	unsigned long long now;
+	ssize_t received;
+	int i, ready;
+
+	do {
+		now = now_ns();
+		ts.tv_sec = (until > now) ? (until - now) / 1000000000ULL : 0;
+		ts.tv_nsec = (until > now) ? (until - now) % 1000000000ULL : 0;
+
+		ready = ppoll(r->fds, r->count, &ts, NULL);
+		if (ready < 0) {
+			if (errno == EINTR) {
+				return exit_application ? -1 : 0;
+			}
+			ERR("Poll failed (%s).", strerror(errno));
+			return -1;
+		}
+
+		for (i = r->count - 1; ready && (i >= 0); i--) {
+			if (!r->fds[i].revents) {
+				continue;
+			}
+			ready--;
+
+			received = recv(r->fds[i].fd, r->response, sizeof r->response, MSG_DONTWAIT);
+			if (received > 0) {
+				r->received += received;
+			} else if (!received && (r->flows[i].mode == IP_TCP)) {
+				/* the server ended the connection */
+				flow_close(r, i);
+			} else if ((received < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				r->errors++;
+				flow_close(r, i);
+			}
+		}
+	} while (now < until);
+
+	return 0;
+}
+
+/* sends the data of a record, while the socket is full the responses are read, so neither side gets stuck */
+static int
+replay_send(struct replay *r, int i, int len)
+{
+	struct replay_flow *flow = &r->flows[i];
+	uint32_t conn = flow->conn;
+	protocol_type mode = flow->mode;
+	ssize_t sent;
+	int done = 0, sock = r->fds[i].fd;
+
+	while (done < len) {
+		sent = sendto(sock, r->request + done, len - done, MSG_DONTWAIT | MSG_NOSIGNAL,
+				(flow->mode == IP_TCP) ? NULL : (struct sockaddr *)&flow->sin, (flow->mode == IP_TCP) ? 0 : flow->sinlen);
+		if ((sent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+			if (replay_wait(r, now_ns() + 1000000ULL)) {
+				return -1;
+			}
+
+			/* the flow may have moved or been closed by the server meanwhile */
+			i = flow_get(r, conn, mode, 0);
+			if (i < 0) {
+				return -1;
+			}
+			flow = &r->flows[i];
+			sock = r->fds[i].fd;
+			continue;
+		} else if (sent < 0) {
+			return -1;
+		}
+		done += sent;
+	}
+
+	return 0;
+}
+
+/*
+ * Replays a log captured by a server against the given server. Every record is sent at its captured time
+ * divided by the speed, or right away with the speed 0, over the connection or the UDP socket of its flow.
+ * The responses are read and counted, but not checked. Prints how far the replay fell behind the schedule.
+ */
+int
+run_replay(const struct bench_opts *opts)
+{
+	struct replay *r;
+	struct capture_record record;
+	char magic[sizeof CAPTURE_MAGIC - 1];
+	unsigned long long start, first = 0, due, now, elapsed;
+	FILE *log;
+	int i, len, ret = 0;
+
+	if (opts->speed < 0) {
+		ERR("Invalid replay speed.");
+		return 1;
+	}
+
+	log = fopen(opts->replay, "r");
+	if (!log) {
+		ERR("Opening the log \"%s\" failed (%s).", opts->replay, strerror(errno));
+		return 1;
+	}
+
+	r = calloc(1, sizeof *r);
+	if (!r) {
+		ERR("Memory allocation error.");
+		ret = 1;
+		goto cleanup;
+	}
+	r->opts = opts;
+
+	if ((fread(magic, 1, sizeof magic, log) != sizeof magic) || memcmp(magic, CAPTURE_MAGIC, sizeof magic)) {
+		ERR("\"%s\" is not a captured log.", opts->replay);
+		ret = 1;
+		goto cleanup;
+	}
+
+	start = now_ns();
+	while (!exit_application && (fread(&record, sizeof record, 1, log) == 1)) {
+		len = le16toh(record.len);
+		if (fread(r->request, 1, len, log) != (size_t)len) {
+			ERR("The log is truncated.");
+			break;
+		}
+
+		/* the replay starts with the first record */
+		if (!r->records++) {
+			first = le64toh(record.time);
+		}
+		due = start;
+		if (opts->speed > 0) {
+			due += (le64toh(record.time) - first) / opts->speed;
+		}
+
+		if (replay_wait(r, due)) {
+			ret = 1;
+			break;
+		}
+		now = now_ns();
+		if (now - due > r->max_lag) {
+			r->max_lag = now - due;
+		}
+
+		i = flow_get(r, le32toh(record.conn), record.mode, record.event != CAPTURE_CLOSE);
+		if (record.event == CAPTURE_DATA) {
+			if ((i < 0) || replay_send(r, i, len)) {
+				r->errors++;
+			} else {
+				r->sent++;
+			}
+		} else if ((record.event == CAPTURE_CLOSE) && (i >= 0)) {
+			/* the responses still come until the server closes the connection as well */
+			shutdown(r->fds[i].fd, SHUT_WR);
+		}
+	}
+	elapsed = now_ns() - start;
+
+	/* the last responses, the UDP flows and the connections the server keeps open end once nothing comes */
+	while (r->count && !exit_application) {
+		len = r->count;
+		now = r->received;
+		if (replay_wait(r, now_ns() + REPLAY_DRAIN_MS * 1000000ULL) || ((len == r->count) && (now == r->received))) {
+			break;
+		}
+	}
+
+	printf("mode=replay speed=%.2f records=%ld sent=%ld errors=%ld received_bytes=%llu rps=%.1f max_lag_us=%.1f\n",
+			opts->speed, r->records, r->sent, r->errors, r->received, r->sent / (elapsed / 1e9), r->max_lag / 1e3);
+
+	if (r->errors) {
+		ret = 1;
+	}
+
+cleanup:
+	if (r) {
+		while (r->count) {
+			flow_close(r, r->count - 1);
+		}
+	}
+	free(r);
+	fclose(log);
+	return ret;
+}
@@ -0,0 +1,294 @@
+/*
+ * File: shm.c
+ * Desc: Shared memory transport of the client, for a server running on the same host
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ipk.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHM_RELAX() __builtin_ia32_pause()
+#else
+#define SHM_RELAX()
+#endif
+
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* returns the oldest message of a ring, NULL if it is empty */
+static struct shm_slot *
+ring_peek(struct shm_ring *ring)
+{
+	unsigned int tail;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+		return NULL;
+	}
+
+	return &ring->slots[tail & (SHM_RING_SLOTS - 1)];
+}
+
+static void
+ring_pop(struct shm_ring *ring)
+{
+	atomic_store_explicit(&ring->tail, atomic_load_explicit(&ring->tail, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/* returns the slot for a new message, NULL if the ring is full */
+static struct shm_slot *
+ring_reserve(struct shm_ring *ring)
+{
+	unsigned int head;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= SHM_RING_SLOTS) {
+		return NULL;
+	}
+
+	return &ring->slots[head & (SHM_RING_SLOTS - 1)];
+}
+
+static void
+ring_push(struct shm_ring *ring)
+{
+	atomic_store_explicit(&ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/* wakes up the server if it is sleeping, called after every change of a ring */
+static void
+shm_wake(struct shm_client *shm)
+{
+	uint64_t one = 1;
+
+	/* pairs with the fence of the sleeping side, either it sees the change or this sees its flag */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&shm->region->server_waiting, memory_order_relaxed)) {
+		if (write(shm->server_event, &one, sizeof one) < 0) {
+			/* the counter can not overflow, the server reads it every time it wakes up */
+			return;
+		}
+	}
+}
+
+/*
+ * Receives the shared memory and the eventfds of a new session from the server,
+ * the socket has to be connected to a server in the SHM mode.
+ * Returns 0 on success, 1 on error.
+ */
+int
+shm_connect(int sock, struct shm_client *shm)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct stat st;
+	char hello[16];
+	int fds[3] = {-1, -1, -1};
+	int i, ret = 1;
+	ssize_t received;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	memset(shm, 0, sizeof *shm);
+	shm->sock = sock;
+	shm->server_event = -1;
+	shm->client_event = -1;
+	shm->spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHM_SPIN : 0;
+
+	memset(&msg, 0, sizeof msg);
+	memset(hello, 0, sizeof hello);
+	iov.iov_base = hello;
+	iov.iov_len = sizeof hello - 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+
+	received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (received < 0) {
+		ERR("Receiving the session failed (%s).", strerror(errno));
+		return 1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS) &&
+			(cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int)))) {
+		memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+	}
+
+	if (strcmp(hello, SHM_HELLO) || (msg.msg_flags & MSG_CTRUNC) || (fds[2] < 0)) {
+		ERR("The server does not offer shared memory.");
+		goto cleanup;
+	}
+
+	if (fstat(fds[0], &st) || (st.st_size < (off_t)sizeof *shm->region)) {
+		ERR("Invalid shared memory of the server.");
+		goto cleanup;
+	}
+
+	shm->region = mmap(NULL, sizeof *shm->region, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (shm->region == MAP_FAILED) {
+		ERR("Mapping shared memory failed (%s).", strerror(errno));
+		shm->region = NULL;
+		goto cleanup;
+	}
+
+	if ((shm->region->magic != SHM_MAGIC) || (shm->region->size != sizeof *shm->region)) {
+		ERR("The shared memory of the server has a different layout.");
+		munmap(shm->region, sizeof *shm->region);
+		shm->region = NULL;
+		goto cleanup;
+	}
+
+	shm->server_event = fds[1];
+	shm->client_event = fds[2];
+	fds[1] = fds[2] = -1;
+	ret = 0;
+
+cleanup:
+	/* the mapping keeps the memory alive */
+	for (i = 0; i < 3; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Sleeps until the server pushes a response or the timeout expires, -1 waits forever.
+ * Returns 1 if the server disconnected or the time ran out, 0 otherwise.
+ */
+static int
+shm_sleep(struct shm_client *shm, long long deadline)
+{
+	struct pollfd fds[2];
+	uint64_t value;
+	int ret = 0, timeout = -1;
+
+	if (deadline >= 0) {
+		timeout = deadline - now_ms();
+		if (timeout <= 0) {
+			return 1;
+		}
+	}
+
+	atomic_store_explicit(&shm->region->client_waiting, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!ring_peek(&shm->region->responses)) {
+		fds[0].fd = shm->client_event;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = shm->sock;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		if ((poll(fds, 2, timeout) < 0) && (errno != EINTR)) {
+			ret = 1;
+		} else if (fds[1].revents) {
+			/* nothing is sent over the socket after the session starts, the server is gone */
+			ERR("The server terminated the session.");
+			ret = 1;
+		} else if ((fds[0].revents & POLLIN) && (read(shm->client_event, &value, sizeof value) < 0)) {
+			ret = 1;
+		}
+	}
+
+	atomic_store_explicit(&shm->region->client_waiting, 0, memory_order_relaxed);
+	return ret;
+}
+
+/*
+ * Sends a request in the UDP format and waits for its response, which is stored in the UDP format as well.
+ * Returns the length of the response, -1 on error or if it did not arrive within the timeout.
+ */
+int
+shm_request(struct shm_client *shm, const char *request, int len, char response[MAX_INPUT_SIZE], int timeout_ms)
+{
+	struct shm_slot *slot;
+	long long deadline = -1;
+	uint32_t resp_len;
+	int spin = 0;
+
+	if (timeout_ms >= 0) {
+		deadline = now_ms() + timeout_ms;
+	}
+
+	/* drop the late responses of the requests which timed out */
+	while (ring_peek(&shm->region->responses)) {
+		ring_pop(&shm->region->responses);
+	}
+
+	slot = ring_reserve(&shm->region->requests);
+	if (!slot || (len > (int)sizeof slot->data)) {
+		return -1;
+	}
+
+	memcpy(slot->data, request, len);
+	slot->len = len;
+	ring_push(&shm->region->requests);
+	shm_wake(shm);
+
+	while (!(slot = ring_peek(&shm->region->responses))) {
+		if (spin < shm->spin) {
+			SHM_RELAX();
+			spin++;
+		} else if (spin < shm->spin + SHM_YIELDS) {
+			sched_yield();
+			spin++;
+		} else if (shm_sleep(shm, deadline)) {
+			return -1;
+		}
+	}
+
+	resp_len = slot->len;
+	if (resp_len > sizeof slot->data) {
+		resp_len = sizeof slot->data;
+	}
+	memcpy(response, slot->data, resp_len);
+	ring_pop(&shm->region->responses);
+	shm_wake(shm);
+
+	return resp_len;
+}
+
+void
+shm_disconnect(struct shm_client *shm)
+{
+	if (shm->region) {
+		munmap(shm->region, sizeof *shm->region);
+		shm->region = NULL;
+	}
+	if (shm->server_event >= 0) {
+		close(shm->server_event);
+		shm->server_event = -1;
+	}
+	if (shm->client_event >= 0) {
+		close(shm->client_event);
+		shm->client_event = -1;
+	}
+}
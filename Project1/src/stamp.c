@@ -0,0 +1,158 @@
+/*
+ * File: stamp.c
+ * Desc: Kernel and NIC timestamps of the sent and received messages, for the measurement mode
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+/* struct scm_timestamping of linux/errqueue.h needs struct timespec */
+#include <time.h>
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "ipk.h"
+
+/* the stamps of the data the calling thread received last */
+_Thread_local struct stamp stamp_rx;
+
+/*
+ * Asks the kernel to stamp the messages of a connected socket when they leave and when they arrive.
+ * The software stamps are taken by the kernel next to the device driver, the hardware ones by the NIC,
+ * if its timestamping was turned on by the administrator. The sent messages are numbered from 0,
+ * a TCP stream numbers its bytes instead.
+ */
+int
+stamp_enable(int sock)
+{
+	int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+			SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+			SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof flags)) {
+		ERR("Enabling the timestamps failed (%s).", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static unsigned long long
+stamp_ns(const struct timespec *ts)
+{
+	return (unsigned long long)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/* reads the stamps from the control messages of a received message, returns the id of a sent one or -1 */
+static long long
+stamp_parse(struct msghdr *msg, struct stamp *stamp)
+{
+	struct scm_timestamping *tss;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	long long id = -1;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPING)) {
+			tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+			stamp->sw = stamp_ns(&tss->ts[0]);
+			stamp->hw = stamp_ns(&tss->ts[2]);
+		} else if (((cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+				((cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))) {
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if ((serr->ee_errno == ENOMSG) && (serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING)) {
+				id = serr->ee_data;
+			}
+		}
+	}
+
+	return id;
+}
+
+/* receives like recvmsg() and keeps the stamps of the message in stamp_rx */
+ssize_t
+stamp_recvmsg(int sock, struct msghdr *msg, int flags)
+{
+	char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	ssize_t received;
+
+	msg->msg_control = control;
+	msg->msg_controllen = sizeof control;
+
+	received = recvmsg(sock, msg, flags);
+	if (received > 0) {
+		stamp_parse(msg, &stamp_rx);
+	}
+
+	msg->msg_control = NULL;
+	msg->msg_controllen = 0;
+	return received;
+}
+
+/*
+ * Finds the stamps of the sent message with the given id in the error queue of the socket, the older ones
+ * are dropped. A NIC may stamp the message after the response came, so its stamp is waited for a while.
+ * Returns 0 on success, -1 if the message was not stamped.
+ */
+int
+stamp_tx(int sock, unsigned int id, struct stamp *stamp)
+{
+	char control[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) +
+			sizeof(struct sockaddr_in6))], data[1];
+	struct iovec iov = {.iov_base = data, .iov_len = sizeof data};
+	struct msghdr msg;
+	struct pollfd pfd = {.fd = sock, .events = POLLERR};
+	long long found;
+	int waited = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (((errno != EAGAIN) && (errno != EWOULDBLOCK)) || waited) {
+				return -1;
+			}
+			/* the error queue is only polled, nothing else wakes it */
+			waited = 1;
+			if (poll(&pfd, 1, STAMP_TX_WAIT_MS) <= 0) {
+				return -1;
+			}
+			continue;
+		}
+
+		memset(stamp, 0, sizeof *stamp);
+		found = stamp_parse(&msg, stamp);
+		if (found == id) {
+			return 0;
+		} else if ((found > id) && (found - id < (1LL << 31))) {
+			/* the message itself was not stamped */
+			return -1;
+		}
+	}
+}
+
+/* the time between the stamps of two messages, in the clock of the NIC if both have it, -1 without stamps */
+long long
+stamp_diff(const struct stamp *sent, const struct stamp *received, int *hardware)
+{
+	*hardware = sent->hw && received->hw;
+	if (*hardware) {
+		return received->hw - sent->hw;
+	} else if (sent->sw && received->sw) {
+		return received->sw - sent->sw;
+	}
+
+	return -1;
+}
@@ -0,0 +1,54 @@
+/*
+ * File: alloc_count.c
+ * Desc: Preloaded into the server by the tests, counts its heap allocations
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_ulong allocations;
+
+void *
+malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+/* the count is written to the file named by ALLOC_COUNT_FILE once the process exits */
+__attribute__((destructor)) static void
+alloc_count_write(void)
+{
+	const char *path = getenv("ALLOC_COUNT_FILE");
+	FILE *file;
+
+	if (!path || !(file = fopen(path, "w"))) {
+		return;
+	}
+
+	fprintf(file, "%lu\n", atomic_load(&allocations));
+	fclose(file);
+}
@@ -0,0 +1,100 @@
+#!/bin/bash
+#
+# Runs a server, measures it with a fixed-seed workload of the client and compares
+# the throughput and the 99th percentile latency against the stored baseline.
+# A single run is noisy, so the test passes if any of the attempts is within the tolerance
+# and a new baseline is the median of all the attempts. Without a baseline the test is skipped.
+#
+# usage: perf.sh <name> <ipkpd> <ipkcpc> <mode> <concurrency> <address> <requests> <results> <baseline> <tolerance> <update>
+#
+# The address is either a port on the loopback or unix:<path> of a unix socket.
+
+name=$1
+ipkpd=$2
+ipkcpc=$3
+mode=$4
+concurrency=$5
+address=$6
+requests=$7
+results=$8
+baseline=$9
+tolerance=${10}
+update=${11}
+
+attempts=3
+
+case $address in
+unix:*)
+    server="-h $address"
+    ;;
+*)
+    server="-h 127.0.0.1 -p $address"
+    ;;
+esac
+
+# measures the server once, prints "<rps> <p99>"
+measure() {
+    $ipkpd $server -m $mode -l error &
+    pid=$!
+    sleep 0.2
+
+    out=$($ipkcpc $server -m $mode -b $requests -c $concurrency -s 1)
+    ret=$?
+    kill -9 $pid
+    wait $pid 2>/dev/null
+
+    echo "$out" >&2
+    if [ $ret -ne 0 ] || [ -z "$out" ]; then
+        return 1
+    fi
+
+    echo "$name $out" >> $results
+    echo "$out" | sed -n 's/.* rps=\([0-9.]*\).* p99_us=\([0-9.]*\).*/\1 \2/p'
+}
+
+case $update in
+ON|on|TRUE|true|1)
+    for i in $(seq $attempts); do
+        measure || { echo "measurement failed"; exit 1; }
+    done > $results.$name
+
+    # replace the baseline of this test with the medians
+    rps=$(cut -d' ' -f1 $results.$name | sort -n | sed -n "$(( (attempts + 1) / 2 ))p")
+    p99=$(cut -d' ' -f2 $results.$name | sort -n | sed -n "$(( (attempts + 1) / 2 ))p")
+    rm -f $results.$name
+
+    touch $baseline
+    sed -i "/^$name /d" $baseline
+    echo "$name $rps $p99" >> $baseline
+    sort -o $baseline $baseline
+    exit 0
+    ;;
+esac
+
+line=$(grep "^$name " $baseline 2>/dev/null)
+
+# the numbers of another machine say nothing, the test is skipped until this one records its own
+if [ -z "$line" ]; then
+    echo "no baseline for $name in $baseline, record one with PERF_UPDATE_BASELINE"
+    exit 77
+fi
+
+for i in $(seq $attempts); do
+    metrics=$(measure) || { echo "measurement failed"; exit 1; }
+
+    echo "baseline: $line, tolerance: $tolerance"
+    echo "$line" | awk -v rps=${metrics% *} -v p99=${metrics#* } -v tol=$tolerance '{
+        ret = 0
+        if (rps < $2 * (1 - tol)) {
+            printf "throughput regressed: %.1f < %.1f req/s\n", rps, $2
+            ret = 1
+        }
+        if (p99 > $3 * (1 + tol)) {
+            printf "p99 latency regressed: %.1f > %.1f us\n", p99, $3
+            ret = 1
+        }
+        exit ret
+    }' && exit 0
+done
+
+exit 1
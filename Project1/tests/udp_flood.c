@@ -0,0 +1,101 @@
+/*
+ * File: udp_flood.c
+ * Desc: Sends UDP batches faster than the server solves them, every response has to be well formed
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* the opcodes of the protocol */
+#define FLOOD_RESPONSE 1
+#define FLOOD_BATCH_REQUEST 2
+#define FLOOD_BATCH_RESPONSE 3
+
+/* the items of a batch and the query every item carries */
+#define FLOOD_ITEMS 5
+#define FLOOD_QUERY "(* (* (* 9999999999999999999999999 9999999999999999999999999) (* 9999999999999999999999999 9999999999999999999999999)) (* (* 9999999999999999999999999 9999999999999999999999999) (* 9999999999999999999999999 9999999999999999999999999)))"
+
+/* the error the server answers a rejected request with */
+#define FLOOD_REJECTED "Server overloaded.\n"
+
+/* how long the responses are waited for once everything was sent */
+#define FLOOD_WAIT_MS 1000
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in sa;
+	struct pollfd pfd;
+	char request[2048], response[2048];
+	long count, i, batches = 0, rejected = 0, malformed = 0;
+	int sock, len, pos = 2, bufsize = 4 << 20;
+	ssize_t received;
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: %s <address> <port> <batches>\n", argv[0]);
+		return 1;
+	}
+	count = atol(argv[3]);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(atoi(argv[2]));
+	if (inet_pton(AF_INET, argv[1], &sa.sin_addr) != 1) {
+		fprintf(stderr, "Invalid address \"%s\".\n", argv[1]);
+		return 1;
+	}
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((sock < 0) || connect(sock, (struct sockaddr *)&sa, sizeof sa)) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof bufsize);
+
+	request[0] = FLOOD_BATCH_REQUEST;
+	request[1] = FLOOD_ITEMS;
+	for (i = 0; i < FLOOD_ITEMS; i++) {
+		len = strlen(FLOOD_QUERY);
+		request[pos++] = len;
+		memcpy(request + pos, FLOOD_QUERY, len);
+		pos += len;
+	}
+
+	/* nothing is read until all the batches are sent, the server has to queue or reject them */
+	for (i = 0; i < count; i++) {
+		send(sock, request, pos, 0);
+	}
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, FLOOD_WAIT_MS) > 0) {
+		received = recv(sock, response, sizeof response, 0);
+		if (received < 0) {
+			break;
+		}
+
+		if ((received >= 2) && (response[0] == FLOOD_BATCH_RESPONSE) && (response[1] == FLOOD_ITEMS)) {
+			batches++;
+		} else if ((received == 3 + (ssize_t)strlen(FLOOD_REJECTED)) && (response[0] == FLOOD_RESPONSE) &&
+				(response[1] == 1) && (response[2] == (char)strlen(FLOOD_REJECTED)) &&
+				!memcmp(response + 3, FLOOD_REJECTED, strlen(FLOOD_REJECTED))) {
+			rejected++;
+		} else {
+			malformed++;
+		}
+	}
+
+	close(sock);
+	printf("batches=%ld rejected=%ld malformed=%ld\n", batches, rejected, malformed);
+	return (!batches || !rejected || malformed) ? 1 : 0;
+}
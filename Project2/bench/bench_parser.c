@@ -0,0 +1,623 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: bench_parser.c
+ * Desc: Microbenchmarks of the parser and the evaluator
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parser.h"
+#include "server.h"
+#include "simd.h"
+
+/* the queries of a batch in the batch benchmarks, the most the client sends at once */
+#define BENCH_BATCH 64
+
+/* the real allocator of glibc */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static struct {
+	int enabled;
+	unsigned long long allocs;
+	unsigned long long bytes;
+} alloc_stats;
+
+struct bench_opts {
+	int depth;
+	int width;
+	int digits;
+	int count;
+	int iterations;
+	int shapes;
+	unsigned int seed;
+};
+
+/* the generated expressions */
+struct corpus {
+	int count;
+	char **expressions;
+	char **queries;
+	char **requests;
+	int *request_lens;
+	struct node **trees;
+};
+
+struct bench_result {
+	unsigned long long ops;
+	unsigned long long ns;
+	unsigned long long allocs;
+	unsigned long long bytes;
+};
+
+/* counting allocator hooks, the parser allocates through these */
+void *
+malloc(size_t size)
+{
+	if (alloc_stats.enabled) {
+		alloc_stats.allocs++;
+		alloc_stats.bytes += size;
+	}
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	if (alloc_stats.enabled) {
+		alloc_stats.allocs++;
+		alloc_stats.bytes += nmemb * size;
+	}
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (alloc_stats.enabled) {
+		alloc_stats.allocs++;
+		alloc_stats.bytes += size;
+	}
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+bench_start(struct bench_result *res)
+{
+	memset(res, 0, sizeof *res);
+	alloc_stats.allocs = 0;
+	alloc_stats.bytes = 0;
+	alloc_stats.enabled = 1;
+	res->ns = now_ns();
+}
+
+static void
+bench_stop(struct bench_result *res, unsigned long long ops)
+{
+	res->ns = now_ns() - res->ns;
+	alloc_stats.enabled = 0;
+	res->ops = ops;
+	res->allocs = alloc_stats.allocs;
+	res->bytes = alloc_stats.bytes;
+}
+
+static void
+bench_print(const char *name, const struct bench_result *res)
+{
+	if (!res->ops) {
+		printf("%-20s %12s\n", name, "skipped");
+		return;
+	}
+
+	printf("%-20s %12llu %12.1f %12.2f %12.1f\n", name, res->ops, (double)res->ns / res->ops,
+			(double)res->allocs / res->ops, (double)res->bytes / res->ops);
+}
+
+/*
+ * Results of the generated expressions are kept below this. While the literals fit into a machine word,
+ * so do all the results, which measures the fast path. Longer literals measure the arbitrary precision.
+ */
+static long double value_max;
+
+/* appends a random literal, its value is returned, approximately for the long ones */
+static long double
+gen_literal(char **pos, int digits)
+{
+	long double value = 0;
+	int i, digit;
+
+	for (i = 0; i < digits; i++) {
+		/* no leading zeroes, no zero literals */
+		digit = (i ? 0 : 1) + rand() % (i ? 10 : 9);
+		value = value * 10 + digit;
+		*(*pos)++ = '0' + digit;
+	}
+
+	return value;
+}
+
+/*
+ * Appends a random expression with the given number of leaves, which is at most depth levels deep.
+ * The operators are picked so that no intermediate result is negative, exceeds value_max or divides
+ * by zero, to measure the successful path. Returns the value of the expression.
+ */
+static long double
+gen_expr(char **pos, int leaves, int depth, int digits)
+{
+	long double left, right;
+	long long max_leaves;
+	int left_leaves, lo, hi;
+	char op, *op_pos;
+
+	if (leaves == 1) {
+		return gen_literal(pos, digits);
+	}
+
+	/* split the leaves so that both subtrees fit into the remaining depth */
+	max_leaves = (depth - 2 >= 30) ? INT_MAX : (1LL << (depth - 2));
+	lo = (leaves - max_leaves > 1) ? leaves - max_leaves : 1;
+	hi = (leaves - 1 < max_leaves) ? leaves - 1 : max_leaves;
+	left_leaves = lo + rand() % (hi - lo + 1);
+
+	*(*pos)++ = '(';
+	op_pos = (*pos)++;
+	*(*pos)++ = ' ';
+	left = gen_expr(pos, left_leaves, depth - 1, digits);
+	*(*pos)++ = ' ';
+	right = gen_expr(pos, leaves - left_leaves, depth - 1, digits);
+	*(*pos)++ = ')';
+
+	op = "+-*/"[rand() % 4];
+	if ((op == '*') && right && (left > value_max / right)) {
+		op = '/';
+	}
+	if ((op == '-') && (left < right)) {
+		op = '/';
+	}
+	if ((op == '+') && (left > value_max - right)) {
+		op = '/';
+	}
+	if ((op == '/') && !right) {
+		op = '*';
+	}
+	*op_pos = op;
+
+	switch (op) {
+	case '+':
+		return left + right;
+	case '-':
+		return left - right;
+	case '*':
+		return left * right;
+	default:
+		return floorl(left / right);
+	}
+}
+
+/* copies an expression with new random literals of the given length, the operators stay the same */
+static void
+gen_same_shape(char *pos, const char *expression, int digits)
+{
+	while (*expression) {
+		if (isdigit(*expression)) {
+			gen_literal(&pos, digits);
+			while (isdigit(*expression)) {
+				expression++;
+			}
+		} else {
+			*pos++ = *expression++;
+		}
+	}
+	*pos = '\0';
+}
+
+static int
+corpus_new(const struct bench_opts *opts, struct corpus *corpus)
+{
+	int i, len;
+	size_t max_len;
+	char *pos;
+
+	srand(opts->seed);
+	value_max = (opts->digits < 19) ? (long double)LLONG_MAX : HUGE_VALL;
+
+	/* every leaf takes up at most digits + 1 characters, every operator 5 */
+	max_len = (size_t)opts->width * (opts->digits + 1) + (size_t)opts->width * 5 + 16;
+
+	corpus->count = opts->count;
+	corpus->expressions = calloc(opts->count, sizeof *corpus->expressions);
+	corpus->queries = calloc(opts->count, sizeof *corpus->queries);
+	corpus->requests = calloc(opts->count, sizeof *corpus->requests);
+	corpus->request_lens = calloc(opts->count, sizeof *corpus->request_lens);
+	corpus->trees = calloc(opts->count, sizeof *corpus->trees);
+	if (!corpus->expressions || !corpus->queries || !corpus->requests || !corpus->request_lens || !corpus->trees) {
+		return -1;
+	}
+
+	for (i = 0; i < opts->count; i++) {
+		corpus->expressions[i] = calloc(1, max_len);
+		corpus->queries[i] = calloc(1, max_len + strlen("SOLVE "));
+		corpus->requests[i] = calloc(1, max_len + 2);
+		if (!corpus->expressions[i] || !corpus->queries[i] || !corpus->requests[i]) {
+			return -1;
+		}
+
+		pos = corpus->expressions[i];
+		if (opts->shapes && (i >= opts->shapes)) {
+			/* the new literals may make the result negative or divide by zero, which the server answers as well */
+			gen_same_shape(pos, corpus->expressions[i % opts->shapes], opts->digits);
+			len = strlen(pos);
+		} else {
+			gen_expr(&pos, opts->width, opts->depth, opts->digits);
+			*pos++ = '\n';
+			len = pos - corpus->expressions[i];
+		}
+
+		/* the TCP query */
+		sprintf(corpus->queries[i], "SOLVE %s", corpus->expressions[i]);
+
+		/* the UDP request, only expressions fitting into its payload are valid */
+		if (len <= 255) {
+			corpus->requests[i][0] = 0;
+			corpus->requests[i][1] = len;
+			memcpy(corpus->requests[i] + 2, corpus->expressions[i], len);
+			corpus->request_lens[i] = len + 2;
+		}
+	}
+
+	return 0;
+}
+
+static void
+corpus_free(struct corpus *corpus)
+{
+	int i;
+
+	for (i = 0; i < corpus->count; i++) {
+		if (corpus->expressions) {
+			free(corpus->expressions[i]);
+		}
+		if (corpus->queries) {
+			free(corpus->queries[i]);
+		}
+		if (corpus->requests) {
+			free(corpus->requests[i]);
+		}
+		if (corpus->trees) {
+			del_tree(corpus->trees[i]);
+		}
+	}
+
+	free(corpus->expressions);
+	free(corpus->queries);
+	free(corpus->requests);
+	free(corpus->request_lens);
+	free(corpus->trees);
+}
+
+static void
+corpus_build_trees(struct corpus *corpus)
+{
+	int i;
+
+	for (i = 0; i < corpus->count; i++) {
+		corpus->trees[i] = NULL;
+		new_tree(corpus->expressions[i], &corpus->trees[i]);
+	}
+}
+
+static void
+corpus_del_trees(struct corpus *corpus)
+{
+	int i;
+
+	for (i = 0; i < corpus->count; i++) {
+		del_tree(corpus->trees[i]);
+		corpus->trees[i] = NULL;
+	}
+}
+
+/* the result of the benchmarked function is accumulated here, so it is not optimized out */
+static volatile long long sink;
+
+static struct num result;
+
+static struct stream_parser parser;
+
+/* solves the UDP queries of a part of the corpus like the server solves a batch, returns their number */
+static int
+bench_batch(struct corpus *corpus, int first, int count)
+{
+	const char *queries[BENCH_BATCH];
+	int lens[BENCH_BATCH], status[BENCH_BATCH], indexes[BENCH_BATCH];
+	long long values[BENCH_BATCH];
+	struct node *tree;
+	int i, n = 0;
+
+	for (i = first; i < first + count; i++) {
+		if (corpus->request_lens[i]) {
+			/* without the LF, which only the expressions have */
+			queries[n] = corpus->expressions[i];
+			lens[n] = corpus->request_lens[i] - 3;
+			indexes[n++] = i;
+		}
+	}
+
+	simd_solve(queries, lens, n, values, status);
+
+	for (i = 0; i < n; i++) {
+		if (status[i] != SIMD_SCALAR) {
+			sink += values[i] + status[i];
+			continue;
+		}
+
+		tree = NULL;
+		if (!new_tree(corpus->expressions[indexes[i]], &tree)) {
+			sink += calculate_answer(tree, &result);
+		}
+		del_tree(tree);
+	}
+
+	return n;
+}
+
+static void
+run(const struct bench_opts *opts, struct corpus *corpus)
+{
+	struct bench_result res;
+	struct node *tree;
+	unsigned long long ops;
+	int i, it;
+
+	printf("%-20s %12s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op", "bytes/op");
+
+	bench_start(&res);
+	for (it = 0; it < opts->iterations; it++) {
+		for (i = 0; i < corpus->count; i++) {
+			sink += tcp_parse_query(corpus->queries[i]);
+		}
+	}
+	bench_stop(&res, (unsigned long long)opts->iterations * corpus->count);
+	bench_print("tcp_parse_query", &res);
+
+	ops = 0;
+	bench_start(&res);
+	for (it = 0; it < opts->iterations; it++) {
+		for (i = 0; i < corpus->count; i++) {
+			if (corpus->request_lens[i]) {
+				sink += udp_parse_request(corpus->requests[i], corpus->request_lens[i]);
+				ops++;
+			}
+		}
+	}
+	bench_stop(&res, ops);
+	bench_print("udp_parse_request", &res);
+
+	/* new_tree and del_tree are measured separately on the whole corpus */
+	memset(&res, 0, sizeof res);
+	for (it = 0; it < opts->iterations; it++) {
+		struct bench_result part;
+
+		bench_start(&part);
+		corpus_build_trees(corpus);
+		bench_stop(&part, corpus->count);
+		res.ns += part.ns;
+		res.ops += part.ops;
+		res.allocs += part.allocs;
+		res.bytes += part.bytes;
+
+		if (it != opts->iterations - 1) {
+			corpus_del_trees(corpus);
+		}
+	}
+	bench_print("new_tree", &res);
+
+	bench_start(&res);
+	for (it = 0; it < opts->iterations; it++) {
+		for (i = 0; i < corpus->count; i++) {
+			sink += calculate_answer(corpus->trees[i], &result);
+		}
+	}
+	bench_stop(&res, (unsigned long long)opts->iterations * corpus->count);
+	bench_print("calculate_answer", &res);
+
+	memset(&res, 0, sizeof res);
+	for (it = 0; it < opts->iterations; it++) {
+		struct bench_result part;
+
+		if (it) {
+			corpus_build_trees(corpus);
+		}
+
+		bench_start(&part);
+		corpus_del_trees(corpus);
+		bench_stop(&part, corpus->count);
+		res.ns += part.ns;
+		res.ops += part.ops;
+	}
+	bench_print("del_tree", &res);
+
+	/* everything the server did with a TCP query before the streaming parser, UDP still does it */
+	bench_start(&res);
+	for (it = 0; it < opts->iterations; it++) {
+		for (i = 0; i < corpus->count; i++) {
+			tree = NULL;
+			if (!tcp_parse_query(corpus->queries[i]) && !new_tree(corpus->queries[i] + strlen("SOLVE "), &tree)) {
+				sink += calculate_answer(tree, &result);
+			}
+			del_tree(tree);
+		}
+	}
+	bench_stop(&res, (unsigned long long)opts->iterations * corpus->count);
+	bench_print("end_to_end", &res);
+
+	/* everything the server does with a TCP query, it is parsed and evaluated in a single pass */
+	bench_start(&res);
+	for (it = 0; it < opts->iterations; it++) {
+		for (i = 0; i < corpus->count; i++) {
+			stream_reset(&parser);
+			stream_feed(&parser, corpus->queries[i], strlen(corpus->queries[i]));
+			sink += num_sign(&parser.result);
+		}
+	}
+	bench_stop(&res, (unsigned long long)opts->iterations * corpus->count);
+	bench_print("stream_feed", &res);
+
+	/* the queries of the UDP batches, the way the server solved them before the lanes, one tree after another */
+	ops = 0;
+	bench_start(&res);
+	for (it = 0; it < opts->iterations; it++) {
+		for (i = 0; i < corpus->count; i++) {
+			if (corpus->request_lens[i]) {
+				tree = NULL;
+				if (!new_tree(corpus->expressions[i], &tree)) {
+					sink += calculate_answer(tree, &result);
+				}
+				del_tree(tree);
+				ops++;
+			}
+		}
+	}
+	bench_stop(&res, ops);
+	bench_print("batch_scalar", &res);
+
+	/* the same queries solved BENCH_BATCH at once, the shapes they share across the lanes */
+	ops = 0;
+	bench_start(&res);
+	for (it = 0; it < opts->iterations; it++) {
+		for (i = 0; i < corpus->count; i += BENCH_BATCH) {
+			ops += bench_batch(corpus, i, (corpus->count - i < BENCH_BATCH) ? corpus->count - i : BENCH_BATCH);
+		}
+	}
+	bench_stop(&res, ops);
+	bench_print("batch_simd", &res);
+}
+
+static void
+help_print()
+{
+	printf("Usage: ./bench_parser [options]\n");
+	printf("Microbenchmarks of the IPK Calculator Protocol parser and evaluator.\n");
+	printf("Available options:\n");
+	printf("\t--help [-H] \t\tDisplays this message.\n");
+	printf("\t--depth [-d] \t\tMaximum depth of an expression tree (default 8).\n");
+	printf("\t--width [-w] \t\tNumber of literals in an expression (default 16).\n");
+	printf("\t--digits [-D] \t\tNumber of digits of a literal (default 3).\n");
+	printf("\t--count [-c] \t\tNumber of expressions in the corpus (default 1000).\n");
+	printf("\t--iterations [-i] \tNumber of passes over the corpus (default 100).\n");
+	printf("\t--seed [-s] \t\tSeed of the generator (default 1).\n");
+	printf("\t--shapes [-S] \t\tNumber of the shapes the expressions share, 0 for a shape of every one (default 0).\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ret = 0, opt;
+	struct corpus corpus = {0};
+	struct bench_opts opts = {
+		.depth = 8,
+		.width = 16,
+		.digits = 3,
+		.count = 1000,
+		.iterations = 100,
+		.seed = 1
+	};
+
+	struct option options[] = {
+		{"help",		no_argument,		NULL,	'H'},
+		{"depth",		required_argument,	NULL,	'd'},
+		{"width",		required_argument,	NULL,	'w'},
+		{"digits",		required_argument,	NULL,	'D'},
+		{"count",		required_argument,	NULL,	'c'},
+		{"iterations",	required_argument,	NULL,	'i'},
+		{"seed",		required_argument,	NULL,	's'},
+		{"shapes",		required_argument,	NULL,	'S'},
+		{NULL,			0,					NULL,	0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "Hd:w:D:c:i:s:S:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'H':
+			help_print();
+			goto cleanup;
+		case 'd':
+			opts.depth = atoi(optarg);
+			break;
+		case 'w':
+			opts.width = atoi(optarg);
+			break;
+		case 'D':
+			opts.digits = atoi(optarg);
+			break;
+		case 'c':
+			opts.count = atoi(optarg);
+			break;
+		case 'i':
+			opts.iterations = atoi(optarg);
+			break;
+		case 's':
+			opts.seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			opts.shapes = atoi(optarg);
+			break;
+		default:
+			ret = 1;
+			goto cleanup;
+		}
+	}
+
+	if ((opts.depth < 1) || (opts.width < 1) || (opts.digits < 1) ||
+			(opts.count < 1) || (opts.iterations < 1) || (opts.shapes < 0)) {
+		ERR("Invalid benchmark parameters.");
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* a tree of the given depth holds at most 2^(depth - 1) literals */
+	if ((opts.depth <= 31) && (opts.width > (1 << (opts.depth - 1)))) {
+		opts.width = 1 << (opts.depth - 1);
+	}
+
+	if (corpus_new(&opts, &corpus)) {
+		ERR("Generating the corpus failed.");
+		ret = 1;
+		goto cleanup;
+	}
+
+	printf("depth %d, width %d, digits %d, %d expressions, %d shapes, %d iterations, seed %u\n",
+			opts.depth, opts.width, opts.digits, opts.count, opts.shapes, opts.iterations, opts.seed);
+	run(&opts, &corpus);
+
+cleanup:
+	corpus_free(&corpus);
+	return ret;
+}
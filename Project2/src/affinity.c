@@ -0,0 +1,278 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: affinity.c
+ * Desc: CPU affinity of the threads and NUMA placement of the pools
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "server.h"
+
+#define AFFINITY_NODES_PATH "/sys/devices/system/node"
+
+/*
+ * The CPUs of the main loop, which accepts the sessions and serves the UDP requests, and of the session threads.
+ * The topology maps every CPU to its NUMA node, the pools are split between the nodes only with numa set.
+ */
+static struct {
+	cpu_set_t io;
+	cpu_set_t sessions;
+	int io_set;
+	int sessions_set;
+	int numa;
+	unsigned int nodes;
+	unsigned char node_of[CPU_SETSIZE];
+	cpu_set_t node_cpus[AFFINITY_MAX_NODES];
+} affinity = {.nodes = 1};
+
+/* parses a list of CPUs like 0-3,8, returns 0 on success, -1 on error */
+static int
+affinity_parse(const char *list, cpu_set_t *set)
+{
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+	do {
+		first = strtoul(list, &end, 10);
+		if (end == list) {
+			return -1;
+		}
+
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if (end == list) {
+				return -1;
+			}
+		}
+
+		if ((first > last) || (last >= CPU_SETSIZE)) {
+			return -1;
+		}
+		for (; first <= last; first++) {
+			CPU_SET(first, set);
+		}
+
+		list = end + 1;
+	} while (*end == ',');
+
+	/* the lists read from sysfs end with LF */
+	return ((*end == '\0') || (*end == '\n')) ? 0 : -1;
+}
+
+int
+affinity_parse_io(const char *list)
+{
+	affinity.io_set = 1;
+	return affinity_parse(list, &affinity.io);
+}
+
+int
+affinity_parse_sessions(const char *list)
+{
+	affinity.sessions_set = 1;
+	return affinity_parse(list, &affinity.sessions);
+}
+
+/* splits the pools between the NUMA nodes */
+void
+affinity_set_numa(int numa)
+{
+	affinity.numa = numa;
+}
+
+/* reads the CPUs of every NUMA node, a system without them is a single node */
+static void
+affinity_topology(void)
+{
+	char path[sizeof AFFINITY_NODES_PATH + 32], list[4096];
+	struct dirent *entry;
+	unsigned int node, cpu;
+	cpu_set_t cpus;
+	FILE *file;
+	DIR *dir;
+	int len;
+
+	dir = opendir(AFFINITY_NODES_PATH);
+	if (!dir) {
+		return;
+	}
+
+	while ((entry = readdir(dir))) {
+		if (sscanf(entry->d_name, "node%u", &node) != 1) {
+			continue;
+		}
+
+		snprintf(path, sizeof path, AFFINITY_NODES_PATH "/node%u/cpulist", node);
+		file = fopen(path, "r");
+		if (!file) {
+			continue;
+		}
+		len = fread(list, 1, sizeof list - 1, file);
+		fclose(file);
+		list[len] = '\0';
+
+		/* a node without CPUs has only memory */
+		if (!len || (list[0] == '\n') || affinity_parse(list, &cpus)) {
+			continue;
+		}
+
+		/* the nodes over the maximum share the pools of the others */
+		node %= AFFINITY_MAX_NODES;
+		if (node + 1 > affinity.nodes) {
+			affinity.nodes = node + 1;
+		}
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &cpus)) {
+				affinity.node_of[cpu] = node;
+				CPU_SET(cpu, &affinity.node_cpus[node]);
+			}
+		}
+	}
+
+	closedir(dir);
+}
+
+/* the given CPUs have to be ones the process may run on */
+static int
+affinity_check(cpu_set_t *set, const cpu_set_t *allowed, const char *name)
+{
+	CPU_AND(set, set, allowed);
+	if (!CPU_COUNT(set)) {
+		ERR("None of the %s CPUs is available.", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* reads the topology and checks the CPU lists, the sessions may run on any allowed CPU by default */
+int
+affinity_init(void)
+{
+	cpu_set_t allowed;
+
+	affinity_topology();
+
+	if (sched_getaffinity(0, sizeof allowed, &allowed)) {
+		ERR("Getting the CPU affinity failed (%s).", strerror(errno));
+		return -1;
+	}
+
+	if (affinity.io_set && affinity_check(&affinity.io, &allowed, "I/O")) {
+		return -1;
+	}
+	if (affinity.sessions_set && affinity_check(&affinity.sessions, &allowed, "session")) {
+		return -1;
+	} else if (!affinity.sessions_set) {
+		affinity.sessions = allowed;
+	}
+
+	if (affinity.numa) {
+		INF("Pools split between %u NUMA nodes.", affinity.nodes);
+	}
+
+	return 0;
+}
+
+/* pins the calling thread, the main loop, to the I/O CPUs */
+void
+affinity_io(void)
+{
+	if (affinity.io_set && pthread_setaffinity_np(pthread_self(), sizeof affinity.io, &affinity.io)) {
+		WRN("Pinning the main loop failed.");
+	}
+}
+
+/*
+ * Picks the CPUs of a new session thread. A session, whose packets are received by one of the session CPUs,
+ * is pinned to that CPU, so the packets and the requests are handled in the same cache. Otherwise it may run
+ * on the session CPUs of the node, which receives its packets. Returns the node for the memory of the session.
+ */
+int
+affinity_session(int sock, pthread_attr_t *attr)
+{
+	cpu_set_t set;
+	socklen_t len;
+	int cpu = -1;
+
+	if (!affinity.sessions_set && !affinity.numa) {
+		return 0;
+	}
+
+	len = sizeof cpu;
+	if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) || (cpu < 0) || (cpu >= CPU_SETSIZE)) {
+		/* a unix socket has no such CPU */
+		cpu = -1;
+	}
+
+	set = affinity.sessions;
+	if ((cpu >= 0) && affinity.sessions_set && CPU_ISSET(cpu, &set)) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+	} else if (cpu >= 0) {
+		CPU_AND(&set, &set, &affinity.node_cpus[affinity.node_of[cpu]]);
+		if (!CPU_COUNT(&set)) {
+			set = affinity.sessions;
+		}
+	}
+
+	if (pthread_attr_setaffinity_np(attr, sizeof set, &set)) {
+		WRN("Setting the CPUs of a session failed.");
+	}
+
+	if (cpu < 0) {
+		/* any of the CPUs, the pools fall back to the other nodes */
+		for (cpu = 0; !CPU_ISSET(cpu, &set); cpu++);
+	}
+
+	return affinity.numa ? affinity.node_of[cpu] : 0;
+}
+
+/* the number of the nodes the pools are split between */
+unsigned int
+affinity_nodes(void)
+{
+	return affinity.numa ? affinity.nodes : 1;
+}
+
+/* the node of the CPU the calling thread runs on */
+int
+affinity_node(void)
+{
+	int cpu;
+
+	if (!affinity.numa) {
+		return 0;
+	}
+
+	cpu = sched_getcpu();
+	return ((cpu < 0) || (cpu >= CPU_SETSIZE)) ? 0 : affinity.node_of[cpu];
+}
+
+/* asks the kernel to fault in the memory on the node, it has to be done before the memory is touched */
+void
+affinity_place(void *memory, size_t len, int node)
+{
+	unsigned long mask = 1UL << node;
+
+	if (syscall(SYS_mbind, memory, len, MPOL_PREFERRED, &mask, sizeof mask * 8, 0)) {
+		WRN("Placing memory on the node %d failed (%s).", node, strerror(errno));
+	}
+}
@@ -0,0 +1,36 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: affinity.h
+ * Desc: CPU affinity of the threads and NUMA placement of the pools header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* the pools are split between at most this many NUMA nodes, the others share them */
+#define AFFINITY_MAX_NODES 8
+
+int affinity_parse_io(const char *list);
+
+int affinity_parse_sessions(const char *list);
+
+void affinity_set_numa(int numa);
+
+int affinity_init(void);
+
+void affinity_io(void);
+
+int affinity_session(int sock, pthread_attr_t *attr);
+
+unsigned int affinity_nodes(void);
+
+int affinity_node(void);
+
+void affinity_place(void *memory, size_t len, int node);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: busypoll.c
+ * Desc: Busy polling of the sockets in place of sleeping
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "busypoll.h"
+#include "server.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BUSY_POLL_RELAX() __builtin_ia32_pause()
+#else
+#define BUSY_POLL_RELAX()
+#endif
+
+/* the time the kernel polls the device queue for, and the spins before yielding, 0 with busy polling off */
+static struct {
+	unsigned int usec;
+	unsigned int spins;
+} busy;
+
+/* turns busy polling on, the kernel polls the device queue of a socket for up to usec microseconds */
+void
+busy_poll_set(unsigned int usec)
+{
+	busy.usec = usec;
+
+	/* spinning on a single CPU would only keep the client from running */
+	busy.spins = (usec && (sysconf(_SC_NPROCESSORS_ONLN) > 1)) ? BUSY_POLL_SPINS : 0;
+}
+
+int
+busy_poll_enabled(void)
+{
+	return busy.usec != 0;
+}
+
+/*
+ * Asks the kernel to poll the device queue of the socket, rather than wait for an interrupt, whenever
+ * it is read and empty. Only a privileged process may poll longer than net.core.busy_read allows.
+ */
+void
+busy_poll_socket(int sock)
+{
+	int usec = busy.usec, prefer = 1;
+
+	if (!busy.usec) {
+		return;
+	}
+
+	if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec)) {
+		WRN("Setting busy polling failed (%s).", strerror(errno));
+	}
+#ifdef SO_PREFER_BUSY_POLL
+	if (setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof prefer)) {
+		WRN("Preferring busy polling failed (%s).", strerror(errno));
+	}
+#else
+	(void) prefer;
+#endif
+}
+
+/*
+ * Called whenever a poll found nothing. The CPU is paused for the first spins and yielded for the next ones,
+ * returns 1 while the caller should poll again and 0 once it should go to sleep, always 0 with busy polling off.
+ */
+int
+busy_poll_backoff(unsigned int *spin)
+{
+	if (!busy.usec || (*spin >= busy.spins + BUSY_POLL_YIELDS)) {
+		return 0;
+	}
+
+	if (*spin < busy.spins) {
+		BUSY_POLL_RELAX();
+	} else {
+		sched_yield();
+	}
+	(*spin)++;
+
+	return 1;
+}
@@ -0,0 +1,26 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: busypoll.h
+ * Desc: Busy polling of the sockets in place of sleeping header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _BUSYPOLL_H_
+#define _BUSYPOLL_H_
+
+/* a socket found empty is polled again this many times with a pause in between, only with more than one CPU */
+#define BUSY_POLL_SPINS 4096
+
+/* then the CPU is yielded this many times, before the thread goes to sleep until the socket is ready */
+#define BUSY_POLL_YIELDS 64
+
+void busy_poll_set(unsigned int usec);
+
+int busy_poll_enabled(void);
+
+void busy_poll_socket(int sock);
+
+int busy_poll_backoff(unsigned int *spin);
+
+#endif
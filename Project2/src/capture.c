@@ -0,0 +1,254 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: capture.c
+ * Desc: Capture of the received requests into a binary log for a later replay
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "metrics.h"
+
+/*
+ * The records are appended to the active buffer under the lock, which also orders them by their time.
+ * The writer swaps the buffers and writes the full one out, so a request never waits for the disk.
+ */
+static struct {
+	pthread_mutex_t lock;
+	char *buffers[2];
+	size_t used;
+	int active;
+	int fd;
+	unsigned long long start;
+	unsigned long long dropped;
+	atomic_int enabled;
+	atomic_uint conns;
+	atomic_int stop;
+	int running;
+	pthread_t tid;
+} capture = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+static void
+capture_append(protocol_type mode, uint32_t conn, int event, const void *data, int len)
+{
+	struct capture_record record;
+
+	if (!atomic_load_explicit(&capture.enabled, memory_order_relaxed)) {
+		return;
+	}
+
+	/* a TCP chunk and a datagram are both at most MAX_BUFFER_SIZE */
+	if ((len < 0) || (len > UINT16_MAX)) {
+		return;
+	}
+
+	pthread_mutex_lock(&capture.lock);
+
+	if (capture.used + sizeof record + len > CAPTURE_BUFFER_SIZE) {
+		/* the writer is behind, never wait for it */
+		capture.dropped++;
+		pthread_mutex_unlock(&capture.lock);
+		return;
+	}
+
+	record.time = htole64(metrics_now() - capture.start);
+	record.conn = htole32(conn);
+	record.len = htole16(len);
+	record.mode = mode;
+	record.event = event;
+
+	memcpy(capture.buffers[capture.active] + capture.used, &record, sizeof record);
+	memcpy(capture.buffers[capture.active] + capture.used + sizeof record, data, len);
+	capture.used += sizeof record + len;
+
+	pthread_mutex_unlock(&capture.lock);
+}
+
+/* records a new TCP connection and returns its id, 0 if nothing is captured */
+uint32_t
+capture_open(void)
+{
+	uint32_t conn;
+
+	if (!atomic_load_explicit(&capture.enabled, memory_order_relaxed)) {
+		return 0;
+	}
+
+	conn = atomic_fetch_add_explicit(&capture.conns, 1, memory_order_relaxed) + 1;
+	capture_append(IP_TCP, conn, CAPTURE_OPEN, NULL, 0);
+	return conn;
+}
+
+void
+capture_close(uint32_t conn)
+{
+	if (conn) {
+		capture_append(IP_TCP, conn, CAPTURE_CLOSE, NULL, 0);
+	}
+}
+
+/* the id of a UDP client is a hash of its address, so its datagrams may be replayed from a socket of their own */
+uint32_t
+capture_address(const struct sockaddr *sa, socklen_t len)
+{
+	const unsigned char *bytes = (const unsigned char *)sa;
+	uint32_t hash = 2166136261u;
+	socklen_t i;
+
+	if (!atomic_load_explicit(&capture.enabled, memory_order_relaxed)) {
+		return 0;
+	}
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+/* records the received bytes of a TCP connection or a datagram */
+void
+capture_data(protocol_type mode, uint32_t conn, const void *data, int len)
+{
+	capture_append(mode, conn, CAPTURE_DATA, data, len);
+}
+
+/* writes out the records collected so far */
+static int
+capture_flush(void)
+{
+	size_t len, written = 0;
+	ssize_t ret;
+	char *buffer;
+
+	pthread_mutex_lock(&capture.lock);
+	buffer = capture.buffers[capture.active];
+	len = capture.used;
+	capture.active ^= 1;
+	capture.used = 0;
+	pthread_mutex_unlock(&capture.lock);
+
+	while (written < len) {
+		ret = write(capture.fd, buffer + written, len - written);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ERR("Writing the capture failed (%s).", strerror(errno));
+			return -1;
+		}
+		written += ret;
+	}
+
+	return 0;
+}
+
+static void *
+capture_writer(void *arg)
+{
+	struct timespec ts = {0, CAPTURE_FLUSH_MS * 1000000L};
+
+	(void) arg;
+
+	while (!atomic_load(&capture.stop)) {
+		nanosleep(&ts, NULL);
+		if (capture_flush()) {
+			/* nothing more is captured */
+			atomic_store(&capture.enabled, 0);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* creates the log and starts the writer, nothing is captured without a path */
+int
+capture_init(const char *path)
+{
+	if (!path) {
+		return 0;
+	}
+
+	capture.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capture.fd < 0) {
+		ERR("Opening the capture \"%s\" failed (%s).", path, strerror(errno));
+		return -1;
+	}
+
+	capture.buffers[0] = malloc(CAPTURE_BUFFER_SIZE);
+	capture.buffers[1] = malloc(CAPTURE_BUFFER_SIZE);
+	if (!capture.buffers[0] || !capture.buffers[1]) {
+		ERR("Memory allocation error.");
+		goto error;
+	}
+
+	/* touch the buffers now, so that the first requests do not fault them in */
+	memset(capture.buffers[0], 0, CAPTURE_BUFFER_SIZE);
+	memset(capture.buffers[1], 0, CAPTURE_BUFFER_SIZE);
+
+	if (write(capture.fd, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != (ssize_t)strlen(CAPTURE_MAGIC)) {
+		ERR("Writing the capture failed (%s).", strerror(errno));
+		goto error;
+	}
+
+	capture.start = metrics_now();
+	atomic_store(&capture.enabled, 1);
+
+	if (pthread_create(&capture.tid, NULL, capture_writer, NULL)) {
+		ERR("Creating the capture thread failed.");
+		atomic_store(&capture.enabled, 0);
+		goto error;
+	}
+	capture.running = 1;
+
+	INF("Capturing the requests into \"%s\".", path);
+	return 0;
+
+error:
+	capture_destroy();
+	return -1;
+}
+
+/* stops capturing and writes out the rest of the records */
+void
+capture_destroy(void)
+{
+	int enabled = atomic_exchange(&capture.enabled, 0);
+
+	if (capture.running) {
+		atomic_store(&capture.stop, 1);
+		pthread_join(capture.tid, NULL);
+		capture.running = 0;
+
+		/* the records appended since the last flush, unless the writer failed already */
+		if (enabled) {
+			capture_flush();
+		}
+	}
+
+	if (capture.dropped) {
+		WRN("%llu captured records dropped, the disk was too slow.", capture.dropped);
+	}
+
+	if (capture.fd >= 0) {
+		close(capture.fd);
+		capture.fd = -1;
+	}
+	free(capture.buffers[0]);
+	free(capture.buffers[1]);
+	capture.buffers[0] = capture.buffers[1] = NULL;
+}
@@ -0,0 +1,55 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: capture.h
+ * Desc: Capture of the received requests into a binary log for a later replay header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "server.h"
+
+/*
+ * The log starts with the magic, every record is the header followed by the received bytes. All the fields
+ * are little endian, the time is in nanoseconds since the capture started. The layout has to match the one
+ * of the replay in the client.
+ */
+#define CAPTURE_MAGIC "IPKCAP1\n"
+
+/* a TCP connection was accepted, its data follows in the records with the same id, until it is closed */
+#define CAPTURE_OPEN 0
+#define CAPTURE_DATA 1
+#define CAPTURE_CLOSE 2
+
+struct capture_record {
+	uint64_t time;
+	uint32_t conn;
+	uint16_t len;
+	uint8_t mode;
+	uint8_t event;
+};
+
+/* the records are collected in one buffer while the other is written, the records which do not fit are dropped */
+#define CAPTURE_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* how often the writer swaps the buffers */
+#define CAPTURE_FLUSH_MS 10
+
+int capture_init(const char *path);
+
+void capture_destroy(void);
+
+uint32_t capture_open(void);
+
+void capture_close(uint32_t conn);
+
+uint32_t capture_address(const struct sockaddr *sa, socklen_t len);
+
+void capture_data(protocol_type mode, uint32_t conn, const void *data, int len);
+
+#endif
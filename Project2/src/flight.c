@@ -0,0 +1,169 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: flight.c
+ * Desc: Coalescing of the identical queries solved at the same time
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#include <pthread.h>
+#include <string.h>
+
+#include "flight.h"
+#include "metrics.h"
+
+/* the queries in flight with the same hash modulo the buckets, the waiters sleep on the condition of the bucket */
+struct flight_bucket {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct flight *head;
+};
+
+static int flight_on;
+
+static struct flight_bucket flight_buckets[FLIGHT_BUCKETS];
+
+/* coalesces the identical queries, off by default since every query is hashed and looked up */
+void
+flight_set(int enabled)
+{
+	flight_on = enabled;
+}
+
+int
+flight_enabled(void)
+{
+	return flight_on;
+}
+
+int
+flight_init(void)
+{
+	int i;
+
+	for (i = 0; i < FLIGHT_BUCKETS; i++) {
+		pthread_mutex_init(&flight_buckets[i].lock, NULL);
+		pthread_cond_init(&flight_buckets[i].cond, NULL);
+		flight_buckets[i].head = NULL;
+	}
+
+	return 0;
+}
+
+/* FNV-1a of the text of a query */
+static uint32_t
+flight_hash(const char *key, int len)
+{
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)key[i]) * 16777619U;
+	}
+
+	return hash;
+}
+
+/*
+ * Looks for an identical query in flight. If there is one, waits until it is solved and copies its result
+ * and the return value of its arithmetic, unless it failed in a way only that query may have. A caller,
+ * which must not wait, solves the query on its own then. Otherwise the query is put in flight and the caller
+ * has to solve it and call flight_leave(), even if it fails.
+ * Returns FLIGHT_SHARED if the result was copied, FLIGHT_LEAD if the caller has to solve the query.
+ */
+int
+flight_join(struct flight *flight, const char *key, int len, int wait, struct num *result, int *ret)
+{
+	struct flight_bucket *bucket;
+	struct flight *leader;
+	int shared = 0;
+
+	flight->key = NULL;
+	if (!flight_on) {
+		return FLIGHT_LEAD;
+	}
+
+	flight->hash = flight_hash(key, len);
+	bucket = &flight_buckets[flight->hash % FLIGHT_BUCKETS];
+
+	pthread_mutex_lock(&bucket->lock);
+	for (leader = bucket->head; leader; leader = leader->next) {
+		if ((leader->hash == flight->hash) && (leader->len == len) && !memcmp(leader->key, key, len)) {
+			break;
+		}
+	}
+
+	if (!leader) {
+		/* the first one solves it */
+		flight->key = key;
+		flight->len = len;
+		flight->waiters = 0;
+		flight->done = 0;
+		flight->next = bucket->head;
+		bucket->head = flight;
+		pthread_mutex_unlock(&bucket->lock);
+		return FLIGHT_LEAD;
+	}
+
+	if (!wait) {
+		pthread_mutex_unlock(&bucket->lock);
+		return FLIGHT_LEAD;
+	}
+
+	leader->waiters++;
+	while (!leader->done) {
+		pthread_cond_wait(&bucket->cond, &bucket->lock);
+	}
+
+	if (leader->ret != FLIGHT_UNSHARED) {
+		*ret = num_copy(result, leader->result);
+		if (!*ret) {
+			*ret = leader->ret;
+			shared = 1;
+		}
+	}
+
+	/* the leader waits for the last one to copy the result */
+	if (!--leader->waiters) {
+		pthread_cond_broadcast(&bucket->cond);
+	}
+	pthread_mutex_unlock(&bucket->lock);
+
+	if (shared) {
+		metrics_inc(METRIC_COALESCED, 1);
+	}
+	return shared ? FLIGHT_SHARED : FLIGHT_LEAD;
+}
+
+/* publishes the result of a query put in flight by flight_join() and waits until all its waiters copied it */
+void
+flight_leave(struct flight *flight, int ret, const struct num *result)
+{
+	struct flight_bucket *bucket;
+	struct flight **prev;
+
+	if (!flight->key) {
+		return;
+	}
+
+	bucket = &flight_buckets[flight->hash % FLIGHT_BUCKETS];
+	pthread_mutex_lock(&bucket->lock);
+
+	/* the queries arriving from now on are solved again */
+	for (prev = &bucket->head; *prev != flight; prev = &(*prev)->next);
+	*prev = flight->next;
+
+	/* only this query may fail to allocate */
+	flight->ret = (ret == NUM_NO_MEMORY) ? FLIGHT_UNSHARED : ret;
+	flight->result = result;
+	flight->done = 1;
+	if (flight->waiters) {
+		pthread_cond_broadcast(&bucket->cond);
+		while (flight->waiters) {
+			pthread_cond_wait(&bucket->cond, &bucket->lock);
+		}
+	}
+
+	pthread_mutex_unlock(&bucket->lock);
+	flight->key = NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: flight.h
+ * Desc: Coalescing of the identical queries solved at the same time header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _FLIGHT_H_
+#define _FLIGHT_H_
+
+#include <stdint.h>
+
+#include "num.h"
+
+/* the queries in flight are kept in this many buckets, each with its own lock */
+#define FLIGHT_BUCKETS 64
+
+/* how flight_join() got the answer, the caller has to solve the query itself or it was shared */
+#define FLIGHT_LEAD 0
+#define FLIGHT_SHARED 1
+
+/* the result of a query which is not shared, a syntax error or a failed allocation */
+#define FLIGHT_UNSHARED -2
+
+/*
+ * A query being solved, the identical ones arriving meanwhile wait for its result instead of solving it again.
+ * It lives on the stack of the thread solving the query and its key points into the request of that thread,
+ * so both stay valid until flight_leave() returns, which waits until every waiter got its copy.
+ */
+struct flight {
+	struct flight *next;
+	const char *key;
+	int len;
+	uint32_t hash;
+	int waiters;
+	int done;
+	int ret;
+	const struct num *result;
+};
+
+void flight_set(int enabled);
+
+int flight_enabled(void);
+
+int flight_init(void);
+
+int flight_join(struct flight *flight, const char *key, int len, int wait, struct num *result, int *ret);
+
+void flight_leave(struct flight *flight, int ret, const struct num *result);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: handoff.c
+ * Desc: Handing the listening sockets over to a new server process
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+extern struct server_opts server_opts;
+
+/* the listeners as they are sent to the new process */
+struct handoff_msg {
+	uint32_t magic;
+	uint32_t count;
+	struct {
+		uint32_t mode;
+		uint32_t port;
+		char address[MAX_ADDRESS_SIZE];
+	} listeners[MAX_LISTENERS];
+};
+
+union handoff_control {
+	char buf[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+	struct cmsghdr align;
+};
+
+/* starts waiting for a new process to take over, returns the listening socket */
+int
+handoff_init(const char *path)
+{
+	return unix_init_server(path, SOCK_STREAM);
+}
+
+/*
+ * Sends all the listeners to a new process, which connected to the handoff socket. The handoff socket
+ * is removed first, so that the new process can create its own on the same path right away.
+ * Returns 0 if the new process took the listeners over, -1 if this process has to keep serving them.
+ */
+int
+handoff_send(int *handoff_sock, const char *path)
+{
+	struct handoff_msg msg;
+	union handoff_control control;
+	struct msghdr hdr;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct pollfd pfd;
+	int fds[MAX_LISTENERS];
+	int sock, i, ret = -1;
+	char ack;
+
+	sock = accept4(*handoff_sock, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0) {
+		return -1;
+	}
+
+	close(*handoff_sock);
+	*handoff_sock = -1;
+	unlink(path);
+
+	memset(&msg, 0, sizeof msg);
+	msg.magic = HANDOFF_MAGIC;
+	msg.count = server_opts.listener_count;
+	for (i = 0; i < server_opts.listener_count; i++) {
+		msg.listeners[i].mode = server_opts.listeners[i].mode;
+		msg.listeners[i].port = server_opts.listeners[i].port;
+		strcpy(msg.listeners[i].address, server_opts.listeners[i].address);
+		fds[i] = server_opts.listeners[i].sock;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memset(&control, 0, sizeof control);
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof msg;
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control.buf;
+	hdr.msg_controllen = CMSG_SPACE(msg.count * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(msg.count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, msg.count * sizeof(int));
+
+	if (sendmsg(sock, &hdr, MSG_NOSIGNAL) != sizeof msg) {
+		ERR("Sending the listeners failed (%s).", strerror(errno));
+		goto cleanup;
+	}
+
+	/* the listeners are not given up until the new process confirms it has them */
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	if ((poll(&pfd, 1, HANDOFF_TIMEOUT_MS) != 1) || (recv(sock, &ack, 1, 0) != 1)) {
+		ERR("The new process did not take the listeners over.");
+		goto cleanup;
+	}
+
+	ret = 0;
+
+cleanup:
+	close(sock);
+	if (ret) {
+		/* wait for another attempt */
+		*handoff_sock = handoff_init(path);
+	}
+	return ret;
+}
+
+/*
+ * Takes the listeners over from a running process, they are added before the ones given on the command line.
+ * Returns 0 on success, -1 on error.
+ */
+int
+handoff_receive(const char *path)
+{
+	struct handoff_msg msg;
+	union handoff_control control;
+	struct msghdr hdr;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct sockaddr_un sa;
+	int fds[MAX_LISTENERS];
+	int sock, i, j, count = 0, ret = -1;
+	ssize_t received;
+
+	if (strlen(path) >= sizeof sa.sun_path) {
+		ERR("Handoff socket path too long.");
+		return -1;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		ERR("Creating handoff socket failed (%s).", strerror(errno));
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if (connect(sock, (struct sockaddr *) &sa, sizeof sa)) {
+		ERR("Connecting to the running server failed (%s).", strerror(errno));
+		goto cleanup;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof msg;
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control.buf;
+	hdr.msg_controllen = sizeof control.buf;
+
+	received = recvmsg(sock, &hdr, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+	cmsg = CMSG_FIRSTHDR(&hdr);
+	if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+	}
+
+	for (i = 0; (received == sizeof msg) && (i < count); i++) {
+		if (msg.listeners[i].mode > IP_SHM) {
+			received = -1;
+		}
+	}
+
+	if ((received != sizeof msg) || (msg.magic != HANDOFF_MAGIC) || (msg.count != (uint32_t)count) ||
+			(server_opts.listener_count + count > MAX_LISTENERS)) {
+		ERR("Invalid listeners received from the running server.");
+		for (i = 0; i < count; i++) {
+			close(fds[i]);
+		}
+		goto cleanup;
+	}
+
+	/* make room for the listeners at the beginning */
+	memmove(server_opts.listeners + count, server_opts.listeners, server_opts.listener_count * sizeof *server_opts.listeners);
+	for (i = 0; i < count; i++) {
+		server_opts.listeners[i].mode = msg.listeners[i].mode;
+		server_opts.listeners[i].port = msg.listeners[i].port;
+		memcpy(server_opts.listeners[i].address, msg.listeners[i].address, MAX_ADDRESS_SIZE);
+		server_opts.listeners[i].address[MAX_ADDRESS_SIZE - 1] = '\0';
+		server_opts.listeners[i].sock = fds[i];
+		INF("Took over the %s listener on \"%s\".", mode_names[msg.listeners[i].mode], server_opts.listeners[i].address);
+	}
+	server_opts.listener_count += count;
+
+	/* the same listener given on the command line would only replace the socket which was taken over */
+	for (i = count; i < server_opts.listener_count; i++) {
+		for (j = 0; j < count; j++) {
+			if ((server_opts.listeners[i].mode == server_opts.listeners[j].mode) &&
+					(server_opts.listeners[i].port == server_opts.listeners[j].port) &&
+					!strcmp(server_opts.listeners[i].address, server_opts.listeners[j].address)) {
+				break;
+			}
+		}
+
+		if (j < count) {
+			memmove(server_opts.listeners + i, server_opts.listeners + i + 1,
+					(server_opts.listener_count - i - 1) * sizeof *server_opts.listeners);
+			server_opts.listener_count--;
+			i--;
+		}
+	}
+
+	/* let the old process go */
+	if (send(sock, "", 1, MSG_NOSIGNAL) != 1) {
+		ERR("Confirming the handoff failed (%s).", strerror(errno));
+	}
+	ret = 0;
+
+cleanup:
+	close(sock);
+	return ret;
+}
@@ -0,0 +1,274 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: log.c
+ * Desc: Asynchronous logging through per-thread rings drained by a writer thread
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+log_level log_max_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = {
+	"error",
+	"warning",
+	"info",
+	"debug"
+};
+
+static const char *level_prefixes[] = {
+	"[ERR]: ",
+	"[WRN]: ",
+	"[INF]: ",
+	"[DBG]: "
+};
+
+/* the rings live as long as the process, a thread may still be logging into one when the writer stops */
+static struct log_ring *rings;
+
+static unsigned int ring_count;
+
+static _Thread_local struct log_ring *thread_ring;
+
+static pthread_key_t log_key;
+
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+
+static struct {
+	pthread_t tid;
+	atomic_int running;
+	atomic_int stop;
+	atomic_uint dropped;
+} writer;
+
+static void
+log_ring_release(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	atomic_store_explicit(&ring->in_use, 0, memory_order_release);
+}
+
+static void
+log_key_create(void)
+{
+	pthread_key_create(&log_key, log_ring_release);
+}
+
+/* gets the ring of the calling thread, the first call per thread claims a free one */
+static struct log_ring *
+log_ring_get(void)
+{
+	unsigned int i;
+	int expected;
+
+	if (thread_ring) {
+		return thread_ring;
+	}
+
+	pthread_once(&log_key_once, log_key_create);
+
+	for (i = 0; i < ring_count; i++) {
+		expected = 0;
+		if (atomic_compare_exchange_strong(&rings[i].in_use, &expected, 1)) {
+			pthread_setspecific(log_key, &rings[i]);
+			thread_ring = &rings[i];
+			break;
+		}
+	}
+
+	return thread_ring;
+}
+
+/* returns 1 if the call site already logged too much in this second */
+static int
+log_ratelimited(struct log_ratelimit *rl, unsigned int *suppressed)
+{
+	struct timespec ts;
+	long long window;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	window = ts.tv_sec;
+
+	*suppressed = 0;
+	if (atomic_load_explicit(&rl->window, memory_order_relaxed) != window) {
+		/* new second, report what was suppressed in the previous one */
+		atomic_store_explicit(&rl->window, window, memory_order_relaxed);
+		atomic_store_explicit(&rl->count, 0, memory_order_relaxed);
+		*suppressed = atomic_exchange_explicit(&rl->suppressed, 0, memory_order_relaxed);
+	}
+
+	if (atomic_fetch_add_explicit(&rl->count, 1, memory_order_relaxed) >= LOG_RATELIMIT_BURST) {
+		atomic_fetch_add_explicit(&rl->suppressed, 1, memory_order_relaxed);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+log_write(FILE *stream, log_level level, const char *line)
+{
+	fputs(level_prefixes[level], stream);
+	fputs(line, stream);
+	fputc('\n', stream);
+}
+
+/* formats the message into the ring of this thread, or prints it right away if no writer runs or no ring is free */
+void
+log_msg(log_level level, struct log_ratelimit *rl, const char *format, ...)
+{
+	va_list ap;
+	struct log_ring *ring;
+	struct log_entry *entry;
+	unsigned int head, suppressed;
+	char line[LOG_LINE_SIZE];
+	int len = 0;
+
+	if (log_ratelimited(rl, &suppressed)) {
+		return;
+	}
+
+	if (suppressed) {
+		len = snprintf(line, sizeof line, "(%u similar messages suppressed) ", suppressed);
+	}
+
+	ring = NULL;
+	if (atomic_load_explicit(&writer.running, memory_order_acquire)) {
+		ring = log_ring_get();
+	}
+
+	if (!ring) {
+		va_start(ap, format);
+		vsnprintf(line + len, sizeof line - len, format, ap);
+		va_end(ap);
+		log_write((level <= LOG_LEVEL_WARNING) ? stderr : stdout, level, line);
+		return;
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+		/* the writer is behind, never wait for it */
+		atomic_fetch_add_explicit(&writer.dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+	entry->level = level;
+	memcpy(entry->line, line, len);
+	va_start(ap, format);
+	vsnprintf(entry->line + len, sizeof entry->line - len, format, ap);
+	va_end(ap);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* writes out everything that is in the rings, returns the number of messages */
+static int
+log_drain(void)
+{
+	struct log_ring *ring;
+	struct log_entry *entry;
+	unsigned int i, head, tail, dropped;
+	int count = 0;
+
+	for (i = 0; i < ring_count; i++) {
+		ring = &rings[i];
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+		for (; tail != head; tail++, count++) {
+			entry = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+			log_write((entry->level <= LOG_LEVEL_WARNING) ? stderr : stdout, entry->level, entry->line);
+		}
+
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+
+	dropped = atomic_exchange_explicit(&writer.dropped, 0, memory_order_relaxed);
+	if (dropped) {
+		fprintf(stderr, "%s%u log messages dropped\n", level_prefixes[LOG_LEVEL_WARNING], dropped);
+	}
+
+	if (count) {
+		fflush(stdout);
+		fflush(stderr);
+	}
+
+	return count;
+}
+
+/* the writer thread, polls the rings and sleeps when there is nothing to write */
+static void *
+log_writer(void *arg)
+{
+	struct timespec idle = {0, 10 * 1000 * 1000};
+
+	(void) arg;
+
+	while (!atomic_load(&writer.stop)) {
+		if (!log_drain()) {
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	/* write the rest before exiting */
+	log_drain();
+	return NULL;
+}
+
+int
+log_parse_level(const char *name, log_level *level)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof level_names / sizeof *level_names; i++) {
+		if (!strcmp(name, level_names[i])) {
+			*level = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* allocates the rings of the given number of threads and starts the writer, until then the messages are printed synchronously */
+int
+log_init(unsigned int count)
+{
+	rings = calloc(count, sizeof *rings);
+	if (!rings) {
+		return -1;
+	}
+	ring_count = count;
+
+	if (pthread_create(&writer.tid, NULL, log_writer, NULL)) {
+		return -1;
+	}
+
+	atomic_store_explicit(&writer.running, 1, memory_order_release);
+	return 0;
+}
+
+void
+log_destroy(void)
+{
+	if (!atomic_load(&writer.running)) {
+		return;
+	}
+
+	/* the messages logged from now on are printed synchronously */
+	atomic_store(&writer.running, 0);
+	atomic_store(&writer.stop, 1);
+	pthread_join(writer.tid, NULL);
+}
@@ -0,0 +1,71 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: log.h
+ * Desc: Asynchronous logging header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdatomic.h>
+
+/* rings allocated above the number of sessions and workers, for the main thread and the helper threads */
+#define LOG_RINGS_SPARE 16
+
+/* number of messages in a ring, must be a power of two */
+#define LOG_RING_SIZE 64
+
+/* maximum length of a single message */
+#define LOG_LINE_SIZE 256
+
+/* number of messages a single call site may log per second */
+#define LOG_RATELIMIT_BURST 10
+
+typedef enum {
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG
+} log_level;
+
+/* state of the rate limiting of a single call site */
+struct log_ratelimit {
+	atomic_llong window;
+	atomic_uint count;
+	atomic_uint suppressed;
+};
+
+struct log_entry {
+	log_level level;
+	char line[LOG_LINE_SIZE];
+};
+
+/* single producer, single consumer ring, the producer is the thread owning it, the consumer is the writer */
+struct log_ring {
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_int in_use;
+	struct log_entry entries[LOG_RING_SIZE];
+};
+
+extern log_level log_max_level;
+
+#define LOG(level, format, ...) do { \
+	static struct log_ratelimit _log_rl; \
+	if ((level) <= log_max_level) { \
+		log_msg(level, &_log_rl, format, ##__VA_ARGS__); \
+	} \
+} while (0)
+
+int log_parse_level(const char *name, log_level *level);
+
+void log_msg(log_level level, struct log_ratelimit *rl, const char *format, ...)
+	__attribute__((format(printf, 3, 4)));
+
+int log_init(unsigned int count);
+
+void log_destroy(void);
+
+#endif
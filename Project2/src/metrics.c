@@ -0,0 +1,370 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: metrics.c
+ * Desc: Server metrics, counters and latency histograms exported over a local socket
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "server.h"
+
+extern volatile int exit_application;
+
+static const char *stage_names[STAGE_COUNT] = {
+	"accept",
+	"recv",
+	"parse",
+	"queue",
+	"tree",
+	"eval",
+	"send"
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} counter_desc[METRIC_COUNT] = {
+	{"ipkpd_connections_total", "Accepted TCP connections."},
+	{"ipkpd_tcp_requests_total", "Handled TCP SOLVE requests."},
+	{"ipkpd_udp_requests_total", "Handled UDP requests."},
+	{"ipkpd_shm_requests_total", "Handled shared memory requests."},
+	{"ipkpd_errors_total", "Requests which failed to be answered."},
+	{"ipkpd_received_bytes_total", "Bytes received from clients."},
+	{"ipkpd_sent_bytes_total", "Bytes sent to clients."},
+	{"ipkpd_rate_limited_total", "Connections, requests and datagrams refused by the rate limits."},
+	{"ipkpd_shed_total", "Requests and sessions rejected because the server was overloaded."},
+	{"ipkpd_batch_items_total", "Queries solved as items of batch requests."},
+	{"ipkpd_coalesced_total", "Queries answered by the result of an identical query solved at the same time."}
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} gauge_desc[GAUGE_COUNT] = {
+	{"ipkpd_work_queue_depth", "Requests waiting for a compute worker."},
+	{"ipkpd_completion_queue_depth", "Responses computed by the workers, waiting to be sent."}
+};
+
+/* the functions reading the gauges, a gauge without one is not served */
+static _Atomic(unsigned long long (*)(void)) gauge_read[GAUGE_COUNT];
+
+/* list of all the per-thread blocks, blocks are never freed, only reused */
+static _Atomic(struct metrics_thread *) metrics_threads;
+
+static _Thread_local struct metrics_thread *thread_metrics;
+
+static pthread_key_t metrics_key;
+
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+
+static struct {
+	int sock;
+	char path[sizeof ((struct sockaddr_un *)0)->sun_path];
+	pthread_t tid;
+	int running;
+	ino_t ino;
+} stats;
+
+/* releases the block of an exiting thread, so that a new thread can reuse it */
+static void
+metrics_thread_release(void *arg)
+{
+	struct metrics_thread *block = arg;
+
+	atomic_store_explicit(&block->in_use, 0, memory_order_release);
+}
+
+static void
+metrics_key_create(void)
+{
+	pthread_key_create(&metrics_key, metrics_thread_release);
+}
+
+/* gets the block of the calling thread, the first call per thread finds a free one or allocates it */
+static struct metrics_thread *
+metrics_thread_get(void)
+{
+	struct metrics_thread *block;
+	int expected;
+
+	if (thread_metrics) {
+		return thread_metrics;
+	}
+
+	pthread_once(&metrics_key_once, metrics_key_create);
+
+	/* try to reuse a block of an already finished thread */
+	for (block = atomic_load(&metrics_threads); block; block = block->next) {
+		expected = 0;
+		if (atomic_compare_exchange_strong(&block->in_use, &expected, 1)) {
+			break;
+		}
+	}
+
+	if (!block) {
+		block = calloc(1, sizeof *block);
+		if (!block) {
+			return NULL;
+		}
+
+		atomic_init(&block->in_use, 1);
+		block->next = atomic_load(&metrics_threads);
+		while (!atomic_compare_exchange_weak(&metrics_threads, &block->next, block));
+	}
+
+	pthread_setspecific(metrics_key, block);
+	thread_metrics = block;
+	return block;
+}
+
+/* only the owner writes into a block, so a relaxed load and store is enough */
+static inline void
+metrics_add(atomic_ullong *var, unsigned long long value)
+{
+	atomic_store_explicit(var, atomic_load_explicit(var, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+/* returns the monotonic time in nanoseconds */
+unsigned long long
+metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+metrics_inc(metrics_counter counter, unsigned long long value)
+{
+	struct metrics_thread *block;
+
+	block = metrics_thread_get();
+	if (block) {
+		metrics_add(&block->counters[counter], value);
+	}
+}
+
+/* records a duration in the histogram of a stage */
+void
+metrics_record(metrics_stage stage, unsigned long long elapsed)
+{
+	struct metrics_thread *block;
+	int bucket;
+
+	block = metrics_thread_get();
+	if (!block) {
+		return;
+	}
+
+	/* bucket i is served as le 2^i, so it holds (2^(i-1), 2^i], an exact power of two included */
+	bucket = (elapsed > 1) ? 64 - __builtin_clzll(elapsed - 1) : 0;
+	if (bucket >= METRICS_BUCKETS) {
+		bucket = METRICS_BUCKETS - 1;
+	}
+
+	metrics_add(&block->stages[stage].count, 1);
+	metrics_add(&block->stages[stage].sum_ns, elapsed);
+	metrics_add(&block->stages[stage].buckets[bucket], 1);
+}
+
+/* records the time elapsed since start_ns in the histogram of a stage, returns the current time */
+unsigned long long
+metrics_observe(metrics_stage stage, unsigned long long start_ns)
+{
+	unsigned long long now;
+
+	now = metrics_now();
+	metrics_record(stage, now - start_ns);
+	return now;
+}
+
+/* sets the function reading a gauge, NULL stops serving it */
+void
+metrics_gauge(metrics_gauge_id gauge, unsigned long long (*read)(void))
+{
+	atomic_store(&gauge_read[gauge], read);
+}
+
+/* writes all the metrics in the Prometheus text format */
+static void
+metrics_write(int fd)
+{
+	struct metrics_thread *block;
+	unsigned long long counters[METRIC_COUNT] = {0};
+	unsigned long long count[STAGE_COUNT] = {0}, sum[STAGE_COUNT] = {0};
+	unsigned long long buckets[STAGE_COUNT][METRICS_BUCKETS] = {{0}};
+	unsigned long long cumulative;
+	unsigned long long (*read)(void);
+	int i, j;
+
+	/* sum up the per-thread blocks */
+	for (block = atomic_load(&metrics_threads); block; block = block->next) {
+		for (i = 0; i < METRIC_COUNT; i++) {
+			counters[i] += atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+		}
+
+		for (i = 0; i < STAGE_COUNT; i++) {
+			count[i] += atomic_load_explicit(&block->stages[i].count, memory_order_relaxed);
+			sum[i] += atomic_load_explicit(&block->stages[i].sum_ns, memory_order_relaxed);
+			for (j = 0; j < METRICS_BUCKETS; j++) {
+				buckets[i][j] += atomic_load_explicit(&block->stages[i].buckets[j], memory_order_relaxed);
+			}
+		}
+	}
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		dprintf(fd, "# HELP %s %s\n", counter_desc[i].name, counter_desc[i].help);
+		dprintf(fd, "# TYPE %s counter\n", counter_desc[i].name);
+		dprintf(fd, "%s %llu\n", counter_desc[i].name, counters[i]);
+	}
+
+	for (i = 0; i < GAUGE_COUNT; i++) {
+		read = atomic_load(&gauge_read[i]);
+		if (!read) {
+			continue;
+		}
+		dprintf(fd, "# HELP %s %s\n", gauge_desc[i].name, gauge_desc[i].help);
+		dprintf(fd, "# TYPE %s gauge\n", gauge_desc[i].name);
+		dprintf(fd, "%s %llu\n", gauge_desc[i].name, read());
+	}
+
+	dprintf(fd, "# HELP ipkpd_stage_latency_seconds Time spent in each stage of handling a request.\n");
+	dprintf(fd, "# TYPE ipkpd_stage_latency_seconds histogram\n");
+	for (i = 0; i < STAGE_COUNT; i++) {
+		cumulative = 0;
+		for (j = 0; j < METRICS_BUCKETS - 1; j++) {
+			cumulative += buckets[i][j];
+			dprintf(fd, "ipkpd_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+					stage_names[i], (double)(1ULL << j) / 1e9, cumulative);
+		}
+		dprintf(fd, "ipkpd_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[i], count[i]);
+		dprintf(fd, "ipkpd_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[i], (double)sum[i] / 1e9);
+		dprintf(fd, "ipkpd_stage_latency_seconds_count{stage=\"%s\"} %llu\n", stage_names[i], count[i]);
+	}
+}
+
+/* serves the stats socket, every connected client gets a snapshot of the metrics */
+static void *
+metrics_serve(void *arg)
+{
+	int client;
+	fd_set readfds;
+	struct timeval timeout;
+
+	(void) arg;
+
+	while (!exit_application) {
+		FD_ZERO(&readfds);
+		FD_SET(stats.sock, &readfds);
+
+		/* wake up every second to check if the server is exiting */
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+
+		if (select(stats.sock + 1, &readfds, NULL, NULL, &timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			ERR("Select failed (%s).", strerror(errno));
+			break;
+		}
+
+		if (FD_ISSET(stats.sock, &readfds)) {
+			client = accept(stats.sock, NULL, NULL);
+			if (client < 0) {
+				continue;
+			}
+
+			metrics_write(client);
+			close(client);
+		}
+	}
+
+	return NULL;
+}
+
+/* starts serving the metrics on a unix socket, metrics are collected even without it */
+int
+metrics_init(const char *path)
+{
+	struct sockaddr_un sa;
+	struct stat st;
+
+	if (!path) {
+		return 0;
+	}
+
+	if (strlen(path) >= sizeof sa.sun_path) {
+		ERR("Stats socket path too long.");
+		return -1;
+	}
+
+	stats.sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (stats.sock < 0) {
+		ERR("Creating stats socket failed (%s).", strerror(errno));
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	strcpy(stats.path, path);
+
+	/* remove a stale socket of a previous run */
+	unlink(path);
+
+	if (bind(stats.sock, (struct sockaddr *) &sa, sizeof sa) || listen(stats.sock, SOCKET_BACKLOG)) {
+		ERR("Binding stats socket failed (%s).", strerror(errno));
+		close(stats.sock);
+		return -1;
+	}
+
+	/* a new process taking over may have replaced the socket file meanwhile, only ours is removed on exit */
+	if (!stat(path, &st)) {
+		stats.ino = st.st_ino;
+	}
+
+	if (pthread_create(&stats.tid, NULL, metrics_serve, NULL)) {
+		ERR("Creating stats thread failed.");
+		close(stats.sock);
+		unlink(path);
+		return -1;
+	}
+
+	stats.running = 1;
+	return 0;
+}
+
+void
+metrics_destroy(void)
+{
+	struct stat st;
+
+	if (!stats.running) {
+		return;
+	}
+
+	pthread_join(stats.tid, NULL);
+	close(stats.sock);
+	if (!stat(stats.path, &st) && (st.st_ino == stats.ino)) {
+		unlink(stats.path);
+	}
+	stats.running = 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: metrics.h
+ * Desc: Server metrics, counters and latency histograms header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdatomic.h>
+
+/* number of latency histogram buckets, bucket i holds latencies up to 2^i ns */
+#define METRICS_BUCKETS 32
+
+/* the stages of handling a request */
+typedef enum {
+	STAGE_ACCEPT,
+	STAGE_RECV,
+	STAGE_PARSE,
+	STAGE_QUEUE,
+	STAGE_TREE,
+	STAGE_EVAL,
+	STAGE_SEND,
+	STAGE_COUNT
+} metrics_stage;
+
+typedef enum {
+	METRIC_CONNECTIONS,
+	METRIC_TCP_REQUESTS,
+	METRIC_UDP_REQUESTS,
+	METRIC_SHM_REQUESTS,
+	METRIC_ERRORS,
+	METRIC_BYTES_RECEIVED,
+	METRIC_BYTES_SENT,
+	METRIC_RATE_LIMITED,
+	METRIC_SHED,
+	METRIC_BATCH_ITEMS,
+	METRIC_COALESCED,
+	METRIC_COUNT
+} metrics_counter;
+
+/* the values which are read only when the metrics are served */
+typedef enum {
+	GAUGE_WORK_QUEUE,
+	GAUGE_COMPLETION_QUEUE,
+	GAUGE_COUNT
+} metrics_gauge_id;
+
+struct metrics_histogram {
+	atomic_ullong count;
+	atomic_ullong sum_ns;
+	atomic_ullong buckets[METRICS_BUCKETS];
+};
+
+/* per-thread metrics block, written only by the thread which owns it */
+struct metrics_thread {
+	atomic_ullong counters[METRIC_COUNT];
+	struct metrics_histogram stages[STAGE_COUNT];
+	atomic_int in_use;
+	struct metrics_thread *next;
+};
+
+unsigned long long metrics_now(void);
+
+void metrics_inc(metrics_counter counter, unsigned long long value);
+
+unsigned long long metrics_observe(metrics_stage stage, unsigned long long start_ns);
+
+void metrics_record(metrics_stage stage, unsigned long long elapsed);
+
+void metrics_gauge(metrics_gauge_id gauge, unsigned long long (*read)(void));
+
+int metrics_init(const char *path);
+
+void metrics_destroy(void);
+
+#endif
@@ -0,0 +1,820 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: num.c
+ * Desc: Integer arithmetic with a 64-bit fast path and an arbitrary precision fallback
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "num.h"
+
+/* the greatest power of ten fitting into a limb */
+#define LIMB_DECIMAL 1000000000U
+#define LIMB_DECIMAL_DIGITS 9
+
+static const uint32_t pow10[LIMB_DECIMAL_DIGITS + 1] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+/* a read-only view of the magnitude of a number, a small number is spread into the local limbs */
+struct mag {
+	const uint32_t *limbs;
+	int len;
+	int neg;
+	uint32_t buf[2];
+};
+
+void
+num_init(struct num *n)
+{
+	memset(n, 0, sizeof *n);
+}
+
+void
+num_free(struct num *n)
+{
+	if (n->limbs) {
+		free(n->limbs);
+	}
+	num_init(n);
+}
+
+void
+num_swap(struct num *a, struct num *b)
+{
+	struct num tmp;
+
+	tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+void
+num_set_int(struct num *n, long long value)
+{
+	n->big = 0;
+	n->neg = 0;
+	n->small = value;
+}
+
+int
+num_sign(const struct num *n)
+{
+	if (n->big) {
+		return n->neg ? -1 : 1;
+	}
+
+	return (n->small > 0) - (n->small < 0);
+}
+
+static int
+num_reserve(struct num *n, int cap)
+{
+	uint32_t *limbs;
+
+	if (cap > NUM_MAX_LIMBS) {
+		return NUM_TOO_LARGE;
+	}
+
+	if (cap <= n->cap) {
+		return 0;
+	}
+
+	limbs = realloc(n->limbs, cap * sizeof *limbs);
+	if (!limbs) {
+		return NUM_NO_MEMORY;
+	}
+
+	n->limbs = limbs;
+	n->cap = cap;
+	return 0;
+}
+
+/* copies the value of a number, the limbs of the copy are reused */
+int
+num_copy(struct num *r, const struct num *a)
+{
+	int ret;
+
+	if (!a->big) {
+		num_set_int(r, a->small);
+		return 0;
+	}
+
+	ret = num_reserve(r, a->len);
+	if (ret) {
+		return ret;
+	}
+
+	memcpy(r->limbs, a->limbs, a->len * sizeof *r->limbs);
+	r->len = a->len;
+	r->neg = a->neg;
+	r->big = 1;
+	return 0;
+}
+
+/* strips the leading zero limbs and moves the number back into a machine word if it fits */
+static void
+num_normalize(struct num *n)
+{
+	unsigned long long value;
+
+	while (n->len && !n->limbs[n->len - 1]) {
+		n->len--;
+	}
+	if (!n->len) {
+		n->neg = 0;
+	}
+
+	if (n->len > 2) {
+		n->big = 1;
+		return;
+	}
+
+	value = n->len ? n->limbs[0] : 0;
+	if (n->len == 2) {
+		value |= (unsigned long long)n->limbs[1] << 32;
+	}
+
+	if (!n->neg && (value <= LLONG_MAX)) {
+		n->small = value;
+	} else if (n->neg && (value - 1 <= LLONG_MAX)) {
+		n->small = -(long long)(value - 1) - 1;
+	} else {
+		n->big = 1;
+		return;
+	}
+
+	n->big = 0;
+	n->neg = 0;
+}
+
+/* sets the result of a fast path which did not fit into a machine word */
+static int
+num_set_wide(struct num *n, __int128 value)
+{
+	unsigned __int128 mag;
+	int ret, i;
+
+	ret = num_reserve(n, 4);
+	if (ret) {
+		return ret;
+	}
+
+	n->neg = value < 0;
+	mag = n->neg ? -(unsigned __int128)value : (unsigned __int128)value;
+	for (i = 0; i < 4; i++) {
+		n->limbs[i] = (uint32_t)(mag >> (32 * i));
+	}
+	n->len = 4;
+	num_normalize(n);
+	return 0;
+}
+
+static void
+num_view(const struct num *n, struct mag *m)
+{
+	unsigned long long value;
+
+	if (n->big) {
+		m->limbs = n->limbs;
+		m->len = n->len;
+		m->neg = n->neg;
+		return;
+	}
+
+	m->neg = n->small < 0;
+	value = m->neg ? -(unsigned long long)n->small : (unsigned long long)n->small;
+	m->buf[0] = (uint32_t)value;
+	m->buf[1] = (uint32_t)(value >> 32);
+	m->limbs = m->buf;
+	m->len = m->buf[1] ? 2 : (m->buf[0] ? 1 : 0);
+}
+
+static int
+mag_cmp(const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+	int i;
+
+	if (an != bn) {
+		return (an > bn) ? 1 : -1;
+	}
+
+	for (i = an - 1; i >= 0; i--) {
+		if (a[i] != b[i]) {
+			return (a[i] > b[i]) ? 1 : -1;
+		}
+	}
+
+	return 0;
+}
+
+/* r = a + b for an >= bn, r has an + 1 limbs, returns the length of r */
+static int
+mag_add(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+	unsigned long long t, carry = 0;
+	int i;
+
+	for (i = 0; i < bn; i++) {
+		t = (unsigned long long)a[i] + b[i] + carry;
+		r[i] = (uint32_t)t;
+		carry = t >> 32;
+	}
+
+	for (; i < an; i++) {
+		t = (unsigned long long)a[i] + carry;
+		r[i] = (uint32_t)t;
+		carry = t >> 32;
+	}
+
+	r[an] = (uint32_t)carry;
+	return an + 1;
+}
+
+/* r = a - b for a >= b, r has an limbs and may be a */
+static void
+mag_sub(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+	long long t, borrow = 0;
+	int i;
+
+	for (i = 0; i < bn; i++) {
+		t = (long long)a[i] - b[i] - borrow;
+		r[i] = (uint32_t)t;
+		borrow = t < 0;
+	}
+
+	for (; i < an; i++) {
+		t = (long long)a[i] - borrow;
+		r[i] = (uint32_t)t;
+		borrow = t < 0;
+	}
+}
+
+/* r += a, where the sum is known to fit into rn limbs */
+static void
+mag_add_into(uint32_t *r, int rn, const uint32_t *a, int an)
+{
+	unsigned long long t, carry = 0;
+	int i;
+
+	for (i = 0; i < an; i++) {
+		t = (unsigned long long)r[i] + a[i] + carry;
+		r[i] = (uint32_t)t;
+		carry = t >> 32;
+	}
+
+	for (; carry && (i < rn); i++) {
+		t = (unsigned long long)r[i] + carry;
+		r[i] = (uint32_t)t;
+		carry = t >> 32;
+	}
+}
+
+static void
+mag_mul_school(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+	unsigned long long t, carry;
+	int i, j;
+
+	memset(r, 0, (an + bn) * sizeof *r);
+
+	for (i = 0; i < bn; i++) {
+		if (!b[i]) {
+			continue;
+		}
+
+		carry = 0;
+		for (j = 0; j < an; j++) {
+			t = (unsigned long long)a[j] * b[i] + r[i + j] + carry;
+			r[i + j] = (uint32_t)t;
+			carry = t >> 32;
+		}
+		r[i + an] = (uint32_t)carry;
+	}
+}
+
+static int mag_mul(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn);
+
+/* a is at least twice as long as b, it is multiplied in pieces of the length of b */
+static int
+mag_mul_unbalanced(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+	uint32_t *piece;
+	int i, len, ret = 0;
+
+	piece = malloc(2 * bn * sizeof *piece);
+	if (!piece) {
+		return NUM_NO_MEMORY;
+	}
+
+	memset(r, 0, (an + bn) * sizeof *r);
+	for (i = 0; i < an; i += bn) {
+		len = (an - i < bn) ? an - i : bn;
+		ret = mag_mul(piece, a + i, len, b, bn);
+		if (ret) {
+			break;
+		}
+		mag_add_into(r + i, an + bn - i, piece, len + bn);
+	}
+
+	free(piece);
+	return ret;
+}
+
+/*
+ * Karatsuba's method for an / 2 < bn <= an. With a = a1 * B^m + a0 and b = b1 * B^m + b0
+ * the product is z2 * B^2m + z1 * B^m + z0, where z0 = a0 * b0, z2 = a1 * b1 and
+ * z1 = (a0 + a1) * (b0 + b1) - z0 - z2, so three multiplications of half the length are enough.
+ */
+static int
+mag_mul_karatsuba(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+	uint32_t *tmp, *sa, *sb, *z1;
+	int m, san, sbn, z1n, ret;
+
+	m = an / 2;
+
+	/* z0 and z2 go right into their place in the result */
+	ret = mag_mul(r, a, m, b, m);
+	if (ret) {
+		return ret;
+	}
+	ret = mag_mul(r + 2 * m, a + m, an - m, b + m, bn - m);
+	if (ret) {
+		return ret;
+	}
+
+	tmp = malloc((4 * an + 4) * sizeof *tmp);
+	if (!tmp) {
+		return NUM_NO_MEMORY;
+	}
+	sa = tmp;
+	sb = sa + an + 1;
+	z1 = sb + an + 1;
+
+	san = mag_add(sa, a + m, an - m, a, m);
+	if (bn - m >= m) {
+		sbn = mag_add(sb, b + m, bn - m, b, m);
+	} else {
+		sbn = mag_add(sb, b, m, b + m, bn - m);
+	}
+
+	ret = mag_mul(z1, sa, san, sb, sbn);
+	if (ret) {
+		goto cleanup;
+	}
+
+	z1n = san + sbn;
+	mag_sub(z1, z1, z1n, r, 2 * m);
+	mag_sub(z1, z1, z1n, r + 2 * m, an + bn - 2 * m);
+	while (z1n && !z1[z1n - 1]) {
+		z1n--;
+	}
+
+	mag_add_into(r + m, an + bn - m, z1, z1n);
+
+cleanup:
+	free(tmp);
+	return ret;
+}
+
+/* r = a * b, r has an + bn limbs and must not overlap the operands */
+static int
+mag_mul(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+	const uint32_t *t;
+	int tn;
+
+	if (an < bn) {
+		t = a;
+		a = b;
+		b = t;
+		tn = an;
+		an = bn;
+		bn = tn;
+	}
+
+	if (bn < KARATSUBA_THRESHOLD) {
+		mag_mul_school(r, a, an, b, bn);
+		return 0;
+	} else if (2 * bn <= an) {
+		return mag_mul_unbalanced(r, a, an, b, bn);
+	}
+
+	return mag_mul_karatsuba(r, a, an, b, bn);
+}
+
+/* q = a / d, q has an limbs and may be a, returns the remainder */
+static uint32_t
+mag_div_small(uint32_t *q, const uint32_t *a, int an, uint32_t d)
+{
+	unsigned long long cur, rem = 0;
+	int i;
+
+	for (i = an - 1; i >= 0; i--) {
+		cur = (rem << 32) | a[i];
+		q[i] = (uint32_t)(cur / d);
+		rem = cur % d;
+	}
+
+	return (uint32_t)rem;
+}
+
+/*
+ * q = a / b for an >= bn >= 2 by Knuth's algorithm D (The Art of Computer Programming, vol. 2, 4.3.1),
+ * q has an - bn + 1 limbs
+ */
+static int
+mag_div(uint32_t *q, const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+	uint32_t *un, *vn;
+	unsigned long long num, qhat, rhat, p;
+	long long t, k;
+	int s, i, j;
+
+	un = malloc((an + 1 + bn) * sizeof *un);
+	if (!un) {
+		return NUM_NO_MEMORY;
+	}
+	vn = un + an + 1;
+
+	/* shift both so that the top bit of the divisor is set, which keeps the estimates of qhat close */
+	s = __builtin_clz(b[bn - 1]);
+	for (i = bn - 1; i > 0; i--) {
+		vn[i] = (b[i] << s) | (s ? (uint32_t)((unsigned long long)b[i - 1] >> (32 - s)) : 0);
+	}
+	vn[0] = b[0] << s;
+
+	un[an] = s ? (uint32_t)((unsigned long long)a[an - 1] >> (32 - s)) : 0;
+	for (i = an - 1; i > 0; i--) {
+		un[i] = (a[i] << s) | (s ? (uint32_t)((unsigned long long)a[i - 1] >> (32 - s)) : 0);
+	}
+	un[0] = a[0] << s;
+
+	for (j = an - bn; j >= 0; j--) {
+		/* estimate the quotient digit from the top two limbs, it is at most two too large */
+		num = ((unsigned long long)un[j + bn] << 32) | un[j + bn - 1];
+		qhat = num / vn[bn - 1];
+		rhat = num % vn[bn - 1];
+		while ((qhat >> 32) || (qhat * vn[bn - 2] > ((rhat << 32) | un[j + bn - 2]))) {
+			qhat--;
+			rhat += vn[bn - 1];
+			if (rhat >> 32) {
+				break;
+			}
+		}
+
+		/* multiply and subtract */
+		k = 0;
+		for (i = 0; i < bn; i++) {
+			p = qhat * vn[i];
+			t = (long long)un[i + j] - k - (long long)(p & 0xFFFFFFFFULL);
+			un[i + j] = (uint32_t)t;
+			k = (long long)(p >> 32) - (t >> 32);
+		}
+		t = (long long)un[j + bn] - k;
+		un[j + bn] = (uint32_t)t;
+
+		q[j] = (uint32_t)qhat;
+		if (t < 0) {
+			/* the estimate was one too large, add the divisor back */
+			q[j]--;
+			k = 0;
+			for (i = 0; i < bn; i++) {
+				t = (long long)un[i + j] + vn[i] + k;
+				un[i + j] = (uint32_t)t;
+				k = t >> 32;
+			}
+			un[j + bn] += (uint32_t)k;
+		}
+	}
+
+	free(un);
+	return 0;
+}
+
+/* n = n * mul + add for a non-negative n */
+int
+num_mul_add(struct num *n, uint32_t mul, uint32_t add)
+{
+	unsigned long long t, carry;
+	long long value;
+	int ret, i;
+
+	if (!n->big) {
+		if (!__builtin_mul_overflow(n->small, (long long)mul, &value) &&
+				!__builtin_add_overflow(value, (long long)add, &value)) {
+			n->small = value;
+			return 0;
+		}
+
+		return num_set_wide(n, (__int128)n->small * mul + add);
+	}
+
+	ret = num_reserve(n, n->len + 1);
+	if (ret) {
+		return ret;
+	}
+
+	carry = add;
+	for (i = 0; i < n->len; i++) {
+		t = (unsigned long long)n->limbs[i] * mul + carry;
+		n->limbs[i] = (uint32_t)t;
+		carry = t >> 32;
+	}
+
+	if (carry) {
+		n->limbs[n->len++] = (uint32_t)carry;
+	}
+
+	return 0;
+}
+
+/* parses a decimal number of len digits */
+int
+num_parse(struct num *n, const char *str, int len)
+{
+	uint32_t chunk;
+	long long value = 0;
+	int i = 0, j, step, ret;
+
+	if (len < 19) {
+		/* always fits into a machine word */
+		for (; i < len; i++) {
+			value = value * 10 + (str[i] - '0');
+		}
+		num_set_int(n, value);
+		return 0;
+	}
+
+	num_set_int(n, 0);
+
+	/* the digits are taken by nine, the first chunk gets the remainder */
+	while (i < len) {
+		step = (i || !(len % LIMB_DECIMAL_DIGITS)) ? LIMB_DECIMAL_DIGITS : len % LIMB_DECIMAL_DIGITS;
+		for (chunk = 0, j = 0; j < step; j++, i++) {
+			chunk = chunk * 10 + (str[i] - '0');
+		}
+
+		ret = num_mul_add(n, pow10[step], chunk);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* r = a + b for a and b of the given signs, handles both the addition and the subtraction */
+static int
+num_add_signed(struct num *r, const struct mag *a, const struct mag *b, int bneg)
+{
+	const struct mag *t;
+	int ret, cmp;
+
+	if (a->neg == bneg) {
+		/* the magnitudes are added */
+		if (a->len < b->len) {
+			t = a;
+			a = b;
+			b = t;
+		}
+
+		ret = num_reserve(r, a->len + 1);
+		if (ret) {
+			return ret;
+		}
+
+		r->len = mag_add(r->limbs, a->limbs, a->len, b->limbs, b->len);
+		r->neg = bneg;
+	} else {
+		/* the smaller magnitude is subtracted from the greater one, which gives the sign */
+		cmp = mag_cmp(a->limbs, a->len, b->limbs, b->len);
+		if (cmp < 0) {
+			t = a;
+			a = b;
+			b = t;
+		}
+
+		ret = num_reserve(r, a->len);
+		if (ret) {
+			return ret;
+		}
+
+		mag_sub(r->limbs, a->limbs, a->len, b->limbs, b->len);
+		r->len = a->len;
+		r->neg = (cmp < 0) ? bneg : !bneg;
+	}
+
+	num_normalize(r);
+	return 0;
+}
+
+/* r = a + b, r must not be an operand */
+int
+num_add(struct num *r, const struct num *a, const struct num *b)
+{
+	struct mag ma, mb;
+	long long value;
+
+	if (!a->big && !b->big) {
+		if (!__builtin_add_overflow(a->small, b->small, &value)) {
+			num_set_int(r, value);
+			return 0;
+		}
+
+		return num_set_wide(r, (__int128)a->small + b->small);
+	}
+
+	num_view(a, &ma);
+	num_view(b, &mb);
+	return num_add_signed(r, &ma, &mb, mb.neg);
+}
+
+/* r = a - b, r must not be an operand */
+int
+num_sub(struct num *r, const struct num *a, const struct num *b)
+{
+	struct mag ma, mb;
+	long long value;
+
+	if (!a->big && !b->big) {
+		if (!__builtin_sub_overflow(a->small, b->small, &value)) {
+			num_set_int(r, value);
+			return 0;
+		}
+
+		return num_set_wide(r, (__int128)a->small - b->small);
+	}
+
+	num_view(a, &ma);
+	num_view(b, &mb);
+	return num_add_signed(r, &ma, &mb, !mb.neg);
+}
+
+/* r = a * b, r must not be an operand */
+int
+num_mul(struct num *r, const struct num *a, const struct num *b)
+{
+	struct mag ma, mb;
+	long long value;
+	int ret;
+
+	if (!a->big && !b->big) {
+		if (!__builtin_mul_overflow(a->small, b->small, &value)) {
+			num_set_int(r, value);
+			return 0;
+		}
+
+		/* the product of two words always fits into 128 bits */
+		return num_set_wide(r, (__int128)a->small * b->small);
+	}
+
+	num_view(a, &ma);
+	num_view(b, &mb);
+	if (!ma.len || !mb.len) {
+		num_set_int(r, 0);
+		return 0;
+	}
+
+	ret = num_reserve(r, ma.len + mb.len);
+	if (ret) {
+		return ret;
+	}
+
+	ret = mag_mul(r->limbs, ma.limbs, ma.len, mb.limbs, mb.len);
+	if (ret) {
+		return ret;
+	}
+
+	r->len = ma.len + mb.len;
+	r->neg = ma.neg != mb.neg;
+	num_normalize(r);
+	return 0;
+}
+
+/* r = a / b rounded towards zero, r must not be an operand */
+int
+num_div(struct num *r, const struct num *a, const struct num *b)
+{
+	struct mag ma, mb;
+	int ret;
+
+	if (!num_sign(b)) {
+		return NUM_DIV_ZERO;
+	}
+
+	if (!a->big && !b->big) {
+		if ((a->small == LLONG_MIN) && (b->small == -1)) {
+			return num_set_wide(r, -(__int128)a->small);
+		}
+
+		num_set_int(r, a->small / b->small);
+		return 0;
+	}
+
+	num_view(a, &ma);
+	num_view(b, &mb);
+	if (mag_cmp(ma.limbs, ma.len, mb.limbs, mb.len) < 0) {
+		num_set_int(r, 0);
+		return 0;
+	}
+
+	ret = num_reserve(r, ma.len);
+	if (ret) {
+		return ret;
+	}
+
+	if (mb.len == 1) {
+		mag_div_small(r->limbs, ma.limbs, ma.len, mb.limbs[0]);
+		r->len = ma.len;
+	} else {
+		ret = mag_div(r->limbs, ma.limbs, ma.len, mb.limbs, mb.len);
+		if (ret) {
+			return ret;
+		}
+		r->len = ma.len - mb.len + 1;
+	}
+
+	r->neg = ma.neg != mb.neg;
+	num_normalize(r);
+	return 0;
+}
+
+/* the size of a buffer the decimal representation fits into, including the sign and the terminator */
+int
+num_str_size(const struct num *n)
+{
+	/* a limb has less than 10 decimal digits, a machine word less than 20 */
+	return (n->big ? n->len * 10 : 20) + 2;
+}
+
+/* writes the digits of value, padded with zeroes to width, returns the number of written digits */
+static int
+write_digits(char *buf, unsigned long long value, int width)
+{
+	char digits[20];
+	int len = 0;
+
+	do {
+		digits[len++] = '0' + value % 10;
+		value /= 10;
+	} while (value || (len < width));
+
+	for (width = 0; width < len; width++) {
+		buf[width] = digits[len - width - 1];
+	}
+
+	return len;
+}
+
+/* writes the decimal representation into buf of num_str_size() bytes, returns its length */
+int
+num_to_str(const struct num *n, char *buf)
+{
+	uint32_t *mag, *groups;
+	int len = 0, mlen, count = 0;
+
+	if (!n->big) {
+		if (n->small < 0) {
+			buf[len++] = '-';
+		}
+		len += write_digits(buf + len, (n->small < 0) ? -(unsigned long long)n->small : (unsigned long long)n->small, 1);
+		buf[len] = '\0';
+		return len;
+	}
+
+	/* split the magnitude into groups of nine decimal digits, the least significant first */
+	mag = malloc((3 * n->len + 1) * sizeof *mag);
+	if (!mag) {
+		return NUM_NO_MEMORY;
+	}
+	groups = mag + n->len;
+
+	memcpy(mag, n->limbs, n->len * sizeof *mag);
+	mlen = n->len;
+	while (mlen) {
+		groups[count++] = mag_div_small(mag, mag, mlen, LIMB_DECIMAL);
+		while (mlen && !mag[mlen - 1]) {
+			mlen--;
+		}
+	}
+
+	if (n->neg) {
+		buf[len++] = '-';
+	}
+	len += write_digits(buf + len, groups[--count], 1);
+	while (count) {
+		len += write_digits(buf + len, groups[--count], LIMB_DECIMAL_DIGITS);
+	}
+	buf[len] = '\0';
+
+	free(mag);
+	return len;
+}
@@ -0,0 +1,67 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: num.h
+ * Desc: Integer arithmetic with a 64-bit fast path and an arbitrary precision fallback header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _NUM_H_
+#define _NUM_H_
+
+#include <stdint.h>
+
+/* operands of at least this many limbs are multiplied by Karatsuba's method */
+#define KARATSUBA_THRESHOLD 32
+
+/* numbers are capped at this many limbs, which is over 600000 decimal digits */
+#define NUM_MAX_LIMBS 65536
+
+/* return values of the arithmetic, 0 means success */
+#define NUM_NO_MEMORY -1
+#define NUM_DIV_ZERO 1
+#define NUM_TOO_LARGE 2
+
+/*
+ * An integer, kept in a machine word while it fits. Only when it does not, its magnitude is kept
+ * in 32-bit limbs, least significant first. The limbs stay allocated when the number becomes small
+ * again, so a reused number does not allocate over and over.
+ */
+struct num {
+	int big;
+	int neg;
+	long long small;
+	int len;
+	int cap;
+	uint32_t *limbs;
+};
+
+void num_init(struct num *n);
+
+void num_free(struct num *n);
+
+void num_swap(struct num *a, struct num *b);
+
+void num_set_int(struct num *n, long long value);
+
+int num_sign(const struct num *n);
+
+int num_copy(struct num *r, const struct num *a);
+
+int num_mul_add(struct num *n, uint32_t mul, uint32_t add);
+
+int num_parse(struct num *n, const char *str, int len);
+
+int num_add(struct num *r, const struct num *a, const struct num *b);
+
+int num_sub(struct num *r, const struct num *a, const struct num *b);
+
+int num_mul(struct num *r, const struct num *a, const struct num *b);
+
+int num_div(struct num *r, const struct num *a, const struct num *b);
+
+int num_str_size(const struct num *n);
+
+int num_to_str(const struct num *n, char *buf);
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: overload.c
+ * Desc: Overload detection and early rejection of new work
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "overload.h"
+#include "server.h"
+
+/* the delay the requests may wait, 0 turns the overload control off */
+static unsigned long long target_ns;
+
+static unsigned long long interval_ns;
+
+static int depth_limit;
+
+/* number of requests in progress */
+static atomic_int depth;
+
+/* the minimum delay of the current interval, ULLONG_MAX while there is none */
+static atomic_ullong window_start;
+static atomic_ullong window_min = ULLONG_MAX;
+
+/* set when even the shortest delay of the last interval was above the target */
+static atomic_int overloaded;
+
+/* the control law, while overloaded the requests are rejected at a rate growing with the square root of their count */
+static struct {
+	atomic_flag lock;
+	unsigned int count;
+	unsigned long long next;
+} shedding = {.lock = ATOMIC_FLAG_INIT};
+
+/* the whole UDP response to a rejected request, it is made only once */
+static char response[3 + sizeof OVERLOAD_MESSAGE - 1];
+
+void
+overload_set_target(unsigned long long target_us)
+{
+	target_ns = target_us * 1000;
+}
+
+int
+overload_init(void)
+{
+	long cpus;
+
+	/* the full queue of the workers rejects the requests with it as well, even without a target */
+	response[0] = 1;
+	response[1] = 1;
+	response[2] = strlen(OVERLOAD_MESSAGE);
+	memcpy(response + 3, OVERLOAD_MESSAGE, strlen(OVERLOAD_MESSAGE));
+
+	if (!target_ns) {
+		return 0;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		cpus = 1;
+	}
+
+	interval_ns = target_ns * OVERLOAD_INTERVAL_FACTOR;
+	depth_limit = cpus * OVERLOAD_DEPTH_PER_CPU;
+	atomic_store(&window_start, metrics_now());
+
+	INF("Overload control with a target delay of %llu us and at most %d requests in progress.",
+			target_ns / 1000, depth_limit);
+	return 0;
+}
+
+/* lets the kernel stamp the datagrams of a UDP socket when they arrive, so that their wait can be measured */
+void
+overload_socket(int sock)
+{
+	const int on = 1;
+
+	if (!target_ns) {
+		return;
+	}
+
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on)) {
+		WRN("Enabling receive timestamps failed (%s).", strerror(errno));
+	}
+}
+
+/* returns how long a received datagram waited in the socket, 0 if it was not stamped */
+unsigned long long
+overload_sojourn(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	struct timespec arrived, now;
+	long long delay;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_TIMESTAMPNS)) {
+			continue;
+		}
+
+		/* the stamp is of the real time clock */
+		memcpy(&arrived, CMSG_DATA(cmsg), sizeof arrived);
+		clock_gettime(CLOCK_REALTIME, &now);
+		delay = (now.tv_sec - arrived.tv_sec) * 1000000000LL + (now.tv_nsec - arrived.tv_nsec);
+		return (delay > 0) ? delay : 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Records the delay of a request, 0 is an unknown one. Once an interval is over, the server is overloaded if even
+ * its shortest delay was above the target, since then the requests were queueing all the time, not in a short burst.
+ */
+void
+overload_record(unsigned long long delay_ns)
+{
+	unsigned long long now, start, last;
+
+	if (!target_ns || !delay_ns) {
+		return;
+	}
+
+	now = metrics_now();
+	start = atomic_load_explicit(&window_start, memory_order_relaxed);
+	if ((now - start >= interval_ns) &&
+			atomic_compare_exchange_strong(&window_start, &start, now)) {
+		/* only a single thread closes the interval */
+		last = atomic_exchange(&window_min, delay_ns);
+		if ((last != ULLONG_MAX) && (last > target_ns)) {
+			if (!atomic_exchange(&overloaded, 1)) {
+				WRN("Server overloaded, the requests waited at least %llu us.", last / 1000);
+			}
+		} else if (atomic_exchange(&overloaded, 0)) {
+			INF("Server no longer overloaded.");
+		}
+		return;
+	}
+
+	last = atomic_load_explicit(&window_min, memory_order_relaxed);
+	while ((delay_ns < last) &&
+			!atomic_compare_exchange_weak_explicit(&window_min, &last, delay_ns, memory_order_relaxed,
+			memory_order_relaxed));
+}
+
+/* integer square root, the control law needs no floating point */
+static unsigned long long
+overload_sqrt(unsigned long long value)
+{
+	unsigned long long root = 0, bit = 1ULL << 62;
+
+	while (bit > value) {
+		bit >>= 2;
+	}
+
+	while (bit) {
+		if (value >= root + bit) {
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+/* returns 1 if it is time for the next rejection of the control law */
+static int
+overload_shed(void)
+{
+	unsigned long long now;
+	int ret = 0;
+
+	now = metrics_now();
+	while (atomic_flag_test_and_set_explicit(&shedding.lock, memory_order_acquire));
+
+	if (!atomic_load_explicit(&overloaded, memory_order_relaxed)) {
+		/* the next overload starts with a single rejection per interval again */
+		shedding.count = 0;
+	} else if (!shedding.count || (now >= shedding.next)) {
+		shedding.count++;
+		/* the square root has 10 fractional bits */
+		shedding.next = now + (interval_ns << 10) / overload_sqrt((unsigned long long)shedding.count << 20);
+		ret = 1;
+	}
+
+	atomic_flag_clear_explicit(&shedding.lock, memory_order_release);
+	return ret;
+}
+
+/*
+ * Decides whether to handle a request which already waited for the given time. While the server is overloaded,
+ * the requests which waited longer than the target are rejected, more and more often until the delays get
+ * below the target, as the control law of CoDel does. A rejection is cheap, but it does not make a client, which
+ * sends its next request right away, go away, so rejecting everything late would leave almost no goodput.
+ * Returns 1 if the request should be handled, 0 if it should be rejected.
+ */
+int
+overload_admit(unsigned long long delay_ns)
+{
+	if (!target_ns) {
+		return 1;
+	}
+
+	overload_record(delay_ns);
+
+	if (((delay_ns > target_ns) && overload_shed()) ||
+			(atomic_load_explicit(&depth, memory_order_relaxed) >= depth_limit)) {
+		metrics_inc(METRIC_SHED, 1);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* returns 1 if new sessions should be refused */
+int
+overload_active(void)
+{
+	if (!target_ns) {
+		return 0;
+	}
+
+	if (atomic_load_explicit(&depth, memory_order_relaxed) >= depth_limit) {
+		return 1;
+	}
+
+	/* no delay was recorded for a whole interval, so nothing is queueing */
+	if (metrics_now() - atomic_load_explicit(&window_start, memory_order_relaxed) >= 2 * interval_ns) {
+		return 0;
+	}
+
+	return atomic_load_explicit(&overloaded, memory_order_relaxed);
+}
+
+/* a request is in progress from its first received bytes until its response is sent */
+void
+overload_enter(void)
+{
+	if (target_ns) {
+		atomic_fetch_add_explicit(&depth, 1, memory_order_relaxed);
+	}
+}
+
+void
+overload_leave(void)
+{
+	if (target_ns) {
+		atomic_fetch_sub_explicit(&depth, 1, memory_order_relaxed);
+	}
+}
+
+/* gets the prepared UDP response to a rejected request, returns its length */
+int
+overload_response(const char **buffer)
+{
+	*buffer = response;
+	return sizeof response;
+}
@@ -0,0 +1,43 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: overload.h
+ * Desc: Overload detection and early rejection of new work header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _OVERLOAD_H_
+#define _OVERLOAD_H_
+
+#include <sys/socket.h>
+
+/* the interval, over which the delays are watched, is this many times the target */
+#define OVERLOAD_INTERVAL_FACTOR 20
+
+/* more requests in progress than this per CPU means they queue for the CPU */
+#define OVERLOAD_DEPTH_PER_CPU 8
+
+/* the payload of the UDP response to a rejected request */
+#define OVERLOAD_MESSAGE "Server overloaded.\n"
+
+void overload_set_target(unsigned long long target_us);
+
+int overload_init(void);
+
+void overload_socket(int sock);
+
+unsigned long long overload_sojourn(struct msghdr *msg);
+
+void overload_record(unsigned long long delay_ns);
+
+int overload_admit(unsigned long long delay_ns);
+
+int overload_active(void);
+
+void overload_enter(void);
+
+void overload_leave(void);
+
+int overload_response(const char **buffer);
+
+#endif
@@ -15,8 +15,14 @@
 #include <string.h>
 
 #include "parser.h"
+#include "pool.h"
 #include "server.h"
 
+/* scales a number by the digits of a partially read chunk */
+static const uint32_t chunk_scale[10] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
 static int
 parse_operator(const char *operator, int *pos)
 {
@@ -114,7 +120,62 @@ tcp_parse_query(const char *query)
 	return 0;
 }
 
-/* UDP parser */
+/*
+ * Checks the framing of a batch, opcode, count and count times a length and a query of that length.
+ * The queries are parsed only when they are solved, a wrong one fails alone.
+ */
+static int
+udp_parse_batch(const char *request, int bytes)
+{
+	int count, pos = 2, len;
+
+	count = (unsigned char)request[1];
+	if (!count) {
+		ERR("Empty batch.");
+		return -1;
+	}
+
+	while (count--) {
+		if (pos >= bytes) {
+			ERR("Batch shorter than its count.");
+			return -1;
+		}
+
+		len = (unsigned char)request[pos];
+		if (!len || (pos + 1 + len > bytes)) {
+			ERR("Batch query of an invalid length.");
+			return -1;
+		}
+		pos += 1 + len;
+	}
+
+	if (pos != bytes) {
+		ERR("Batch longer than its count.");
+		return -1;
+	}
+
+	return bytes - 2;
+}
+
+/* checks that a query of a batch is a single expression of the given length */
+int
+udp_parse_item(const char *item, int len)
+{
+	char query[UCHAR_MAX + 1];
+	int pos = 0;
+
+	/* the item is followed by the next one, the parser has to stop at its end */
+	memcpy(query, item, len);
+	query[len] = '\0';
+
+	if (parse_expr(query, &pos) || (pos != len)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* UDP parser, returns the length of the payload */
 int
 udp_parse_request(const char *request, int bytes)
 {
@@ -126,6 +187,10 @@ udp_parse_request(const char *request, int bytes)
 		return -1;
 	}
 
+	if (request[0] == UDP_BATCH_REQUEST) {
+		return udp_parse_batch(request, bytes);
+	}
+
 	if (request[0]) {
 		/* check if it's request */
 		ERR("Expected opcode to be request.");
@@ -136,23 +201,31 @@ udp_parse_request(const char *request, int bytes)
 		return -1;
 	}
 
-	return request[1];
+	return (unsigned char)request[1];
 }
 
 /* creates a new tree node */
 struct node *
-new_node(char *value) {
+new_node(const char *value, int len) {
   struct node *node = NULL;
 
-  node = malloc(sizeof *node);
+  node = pool_alloc(&node_pool);
   if (!node) {
   	ERR("Memory allocation error.");
   	return NULL;
   }
 
-  node->value = strdup(value);
+  /* only a long number needs memory of its own */
+  if (len < NODE_VALUE_SIZE) {
+  	memcpy(node->inline_value, value, len);
+  	node->inline_value[len] = '\0';
+  	node->value = node->inline_value;
+  } else {
+  	node->value = strndup(value, len);
+  }
   if (!node->value) {
   	ERR("Memory allocation error.");
+  	pool_free(&node_pool, node);
   	return NULL;
   }
   node->left = NULL;
@@ -171,14 +244,16 @@ del_tree(struct node *tree)
 
 	del_tree(tree->left);
 	del_tree(tree->right);
-	free(tree->value);
-	free(tree);
+	if (tree->value != tree->inline_value) {
+		free(tree->value);
+	}
+	pool_free(&node_pool, tree);
 }
 
 static char *
 build_tree(struct node **tree, char *expr)
 {
-  char buffer[MAX_INT_LENGTH + 1] = {0};
+  const char *value;
   struct node *node;
   int digit_count = 0;
   int is_digit = 0;
@@ -192,21 +267,20 @@ build_tree(struct node **tree, char *expr)
       expr++;
     }
 
-    buffer[0] = *expr;
+    /* the literals are not limited in length, so the value is copied right from the expression */
+    value = expr;
+    digit_count = 1;
 
     if (isdigit(*expr)) {
       digit_count = 0;
       is_digit = 1;
       while (isdigit(*expr)) {
-        buffer[digit_count] = *expr;
         digit_count++;
         expr++;
       }
-
-      buffer[digit_count] = '\0';
     }
 
-    node = new_node(buffer);
+    node = new_node(value, digit_count);
     if (!node) {
       return NULL;
     }
@@ -252,37 +326,382 @@ new_tree(const char *expression, struct node **tree)
 	return 0;
 }
 
+/* applies an operator to its operands, shared by the tree and the streaming evaluation
+ * returns 0 on success, otherwise the error of the arithmetic
+ */
+static int
+apply_operator(char op, struct num *result, const struct num *left, const struct num *right)
+{
+	if (op == '+') {
+		return num_add(result, left, right);
+	} else if (op == '-') {
+		return num_sub(result, left, right);
+	} else if (op == '*') {
+		return num_mul(result, left, right);
+	} else {
+		return num_div(result, left, right);
+	}
+}
+
 /* calculates the answer from the tree
- * returns -1 on error
+ * returns 0 on success, otherwise the error of the arithmetic
  */
 int
-calculate_answer(struct node *tree)
+calculate_answer(struct node *tree, struct num *result)
 {
-	int left_val, right_val;
+	struct num left, right;
+	int ret;
 
 	if (!tree->left && !tree->right) {
 		/* it's a leaf */
-		return atoi(tree->value);
-	} else {
-		left_val = calculate_answer(tree->left);
-		right_val = calculate_answer(tree->right);
-		if (left_val == -1 || right_val == -1) {
-			ERR("Calculation failed.");
-			return -1;
+		return num_parse(result, tree->value, strlen(tree->value));
+	}
+
+	num_init(&left);
+	num_init(&right);
+
+	ret = calculate_answer(tree->left, &left);
+	if (!ret) {
+		ret = calculate_answer(tree->right, &right);
+	}
+	if (!ret) {
+		ret = apply_operator(tree->value[0], result, &left, &right);
+	}
+
+	num_free(&left);
+	num_free(&right);
+	return ret;
+}
+
+/* prepares the parser for a new request, the numbers keep their memory */
+void
+stream_reset(struct stream_parser *parser)
+{
+	parser->state = STREAM_COMMAND;
+	parser->command = NULL;
+	parser->pos = 0;
+	parser->batch = 0;
+	parser->binary = 0;
+	parser->depth = 0;
+	parser->error = 0;
+}
+
+/* prepares the parser for a query of a binary frame, which has no command and no LF, but may have binary literals */
+void
+stream_query(struct stream_parser *parser)
+{
+	stream_reset(parser);
+	parser->binary = 1;
+	parser->state = STREAM_QUERY;
+}
+
+/* the frame of the parentheses at the given depth, counted from 0 */
+static struct stream_frame *
+stream_frame(struct stream_parser *parser, int depth)
+{
+	if (depth < STREAM_INLINE_FRAMES) {
+		return &parser->frames[depth];
+	}
+
+	return &parser->stack[depth - STREAM_INLINE_FRAMES];
+}
+
+/* makes room for one more open parenthesis, returns 0 on success, otherwise the error of the arithmetic */
+static int
+stream_push(struct stream_parser *parser)
+{
+	struct stream_frame *stack;
+	int capacity;
+
+	if (parser->depth == STREAM_INLINE_FRAMES + parser->capacity) {
+		/* the frames past the inline ones double, the new ones hold no memory yet */
+		capacity = parser->capacity ? parser->capacity * 2 : STREAM_INLINE_FRAMES;
+		if (capacity > MAX_STACK_SIZE - STREAM_INLINE_FRAMES) {
+			capacity = MAX_STACK_SIZE - STREAM_INLINE_FRAMES;
 		}
 
-		if (!strcmp(tree->value, "+")) {
-			return left_val + right_val;
-		} else if (!strcmp(tree->value, "-")) {
-			return left_val - right_val;
-		} else if (!strcmp(tree->value, "*")) {
-			return left_val * right_val;
-		} else {
-			if (right_val == 0) {
-				ERR("Division by zero attempted.");
-				return INT_MIN;
+		stack = realloc(parser->stack, capacity * sizeof *stack);
+		if (!stack) {
+			return NUM_NO_MEMORY;
+		}
+		memset(stack + parser->capacity, 0, (capacity - parser->capacity) * sizeof *stack);
+		parser->stack = stack;
+		parser->capacity = capacity;
+	}
+
+	stream_frame(parser, parser->depth)->operands = 0;
+	parser->depth++;
+	if (parser->depth > parser->deepest) {
+		parser->deepest = parser->depth;
+	}
+
+	return 0;
+}
+
+/* frees the memory of the numbers of the frames which were used and the stack */
+void
+stream_free(struct stream_parser *parser)
+{
+	struct stream_frame *frame;
+	int i;
+
+	for (i = 0; i < parser->deepest; i++) {
+		frame = stream_frame(parser, i);
+		num_free(&frame->left);
+		num_free(&frame->right);
+	}
+	free(parser->stack);
+	parser->stack = NULL;
+	parser->capacity = 0;
+	parser->deepest = 0;
+	num_free(&parser->result);
+}
+
+/* the place of the next operand of the innermost open expression, or of the result */
+static struct num *
+stream_slot(struct stream_parser *parser)
+{
+	struct stream_frame *top;
+
+	if (!parser->depth) {
+		return &parser->result;
+	}
+
+	top = stream_frame(parser, parser->depth - 1);
+	return top->operands ? &top->right : &top->left;
+}
+
+/* adds the digits of the chunk to the literal in the slot */
+static int
+stream_flush(struct stream_parser *parser)
+{
+	struct num *slot = stream_slot(parser);
+	int ret, low_len;
+
+	if (!parser->chunked) {
+		num_set_int(slot, 0);
+		parser->chunked = 1;
+	}
+
+	/* the chunk has up to 18 digits, it is added by nine */
+	low_len = (parser->chunk_len > 9) ? 9 : parser->chunk_len;
+	if (parser->chunk_len > 9) {
+		ret = num_mul_add(slot, chunk_scale[parser->chunk_len - 9], parser->chunk / 1000000000);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	ret = num_mul_add(slot, chunk_scale[low_len], parser->chunk % chunk_scale[low_len]);
+	parser->chunk = 0;
+	parser->chunk_len = 0;
+	return ret;
+}
+
+/* the digits of a literal are complete, the literal is stored in its slot */
+static int
+stream_literal(struct stream_parser *parser)
+{
+	if (!parser->chunked) {
+		num_set_int(stream_slot(parser), parser->chunk);
+		return 0;
+	}
+
+	return stream_flush(parser);
+}
+
+/* the operand in the slot is complete */
+static void
+stream_operand(struct stream_parser *parser)
+{
+	if (!parser->depth) {
+		/* the length of a binary frame tells where it ends */
+		parser->state = parser->binary ? STREAM_SOLVE : STREAM_LF;
+		return;
+	}
+
+	stream_frame(parser, parser->depth - 1)->operands++;
+	parser->state = STREAM_OPERAND;
+}
+
+/*
+ * Feeds the received bytes to the parser. Parses
+ *   solve = "SOLVE" SP query LF
+ *   solven = "SOLVEN" 1*(SP query) LF
+ *   bye = "BYE" LF
+ * and stops right after the LF, or at the first unexpected byte. The state is then one of
+ * STREAM_SOLVE (the result is in parser->result), STREAM_BYE or STREAM_ERROR, otherwise more
+ * bytes are needed. A batch also stops after every query but the last one in STREAM_NEXT, once
+ * its result is taken from parser->result, the next call goes on with the following query.
+ * The query of a binary frame, started by stream_query(), ends in STREAM_SOLVE right after it is complete,
+ * a bare decimal literal only once stream_end() is called at the end of the frame.
+ * Returns the number of consumed bytes, the rest belongs to the next request.
+ * The digits of a literal are collected in a machine word, only a literal longer than 18 digits
+ * is built in the arbitrary precision.
+ */
+int
+stream_feed(struct stream_parser *parser, const char *data, int len)
+{
+	struct stream_frame *top;
+	int i;
+	char c;
+
+	if (parser->state == STREAM_NEXT) {
+		parser->state = STREAM_QUERY;
+	}
+
+	for (i = 0; i < len; i++) {
+		c = data[i];
+
+		switch (parser->state) {
+		case STREAM_COMMAND:
+			if (!parser->pos) {
+				/* the first byte decides which command it is */
+				parser->command = (c == TCP_SOLVE[0]) ? TCP_SOLVE : TCP_BYE;
+			} else if ((c != parser->command[parser->pos]) && !parser->batch &&
+					(parser->command[0] == TCP_SOLVE[0]) && (c == TCP_SOLVEN[parser->pos])) {
+				/* the batch command only differs after the common prefix */
+				parser->command = TCP_SOLVEN;
+				parser->batch = 1;
+			}
+
+			if (c != parser->command[parser->pos]) {
+				goto error;
+			}
+
+			if (!parser->command[++parser->pos]) {
+				if (parser->command[0] == TCP_BYE[0]) {
+					parser->state = STREAM_BYE;
+					return i + 1;
+				}
+				parser->state = STREAM_QUERY;
+			}
+			break;
+		case STREAM_QUERY:
+		case STREAM_EXPR:
+			if (c == '(') {
+				/* open a new expression */
+				if (parser->depth == MAX_STACK_SIZE) {
+					goto error;
+				}
+				parser->error = stream_push(parser);
+				if (parser->error) {
+					goto error;
+				}
+				parser->state = STREAM_OPERATOR;
+			} else if (parser->binary && ((unsigned char)c == TCP_BIN_LITERAL)) {
+				/* the value follows in network order */
+				parser->chunk = 0;
+				parser->chunk_len = 0;
+				parser->state = STREAM_BINARY;
+			} else if (isdigit(c)) {
+				parser->chunk = c - '0';
+				parser->chunk_len = 1;
+				parser->chunked = 0;
+				parser->state = STREAM_NUMBER;
+			} else {
+				goto error;
+			}
+			break;
+		case STREAM_BINARY:
+			parser->chunk = (parser->chunk << 8) | (unsigned char)c;
+			if (++parser->chunk_len < 8) {
+				break;
+			}
+
+			/* the literals are not negative */
+			if (parser->chunk > LLONG_MAX) {
+				goto error;
 			}
-			return left_val / right_val;
+			num_set_int(stream_slot(parser), parser->chunk);
+			stream_operand(parser);
+			break;
+		case STREAM_OPERATOR:
+			if (c != '+' && c != '-' && c != '*' && c != '/') {
+				goto error;
+			}
+			stream_frame(parser, parser->depth - 1)->op = c;
+			parser->state = STREAM_SP;
+			break;
+		case STREAM_SP:
+			if (c != ' ') {
+				goto error;
+			}
+			parser->state = STREAM_EXPR;
+			break;
+		case STREAM_NUMBER:
+			if (isdigit(c)) {
+				if (parser->chunk_len == 18) {
+					/* a long literal, the digits read so far are added to the number */
+					parser->error = stream_flush(parser);
+					if (parser->error) {
+						goto error;
+					}
+				}
+				parser->chunk = parser->chunk * 10 + (c - '0');
+				parser->chunk_len++;
+				break;
+			}
+
+			/* the literal ended, the byte is handled as the one following an operand */
+			parser->error = stream_literal(parser);
+			if (parser->error) {
+				goto error;
+			}
+			stream_operand(parser);
+			if (!parser->depth) {
+				/* a bare literal, the byte has to end the query */
+				i--;
+				break;
+			}
+			/* fallthrough */
+		case STREAM_OPERAND:
+			top = stream_frame(parser, parser->depth - 1);
+			if ((top->operands == 1) && (c == ' ')) {
+				parser->state = STREAM_EXPR;
+			} else if ((top->operands == 2) && (c == ')')) {
+				/* close the expression, its value is an operand of the enclosing one */
+				parser->depth--;
+				parser->error = apply_operator(top->op, stream_slot(parser), &top->left, &top->right);
+				if (parser->error) {
+					goto error;
+				}
+				stream_operand(parser);
+			} else {
+				goto error;
+			}
+			break;
+		case STREAM_LF:
+			if (parser->batch && (c == ' ')) {
+				/* another query of the batch follows */
+				parser->state = STREAM_NEXT;
+				return i + 1;
+			}
+			if (c != '\n') {
+				goto error;
+			}
+			parser->state = STREAM_SOLVE;
+			return i + 1;
+		default:
+			return i;
 		}
 	}
+
+	return len;
+
+error:
+	parser->state = STREAM_ERROR;
+	return i + 1;
+}
+
+/* ends the query of a binary frame with its last byte, nothing else ends a bare decimal literal there */
+void
+stream_end(struct stream_parser *parser)
+{
+	if ((parser->state != STREAM_NUMBER) || parser->depth) {
+		return;
+	}
+
+	parser->error = stream_literal(parser);
+	parser->state = parser->error ? STREAM_ERROR : STREAM_SOLVE;
 }
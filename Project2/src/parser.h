@@ -9,27 +9,95 @@
 #ifndef _PARSER_H_
 #define _PARSER_H_
 
-/* number of characters in maximum integer */
-#define MAX_INT_LENGTH 10
+#include "num.h"
 
 /* number of maximum groupings into parentheses */
-#define MAX_STACK_SIZE 100
+#define MAX_STACK_SIZE 1024
+
+/* parentheses the stream parser keeps in itself, the deeper ones are allocated when a query gets there */
+#define STREAM_INLINE_FRAMES 16
+
+/* a value of a node up to this length is stored in the node itself */
+#define NODE_VALUE_SIZE 24
 
 /* binary tree */
 struct node {
 	char *value;
 	struct node *left;
 	struct node *right;
+	char inline_value[NODE_VALUE_SIZE];
+};
+
+/* states of the resumable parser */
+typedef enum {
+	STREAM_COMMAND,
+	STREAM_QUERY,
+	STREAM_OPERATOR,
+	STREAM_SP,
+	STREAM_EXPR,
+	STREAM_NUMBER,
+	STREAM_BINARY,
+	STREAM_OPERAND,
+	STREAM_LF,
+	STREAM_NEXT,
+	STREAM_SOLVE,
+	STREAM_BYE,
+	STREAM_ERROR
+} stream_state;
+
+/* a parenthesized expression which is being parsed */
+struct stream_frame {
+	char op;
+	int operands;
+	struct num left;
+	struct num right;
+};
+
+/*
+ * Resumable parser of the TCP requests, which evaluates the query as it is parsed.
+ * Only the currently open parentheses are kept, never the whole expression.
+ * On STREAM_ERROR, error holds the error of the arithmetic, or 0 for a syntax error.
+ * The frames past the inline ones are in the stack, which grows up to MAX_STACK_SIZE in total,
+ * only the deepest frames ever used hold any memory.
+ */
+struct stream_parser {
+	stream_state state;
+	const char *command;
+	int pos;
+	unsigned long long chunk;
+	int chunk_len;
+	int chunked;
+	int error;
+	int batch;
+	int binary;
+	int depth;
+	int deepest;
+	int capacity;
+	struct num result;
+	struct stream_frame frames[STREAM_INLINE_FRAMES];
+	struct stream_frame *stack;
 };
 
 int tcp_parse_query(const char *query);
 
+void stream_reset(struct stream_parser *parser);
+
+void stream_query(struct stream_parser *parser);
+
+void stream_free(struct stream_parser *parser);
+
+int stream_feed(struct stream_parser *parser, const char *data, int len);
+
+void stream_end(struct stream_parser *parser);
+
 int udp_parse_request(const char *request, int bytes);
 
+int udp_parse_item(const char *item, int len);
+
 void del_tree(struct node *tree);
 
 int new_tree(const char *expression, struct node **tree);
 
-int calculate_answer(struct node *tree);
+int calculate_answer(struct node *tree, struct num *result);
 
 #endif
@@ -0,0 +1,173 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: pool.c
+ * Desc: Preallocated pools of objects of a fixed size
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "server.h"
+
+struct pool context_pool = POOL_INITIALIZER(sizeof(struct context));
+struct pool buffer_pool = POOL_INITIALIZER(MAX_BUFFER_SIZE);
+struct pool node_pool = POOL_INITIALIZER(sizeof(struct node));
+
+/* allocates all the objects of a pool, an equal part on every node, and links them into the free lists */
+static int
+pool_init(struct pool *pool, unsigned int capacity, unsigned int nodes)
+{
+	unsigned int i, node, per_node;
+	size_t page;
+	void **object;
+	char *memory;
+
+	/* every object has to hold the link and keep the alignment of the next one */
+	pool->size = (pool->size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+	per_node = (capacity + nodes - 1) / nodes;
+	pool->stride = (size_t)per_node * pool->size;
+	if (nodes > 1) {
+		/* the parts of the nodes are placed by whole pages */
+		page = sysconf(_SC_PAGESIZE);
+		pool->stride = (pool->stride + page - 1) & ~(page - 1);
+		if (posix_memalign((void **)&pool->memory, page, pool->stride * nodes)) {
+			pool->memory = NULL;
+		}
+	} else {
+		pool->memory = malloc(pool->stride);
+	}
+	if (!pool->memory) {
+		ERR("Memory allocation error.");
+		return -1;
+	}
+
+	for (node = 0; node < nodes; node++) {
+		memory = pool->memory + node * pool->stride;
+		if (nodes > 1) {
+			affinity_place(memory, pool->stride, node);
+		}
+
+		/* touch the memory now, so that the first sessions do not fault it in */
+		memset(memory, 0, pool->stride);
+
+		pool->free[node] = NULL;
+		for (i = per_node; i > 0; i--) {
+			object = (void **)(memory + (size_t)(i - 1) * pool->size);
+			*object = pool->free[node];
+			pool->free[node] = object;
+		}
+	}
+	pool->capacity = per_node * nodes;
+	pool->nodes = nodes;
+
+	return 0;
+}
+
+/* takes an object from the pool, from the node of the calling thread if the pool is split between nodes */
+void *
+pool_alloc(struct pool *pool)
+{
+	return pool_alloc_node(pool, affinity_node());
+}
+
+/* takes an object from the part of the given node, then from the other nodes, then from the heap */
+void *
+pool_alloc_node(struct pool *pool, int node)
+{
+	unsigned int i, n;
+	void *object = NULL;
+
+	if (pool->memory) {
+		pthread_mutex_lock(&pool->lock);
+		for (i = 0; !object && (i < pool->nodes); i++) {
+			n = (node + i) % pool->nodes;
+			object = pool->free[n];
+			if (object) {
+				pool->free[n] = *(void **)object;
+				pool->used++;
+			}
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (!object) {
+		atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+		object = malloc(pool->size);
+	}
+
+	return object;
+}
+
+/* returns an object to the pool, or to the heap if it came from there */
+void
+pool_free(struct pool *pool, void *object)
+{
+	unsigned int node;
+
+	if (!object) {
+		return;
+	}
+
+	if (!pool->memory || ((char *)object < pool->memory) ||
+			((char *)object >= pool->memory + pool->stride * pool->nodes)) {
+		free(object);
+		return;
+	}
+
+	/* back to the node it was placed on */
+	node = ((char *)object - pool->memory) / pool->stride;
+
+	pthread_mutex_lock(&pool->lock);
+	*(void **)object = pool->free[node];
+	pool->free[node] = object;
+	pool->used--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* preallocates the pools for the given number of sessions */
+int
+pools_init(unsigned int sessions)
+{
+	unsigned int nodes = affinity_nodes();
+
+	if (pool_init(&context_pool, sessions, nodes) || pool_init(&buffer_pool, sessions, nodes) ||
+			pool_init(&node_pool, sessions * POOL_NODES_PER_SESSION, nodes)) {
+		pools_destroy();
+		return -1;
+	}
+
+	INF("Pools preallocated for %u sessions.", sessions);
+	return 0;
+}
+
+/* a pool with objects still in use, e.g. by the sessions interrupted on exit, is left to the process exit */
+void
+pools_destroy(void)
+{
+	struct pool *pools[] = {&context_pool, &buffer_pool, &node_pool};
+	unsigned int i;
+
+	for (i = 0; i < sizeof pools / sizeof *pools; i++) {
+		if (atomic_load(&pools[i]->misses)) {
+			INF("%llu objects did not fit into a pool of %u.", atomic_load(&pools[i]->misses), pools[i]->capacity);
+		}
+
+		if (pools[i]->used) {
+			continue;
+		}
+
+		free(pools[i]->memory);
+		pools[i]->memory = NULL;
+		memset(pools[i]->free, 0, sizeof pools[i]->free);
+		pools[i]->capacity = 0;
+		pools[i]->nodes = 0;
+	}
+}
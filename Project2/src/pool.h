@@ -0,0 +1,55 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: pool.h
+ * Desc: Preallocated pools of objects of a fixed size header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "affinity.h"
+
+/* the nodes of the trees are preallocated for this many per session, enough for the longest UDP request */
+#define POOL_NODES_PER_SESSION 128
+
+/*
+ * A pool allocates all its objects at once, the free ones are kept in a list threaded through them.
+ * The memory may be split between the NUMA nodes, every node has a part of stride bytes and a list of its own.
+ * When the pool runs out, or before it is initialized, the objects come from the heap.
+ */
+struct pool {
+	pthread_mutex_t lock;
+	size_t size;
+	size_t stride;
+	unsigned int capacity;
+	unsigned int used;
+	unsigned int nodes;
+	char *memory;
+	void *free[AFFINITY_MAX_NODES];
+	atomic_ullong misses;
+};
+
+#define POOL_INITIALIZER(object_size) {.lock = PTHREAD_MUTEX_INITIALIZER, .size = (object_size)}
+
+/* the contexts of the TCP sessions, the buffers of their responses and the nodes of the UDP trees */
+extern struct pool context_pool;
+extern struct pool buffer_pool;
+extern struct pool node_pool;
+
+void *pool_alloc(struct pool *pool);
+
+void *pool_alloc_node(struct pool *pool, int node);
+
+void pool_free(struct pool *pool, void *object);
+
+int pools_init(unsigned int sessions);
+
+void pools_destroy(void);
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: queue.c
+ * Desc: Bounded lock-free queue of pointers for any number of producers and consumers
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "queue.h"
+#include "server.h"
+
+/* allocates the cells, the capacity has to be a power of two */
+int
+queue_init(struct queue *queue, size_t capacity)
+{
+	size_t i;
+
+	if (!capacity || (capacity & (capacity - 1))) {
+		ERR("Queue capacity has to be a power of two.");
+		return -1;
+	}
+
+	queue->cells = malloc(capacity * sizeof *queue->cells);
+	if (!queue->cells) {
+		ERR("Memory allocation error.");
+		return -1;
+	}
+
+	/* a cell may be written once its sequence number equals the position */
+	for (i = 0; i < capacity; i++) {
+		atomic_init(&queue->cells[i].seq, i);
+		queue->cells[i].data = NULL;
+	}
+	queue->mask = capacity - 1;
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+
+	return 0;
+}
+
+void
+queue_destroy(struct queue *queue)
+{
+	free(queue->cells);
+	queue->cells = NULL;
+}
+
+/* appends a pointer, returns 0 on success, -1 if the queue is full */
+int
+queue_push(struct queue *queue, void *data)
+{
+	struct queue_cell *cell;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	for (;;) {
+		cell = &queue->cells[pos & queue->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (!diff) {
+			/* the cell is free in this lap, claim it */
+			if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* the cell still holds the pointer of the previous lap */
+			return -1;
+		} else {
+			/* another producer took the position */
+			pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+		}
+	}
+
+	cell->data = data;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+/* removes the oldest pointer, returns NULL if the queue is empty */
+void *
+queue_pop(struct queue *queue)
+{
+	struct queue_cell *cell;
+	size_t pos, seq;
+	intptr_t diff;
+	void *data;
+
+	pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	for (;;) {
+		cell = &queue->cells[pos & queue->mask];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (!diff) {
+			/* the cell was written in this lap, claim it */
+			if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* nothing was written into the cell yet */
+			return NULL;
+		} else {
+			/* another consumer took the position */
+			pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+		}
+	}
+
+	data = cell->data;
+	/* the cell may be written again in the next lap */
+	atomic_store_explicit(&cell->seq, pos + queue->mask + 1, memory_order_release);
+	return data;
+}
+
+/* the number of the pointers in the queue, only a snapshot while others push and pop */
+size_t
+queue_depth(struct queue *queue)
+{
+	size_t head, tail;
+
+	head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	return (tail > head) ? tail - head : 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: queue.h
+ * Desc: Bounded lock-free queue of pointers for any number of producers and consumers header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define QUEUE_CACHE_LINE 64
+
+/*
+ * Every cell carries a sequence number, which tells whether the cell may be written or read in the current
+ * lap over the ring. A producer or a consumer claims a position by moving the tail or the head with a single
+ * compare and swap, so the threads only compete over the positions, never over a lock.
+ */
+struct queue_cell {
+	atomic_size_t seq;
+	void *data;
+};
+
+struct queue {
+	struct queue_cell *cells;
+	size_t mask;
+	_Alignas(QUEUE_CACHE_LINE) atomic_size_t head;
+	_Alignas(QUEUE_CACHE_LINE) atomic_size_t tail;
+};
+
+int queue_init(struct queue *queue, size_t capacity);
+
+void queue_destroy(struct queue *queue);
+
+int queue_push(struct queue *queue, void *data);
+
+void *queue_pop(struct queue *queue);
+
+size_t queue_depth(struct queue *queue);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: ratelimit.c
+ * Desc: Per-client rate limits of connections, requests and bytes
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "ratelimit.h"
+#include "server.h"
+
+/* allowed events per second of every kind, 0 is unlimited */
+static unsigned long long rates[RATELIMIT_COUNT];
+
+/* NULL while no limit is set, then every event is allowed right away */
+static struct ratelimit_set *table;
+
+/* keeps the clients from choosing addresses which all fall into the same set */
+static uint64_t seed;
+
+/*
+ * Parses the limits in the form <connections>:<requests>:<bytes>, all of them per second and client.
+ * Returns 0 on success, -1 on error.
+ */
+int
+ratelimit_parse(const char *limits)
+{
+	unsigned long long parsed[RATELIMIT_COUNT];
+	int end = -1;
+
+	if ((sscanf(limits, "%llu:%llu:%llu%n", &parsed[RATELIMIT_CONNECTIONS], &parsed[RATELIMIT_REQUESTS],
+			&parsed[RATELIMIT_BYTES], &end) != 3) || (limits[end] != '\0')) {
+		return -1;
+	}
+
+	memcpy(rates, parsed, sizeof rates);
+	return 0;
+}
+
+/*
+ * Gets the key of a client from its address, only the clients on the network are limited.
+ * Returns 1 if the client is limited, 0 otherwise.
+ */
+int
+ratelimit_key(const struct sockaddr *sa, socklen_t len, struct ratelimit_key *key)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+
+	memset(key, 0, sizeof *key);
+
+	if ((sa->sa_family == AF_INET) && (len >= sizeof *sin)) {
+		key->addr[10] = 0xff;
+		key->addr[11] = 0xff;
+		memcpy(key->addr + 12, &sin->sin_addr, 4);
+		return 1;
+	} else if ((sa->sa_family == AF_INET6) && (len >= sizeof *sin6)) {
+		memcpy(key->addr, &sin6->sin6_addr, 16);
+		return 1;
+	}
+
+	return 0;
+}
+
+static uint64_t
+ratelimit_hash(const struct ratelimit_key *key)
+{
+	uint64_t a, b, h;
+
+	memcpy(&a, key->addr, 8);
+	memcpy(&b, key->addr + 8, 8);
+
+	h = (a ^ seed) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ b) * 0xff51afd7ed558ccdULL;
+	return h ^ (h >> 32);
+}
+
+static unsigned long long
+ratelimit_latest(const struct ratelimit_entry *entry)
+{
+	unsigned long long latest = 0;
+	int i;
+
+	for (i = 0; i < RATELIMIT_COUNT; i++) {
+		if (entry->tat[i] > latest) {
+			latest = entry->tat[i];
+		}
+	}
+
+	return latest;
+}
+
+/* finds the entry of a client in its set, a new client replaces the one which would be allowed the soonest */
+static struct ratelimit_entry *
+ratelimit_find(struct ratelimit_set *set, const struct ratelimit_key *key)
+{
+	struct ratelimit_entry *victim = &set->entries[0];
+	int i;
+
+	for (i = 0; i < RATELIMIT_WAYS; i++) {
+		if (!memcmp(&set->entries[i].key, key, sizeof *key)) {
+			return &set->entries[i];
+		}
+
+		if (ratelimit_latest(&set->entries[i]) < ratelimit_latest(victim)) {
+			victim = &set->entries[i];
+		}
+	}
+
+	/* an empty entry and one of a client, who has not been limited for a while, are the same */
+	memset(victim, 0, sizeof *victim);
+	victim->key = *key;
+	return victim;
+}
+
+/*
+ * Charges a client for the given events, either all of them are allowed or none.
+ * Returns 1 if the events are allowed, 0 if the client is over one of its limits.
+ */
+int
+ratelimit_allow(const struct ratelimit_key *key, unsigned long long connections, unsigned long long requests,
+		unsigned long long bytes)
+{
+	struct ratelimit_set *set;
+	struct ratelimit_entry *entry;
+	unsigned long long now, costs[RATELIMIT_COUNT], tat[RATELIMIT_COUNT];
+	int i, ret = 1;
+
+	if (!table) {
+		return 1;
+	}
+
+	costs[RATELIMIT_CONNECTIONS] = connections;
+	costs[RATELIMIT_REQUESTS] = requests;
+	costs[RATELIMIT_BYTES] = bytes;
+	now = metrics_now();
+
+	set = &table[ratelimit_hash(key) & (RATELIMIT_SETS - 1)];
+	while (atomic_flag_test_and_set_explicit(&set->lock, memory_order_acquire));
+
+	entry = ratelimit_find(set, key);
+	for (i = 0; i < RATELIMIT_COUNT; i++) {
+		tat[i] = entry->tat[i];
+		if (!rates[i] || !costs[i]) {
+			continue;
+		}
+
+		if (tat[i] < now) {
+			tat[i] = now;
+		}
+		tat[i] += costs[i] * 1000000000ULL / rates[i];
+		if (tat[i] - now > RATELIMIT_BURST_NS) {
+			ret = 0;
+			break;
+		}
+	}
+
+	if (ret) {
+		memcpy(entry->tat, tat, sizeof tat);
+	}
+
+	atomic_flag_clear_explicit(&set->lock, memory_order_release);
+
+	if (!ret) {
+		metrics_inc(METRIC_RATE_LIMITED, 1);
+	}
+	return ret;
+}
+
+/* creates the table of the clients if any limit is set */
+int
+ratelimit_init(void)
+{
+	int i;
+
+	if (!rates[RATELIMIT_CONNECTIONS] && !rates[RATELIMIT_REQUESTS] && !rates[RATELIMIT_BYTES]) {
+		return 0;
+	}
+
+	table = malloc(RATELIMIT_SETS * sizeof *table);
+	if (!table) {
+		ERR("Memory allocation error.");
+		return -1;
+	}
+
+	memset(table, 0, RATELIMIT_SETS * sizeof *table);
+	for (i = 0; i < RATELIMIT_SETS; i++) {
+		atomic_flag_clear(&table[i].lock);
+	}
+	seed = metrics_now() * 0x9e3779b97f4a7c15ULL;
+
+	INF("Rate limits per client: %llu connections, %llu requests and %llu bytes per second.",
+			rates[RATELIMIT_CONNECTIONS], rates[RATELIMIT_REQUESTS], rates[RATELIMIT_BYTES]);
+	return 0;
+}
+
+void
+ratelimit_destroy(void)
+{
+	free(table);
+	table = NULL;
+}
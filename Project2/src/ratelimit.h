@@ -0,0 +1,62 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: ratelimit.h
+ * Desc: Per-client rate limits of connections, requests and bytes header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* number of sets of the table, a power of two */
+#define RATELIMIT_SETS 1024
+
+/* number of clients in a set, when it is full the client which would be allowed the soonest is replaced */
+#define RATELIMIT_WAYS 8
+
+/* a client may exceed its rate by the amount it gets in this time */
+#define RATELIMIT_BURST_NS 1000000000ULL
+
+typedef enum {
+	RATELIMIT_CONNECTIONS,
+	RATELIMIT_REQUESTS,
+	RATELIMIT_BYTES,
+	RATELIMIT_COUNT
+} ratelimit_kind;
+
+/* the IP address of a client, an IPv4 one is mapped to IPv6, all zeroes is an empty entry */
+struct ratelimit_key {
+	uint8_t addr[16];
+};
+
+/*
+ * A client has a theoretical arrival time for every limit, it moves forward by the cost of every allowed
+ * event and the event is refused when it would get more than the burst ahead of the current time.
+ */
+struct ratelimit_entry {
+	struct ratelimit_key key;
+	unsigned long long tat[RATELIMIT_COUNT];
+};
+
+struct ratelimit_set {
+	atomic_flag lock;
+	struct ratelimit_entry entries[RATELIMIT_WAYS];
+};
+
+int ratelimit_parse(const char *limits);
+
+int ratelimit_key(const struct sockaddr *sa, socklen_t len, struct ratelimit_key *key);
+
+int ratelimit_allow(const struct ratelimit_key *key, unsigned long long connections, unsigned long long requests,
+		unsigned long long bytes);
+
+int ratelimit_init(void);
+
+void ratelimit_destroy(void);
+
+#endif
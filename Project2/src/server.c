@@ -8,17 +8,41 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <getopt.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "busypoll.h"
+#include "capture.h"
+#include "flight.h"
+#include "metrics.h"
+#include "overload.h"
+#include "pool.h"
 #include "server.h"
+#include "shm.h"
+#include "workers.h"
 
-struct server_opts server_opts;
+struct server_opts server_opts = {
+	.handshake_timeout = TCP_HANDSHAKE_TIMEOUT_MS,
+	.idle_timeout = TCP_IDLE_TIMEOUT_MS,
+	.request_timeout = TCP_REQUEST_TIMEOUT_MS,
+	.pool_size = MAX_CLIENTS
+};
 
 volatile int exit_application = 0;
 
+volatile int drain_sessions = 0;
+
+const char *mode_names[] = {"TCP", "UDP", "SHM"};
+
 static void
 sigint_handler(int signum)
 {
@@ -27,19 +51,400 @@ sigint_handler(int signum)
     exit_application = 1;
 }
 
+static void
+sigusr1_handler(int signum)
+{
+    (void) signum;
+    /* the main loop dumps the trace rings */
+    trace_request_dump();
+}
+
+static void
+sigusr2_handler(int signum)
+{
+    (void) signum;
+    /* only interrupts a blocked session, which then checks whether it should end */
+}
+
+/* returns the path of a unix socket address, NULL for an IP address */
+const char *
+unix_path(const char *address)
+{
+	if (strncmp(address, UNIX_PREFIX, strlen(UNIX_PREFIX))) {
+		return NULL;
+	}
+
+	return address + strlen(UNIX_PREFIX);
+}
+
+/* creates a non-blocking unix socket bound to the path, a stream socket also listens */
+int
+unix_init_server(const char *path, int type)
+{
+	int sock;
+	struct sockaddr_un sa;
+
+	if (strlen(path) >= sizeof sa.sun_path) {
+		ERR("Unix socket path too long.");
+		return -1;
+	}
+
+	sock = socket(AF_UNIX, type | SOCK_NONBLOCK, 0);
+	if (sock < 0) {
+		ERR("Creating server socket failed (%s).", strerror(errno));
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	/* remove a stale socket of a previous run */
+	unlink(path);
+
+	if (bind(sock, (struct sockaddr *) &sa, sizeof sa)) {
+		ERR("Bind failed (%s).", strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	if ((type == SOCK_STREAM) && listen(sock, SOCKET_BACKLOG)) {
+		ERR("Listen failed (%s).", strerror(errno));
+		close(sock);
+		unlink(path);
+		return -1;
+	}
+
+	return sock;
+}
+
+/* returns the mode with the given name, -1 if there is none */
+static int
+mode_parse(const char *name, int len)
+{
+	int i;
+
+	for (i = 0; i < (int)(sizeof mode_names / sizeof *mode_names); i++) {
+		if (((int)strlen(mode_names[i]) == len) && !strncmp(name, mode_names[i], len)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Adds an address to listen on, either an IPv4 address with a port or a unix socket path with the prefix.
+ * Returns 0 on success, 1 if the listener is invalid.
+ */
+static int
+listener_add(protocol_type mode, const char *address, int len, unsigned int port)
+{
+	struct listener *l;
+
+	if (server_opts.listener_count == MAX_LISTENERS) {
+		ERR("Too many listeners, at most %d are allowed.", MAX_LISTENERS);
+		return 1;
+	}
+
+	if (len >= MAX_ADDRESS_SIZE) {
+		ERR("Address too long.");
+		return 1;
+	}
+
+	l = &server_opts.listeners[server_opts.listener_count];
+	memcpy(l->address, address, len);
+	l->address[len] = '\0';
+	l->mode = mode;
+	l->port = port;
+	l->sock = -1;
+
+	if (!unix_path(l->address) && !port) {
+		ERR("Missing port of \"%s\".", l->address);
+		return 1;
+	}
+
+	/* the clients find the shared memory through a unix socket */
+	if ((mode == IP_SHM) && !unix_path(l->address)) {
+		ERR("The SHM mode needs a unix:<path> address.");
+		return 1;
+	}
+
+	server_opts.listener_count++;
+	return 0;
+}
+
+/* parses a listener given as <mode>:<address>:<port> or <mode>:unix:<path> */
+static int
+listener_parse(const char *spec)
+{
+	const char *address, *port;
+	int mode = -1;
+
+	address = strchr(spec, ':');
+	if (address) {
+		mode = mode_parse(spec, address - spec);
+		address++;
+	}
+
+	if (mode < 0) {
+		ERR("Invalid listener \"%s\".", spec);
+		return 1;
+	}
+
+	if (unix_path(address)) {
+		return listener_add(mode, address, strlen(address), 0);
+	}
+
+	port = strrchr(address, ':');
+	if (!port) {
+		ERR("Invalid listener \"%s\".", spec);
+		return 1;
+	}
+
+	return listener_add(mode, address, port - address, atoi(port + 1));
+}
+
+/* parses the deadlines of a TCP session in the form <handshake>:<idle>:<request>, returns 0 on success */
+static int
+timeouts_parse(const char *timeouts)
+{
+	unsigned long long handshake, idle, request;
+	int end = -1;
+
+	if ((sscanf(timeouts, "%llu:%llu:%llu%n", &handshake, &idle, &request, &end) != 3) || (timeouts[end] != '\0')) {
+		return -1;
+	}
+
+	server_opts.handshake_timeout = handshake;
+	server_opts.idle_timeout = idle;
+	server_opts.request_timeout = request;
+	return 0;
+}
+
+/* creates the sockets of all the listeners */
+static int
+listeners_init(void)
+{
+	struct listener *l;
+	int i;
+
+	for (i = 0; i < server_opts.listener_count; i++) {
+		l = &server_opts.listeners[i];
+		if (l->sock >= 0) {
+			/* taken over from the previous process */
+			continue;
+		}
+
+		if (l->mode == IP_TCP) {
+			l->sock = tcp_init_server(l->address, l->port);
+		} else if (l->mode == IP_UDP) {
+			l->sock = udp_init_server(l->address, l->port);
+		} else {
+			l->sock = unix_init_server(unix_path(l->address), SOCK_STREAM);
+		}
+
+		if (l->sock < 0) {
+			ERR("Initializing %s server on \"%s\" failed.", mode_names[l->mode], l->address);
+			return -1;
+		}
+	}
+
+	/* the received data is stamped on arrival, the accepted sockets inherit it, the taken over ones get it as well */
+	for (i = 0; i < server_opts.listener_count; i++) {
+		if (server_opts.listeners[i].mode != IP_SHM) {
+			overload_socket(server_opts.listeners[i].sock);
+			busy_poll_socket(server_opts.listeners[i].sock);
+		}
+	}
+
+	return 0;
+}
+
+/* closes the sockets of all the listeners, the files of the unix ones are removed unless they were handed over */
+static void
+listeners_close(int unlink_files)
+{
+	struct listener *l;
+	int i;
+
+	for (i = 0; i < server_opts.listener_count; i++) {
+		l = &server_opts.listeners[i];
+		if (l->sock < 0) {
+			continue;
+		}
+
+		close(l->sock);
+		l->sock = -1;
+		if (unlink_files && unix_path(l->address)) {
+			unlink(unix_path(l->address));
+		}
+	}
+}
+
+/*
+ * The main loop, it waits on the sockets of all the listeners at once. The new TCP and SHM clients get
+ * a thread for their session, the UDP datagrams are handled right here.
+ */
+static int
+serve(void)
+{
+	int ret = 0, i, maxfd, ready, handoff_sock = -1, handed_off = 0;
+	unsigned int spin = 0;
+	fd_set readfds;
+	struct timeval timeout;
+	struct listener *l;
+	unsigned long long deadline;
+
+	if (listeners_init()) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* a new process may take the listeners over through this socket */
+	if (server_opts.handoff_path) {
+		handoff_sock = handoff_init(server_opts.handoff_path);
+		if (handoff_sock < 0) {
+			ret = 1;
+			goto cleanup;
+		}
+	}
+
+	/* the helper threads are already running, only the main loop is pinned */
+	affinity_io();
+
+	while (!exit_application) {
+		trace_dump_pending();
+
+		FD_ZERO(&readfds);
+		maxfd = -1;
+		for (i = 0; i < server_opts.listener_count; i++) {
+			FD_SET(server_opts.listeners[i].sock, &readfds);
+			if (server_opts.listeners[i].sock > maxfd) {
+				maxfd = server_opts.listeners[i].sock;
+			}
+		}
+		if (handoff_sock >= 0) {
+			FD_SET(handoff_sock, &readfds);
+			if (handoff_sock > maxfd) {
+				maxfd = handoff_sock;
+			}
+		}
+		if (workers_fd() >= 0) {
+			FD_SET(workers_fd(), &readfds);
+			if (workers_fd() > maxfd) {
+				maxfd = workers_fd();
+			}
+		}
+
+		/* wake up every second to check for a pending trace dump, busy polling does not sleep until idle for a while */
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		if (busy_poll_backoff(&spin)) {
+			timeout.tv_sec = 0;
+		}
+
+		ready = select(maxfd + 1, &readfds, NULL, NULL, &timeout);
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			ERR("Select failed (%s).", strerror(errno));
+			ret = 1;
+			break;
+		} else if (ready) {
+			spin = 0;
+		}
+
+		for (i = 0; i < server_opts.listener_count; i++) {
+			l = &server_opts.listeners[i];
+			if (!FD_ISSET(l->sock, &readfds)) {
+				continue;
+			}
+
+			if (l->mode == IP_TCP) {
+				tcp_accept(l->sock);
+			} else if (l->mode == IP_UDP) {
+				udp_handle(l->sock);
+			} else {
+				shm_accept(l->sock);
+			}
+		}
+
+		/* the responses computed by the workers are sent by the main loop, which owns the sockets */
+		if ((workers_fd() >= 0) && FD_ISSET(workers_fd(), &readfds)) {
+			workers_complete();
+		}
+
+		if ((handoff_sock >= 0) && FD_ISSET(handoff_sock, &readfds) &&
+				!handoff_send(&handoff_sock, server_opts.handoff_path)) {
+			INF("Listeners handed over, draining the sessions.");
+			handed_off = 1;
+			break;
+		}
+	}
+
+	/* the requests in flight are still answered */
+	workers_drain();
+
+	if (handed_off) {
+		/* the new process serves the listeners now, this one only finishes its sessions */
+		listeners_close(0);
+		drain_sessions = 1;
+
+		deadline = metrics_now() + HANDOFF_DRAIN_TIMEOUT_MS * 1000000ULL;
+		while ((tcp_drain() + shm_drain()) && !exit_application && (metrics_now() < deadline)) {
+			usleep(10000);
+		}
+	}
+
+	/* interrupt the sessions and wait for them */
+	tcp_shutdown();
+	shm_shutdown();
+
+cleanup:
+	listeners_close(1);
+	if (handoff_sock >= 0) {
+		close(handoff_sock);
+		unlink(server_opts.handoff_path);
+	}
+	return ret;
+}
+
 void
 help_print()
 {
 	printf("Usage: ./ipkcpd -h <host> -p <port> -m <mode>\n");
 	printf("An IPK Calculator Protocol network server.\n");
 	printf("Example: ./ipkcpd -h example.com -p 830 -m TCP\n");
+	printf("Example: ./ipkcpd -h unix:/tmp/ipkpd.sock -m UDP\n");
+	printf("Example: ./ipkcpd -h unix:/tmp/ipkpd.shm -m SHM\n");
+	printf("Example: ./ipkcpd -L TCP:127.0.0.1:2023 -L UDP:127.0.0.1:2023 -L UDP:unix:/tmp/ipkpd.sock\n");
 	printf("Available options:\n");
 	printf("\t--help \t\t\tDisplays this message.\n");
-	printf("\t--host [-h] \t\tSpecify the address to listen on.\n");
-	printf("\t--port [-p] \t\tSpecify the port to use.\n");
-	printf("\t--mode [-m] \t\tSelect the mode to use, either TCP or UDP.\n");
+	printf("\t--host [-h] \t\tSpecify the address to listen on, unix:<path> for a unix socket.\n");
+	printf("\t--port [-p] \t\tSpecify the port to use, not needed for a unix socket.\n");
+	printf("\t--mode [-m] \t\tSelect the mode to use, TCP, UDP or SHM (shared memory, unix:<path> only).\n");
+	printf("\t--listen [-L] \t\tAlso listen on <mode>:<host>:<port> or <mode>:unix:<path>, may be repeated.\n");
+	printf("\t--handoff [-o] \t\tHand the listeners over to a new process connecting to the given unix socket path.\n");
+	printf("\t--takeover [-r] \tTake the listeners over from a running process with the given handoff path.\n");
 	printf("\t--tcptest [-t] \t\tRuns a TCP server on address 127.0.0.1 on port 9999.\n");
 	printf("\t--udptest [-u] \t\tRuns a UDP server on address 127.0.0.1 on port 9999.\n");
+	printf("\t--stats [-s] \t\tServe metrics on the given unix socket path.\n");
+	printf("\t--trace-threshold [-T] \tPrint the timeline of requests slower than the given microseconds.\n");
+	printf("\t--log-level [-l] \tSet the log level, one of error, warning, info or debug.\n");
+	printf("\t--rate-limit [-R] \tLimit <connections>:<requests>:<bytes> per second of every client, 0 is unlimited.\n");
+	printf("\t--overload-target [-O] \tReject new work early once the requests keep waiting longer than the given microseconds.\n");
+	printf("\t--timeouts [-w] \tSet the TCP <handshake>:<idle>:<request> deadlines in milliseconds, 0 is none.\n");
+	printf("\t--pool-size [-P] \tPreallocate the memory of the given number of sessions, more of them use the heap.\n");
+	printf("\t--io-cpus [-a] \t\tPin the main loop, which accepts the sessions and serves UDP, to the given CPUs, e.g. 0-1.\n");
+	printf("\t--session-cpus [-A] \tRun the sessions on the given CPUs, each on the one receiving its packets if it is one of them.\n");
+	printf("\t--numa [-N] \t\tSplit the preallocated memory between the NUMA nodes and serve every session from its own.\n");
+	printf("\t--capture [-c] \t\tRecord the received requests with their times into the given file for a replay.\n");
+	printf("\t--busy-poll [-y] \tPoll the sockets for the given microseconds and spin on them rather than sleep.\n");
+	printf("\t--workers [-W] \t\tSolve the UDP requests on the given number of worker threads, not in the main loop.\n");
+	printf("\t--coalesce [-C] \tSolve the identical queries arriving at the same time only once and share the result.\n");
 }
 
 int
@@ -52,17 +457,34 @@ main(int argc, char *argv[])
 		{"host",	required_argument,	NULL,	'h'},
 		{"port",	required_argument,	NULL,	'p'},
 		{"mode",	required_argument,	NULL,	'm'},
+		{"listen",	required_argument,	NULL,	'L'},
+		{"handoff",	required_argument,	NULL,	'o'},
+		{"takeover",	required_argument,	NULL,	'r'},
 		{"tcptest",	no_argument,		NULL,	't'},
 		{"udptest",	no_argument,		NULL,	'u'},
+		{"stats",	required_argument,	NULL,	's'},
+		{"trace-threshold",	required_argument,	NULL,	'T'},
+		{"log-level",	required_argument,	NULL,	'l'},
+		{"rate-limit",	required_argument,	NULL,	'R'},
+		{"overload-target",	required_argument,	NULL,	'O'},
+		{"timeouts",	required_argument,	NULL,	'w'},
+		{"pool-size",	required_argument,	NULL,	'P'},
+		{"io-cpus",	required_argument,	NULL,	'a'},
+		{"session-cpus",	required_argument,	NULL,	'A'},
+		{"numa",	no_argument,		NULL,	'N'},
+		{"busy-poll",	required_argument,	NULL,	'y'},
+		{"capture",	required_argument,	NULL,	'c'},
+		{"workers",	required_argument,	NULL,	'W'},
+		{"coalesce",	no_argument,		NULL,	'C'},
 		{NULL,		0,					NULL,	0}
 	};
 
-	if (argc != 7 && argc != 2) {
+	if (argc < 2) {
 		help_print();
 		goto cleanup;
 	}
 
-	while ((opt = getopt_long(argc, argv, "Hh:p:m:tu", options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "Hh:p:m:L:o:r:tus:T:l:R:O:w:P:a:A:Ny:c:W:C", options, NULL)) != -1) {
 		switch(opt) {
 		case 'H':
 			help_print();
@@ -75,16 +497,25 @@ main(int argc, char *argv[])
 			server_opts.port = atoi(optarg);
 			break;
 		case 'm':
-			if (!strcmp(optarg, "TCP")) {
-				server_opts.mode = IP_TCP;
-			} else if (!strcmp(optarg, "UDP")) {
-				server_opts.mode = IP_UDP;
-			} else {
-				ERR("Only TCP or UDP modes are allowed.");
+			if (mode_parse(optarg, strlen(optarg)) < 0) {
+				ERR("Only TCP, UDP or SHM modes are allowed.");
+				ret = 1;
+				goto cleanup;
+			}
+			server_opts.mode = mode_parse(optarg, strlen(optarg));
+			break;
+		case 'L':
+			if (listener_parse(optarg)) {
 				ret = 1;
 				goto cleanup;
 			}
 			break;
+		case 'o':
+			server_opts.handoff_path = optarg;
+			break;
+		case 'r':
+			server_opts.takeover_path = optarg;
+			break;
 		case 't':
 			server_opts.address = "127.0.0.1";
 			server_opts.port = 9999;
@@ -95,22 +526,160 @@ main(int argc, char *argv[])
 			server_opts.port = 9999;
 			server_opts.mode = IP_UDP;
 			break;
+		case 's':
+			server_opts.stats_path = optarg;
+			break;
+		case 'T':
+			server_opts.trace_threshold = strtoull(optarg, NULL, 10);
+			break;
+		case 'l':
+			if (log_parse_level(optarg, &log_max_level)) {
+				ERR("Unknown log level \"%s\".", optarg);
+				ret = 1;
+				goto cleanup;
+			}
+			break;
+		case 'R':
+			if (ratelimit_parse(optarg)) {
+				ERR("Invalid rate limits \"%s\", expected <connections>:<requests>:<bytes>.", optarg);
+				ret = 1;
+				goto cleanup;
+			}
+			break;
+		case 'O':
+			overload_set_target(strtoull(optarg, NULL, 10));
+			break;
+		case 'w':
+			if (timeouts_parse(optarg)) {
+				ERR("Invalid timeouts \"%s\", expected <handshake>:<idle>:<request>.", optarg);
+				ret = 1;
+				goto cleanup;
+			}
+			break;
+		case 'P':
+			server_opts.pool_size = atoi(optarg);
+			break;
+		case 'a':
+			if (affinity_parse_io(optarg)) {
+				ERR("Invalid list of CPUs \"%s\".", optarg);
+				ret = 1;
+				goto cleanup;
+			}
+			break;
+		case 'A':
+			if (affinity_parse_sessions(optarg)) {
+				ERR("Invalid list of CPUs \"%s\".", optarg);
+				ret = 1;
+				goto cleanup;
+			}
+			break;
+		case 'N':
+			affinity_set_numa(1);
+			break;
+		case 'y':
+			busy_poll_set(strtoul(optarg, NULL, 10));
+			break;
+		case 'c':
+			server_opts.capture_path = optarg;
+			break;
+		case 'W':
+			workers_set(strtoul(optarg, NULL, 10));
+			break;
+		case 'C':
+			flight_set(1);
+			break;
 		default:
 			ret = 1;
 			break;
 		}
 	}
 
+	/* the host, port and mode options make one more listener */
+	if (server_opts.address &&
+			listener_add(server_opts.mode, server_opts.address, strlen(server_opts.address), server_opts.port)) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (!server_opts.listener_count && !server_opts.takeover_path) {
+		help_print();
+		ret = 1;
+		goto cleanup;
+	}
+
 	/* set the interrupt signal handler */
 	signal(SIGINT, sigint_handler);
 
-	/* call the corresponding connection type */
-	if (server_opts.mode == IP_TCP) {
-		ret = handle_tcp();
-	} else {
-		ret = handle_udp();
+	/* SIGUSR1 dumps the recent request timelines */
+	signal(SIGUSR1, sigusr1_handler);
+
+	/* SIGUSR2 wakes up the sessions when draining */
+	signal(SIGUSR2, sigusr2_handler);
+	trace_set_threshold(server_opts.trace_threshold);
+
+	/* move the logging off the request path */
+	if (log_init(server_opts.pool_size + workers_count() + LOG_RINGS_SPARE)) {
+		ERR("Starting the log writer failed.");
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* start serving the metrics */
+	if (metrics_init(server_opts.stats_path)) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* all the memory of the sessions is allocated now, not while serving them, on the nodes that use it */
+	ret = 1;
+	if (affinity_init()) {
+		goto cleanup;
+	}
+	if (pools_init(server_opts.pool_size)) {
+		goto cleanup;
+	}
+	if (trace_init(server_opts.pool_size + TRACE_RINGS_SPARE)) {
+		goto cleanup;
+	}
+	if (ratelimit_init()) {
+		goto cleanup;
+	}
+	if (overload_init()) {
+		goto cleanup;
+	}
+	if (timers_init()) {
+		goto cleanup;
+	}
+	if (capture_init(server_opts.capture_path)) {
+		goto cleanup;
+	}
+	if (flight_init()) {
+		goto cleanup;
+	}
+	if (workers_init()) {
+		goto cleanup;
+	}
+	if (udp_init()) {
+		goto cleanup;
+	}
+
+	/* get the listeners of the running process, only then the new ones are created */
+	if (!server_opts.takeover_path || !handoff_receive(server_opts.takeover_path)) {
+		/* serve all the listeners */
+		ret = serve();
 	}
 
 cleanup:
+	/* the helper threads stop once the server is exiting, the workers may not have been drained by serve() */
+	exit_application = 1;
+	workers_drain();
+	udp_destroy();
+	workers_destroy();
+	capture_destroy();
+	timers_destroy();
+	ratelimit_destroy();
+	pools_destroy();
+	metrics_destroy();
+	log_destroy();
 	return ret;
 }
@@ -9,9 +9,22 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include <pthread.h>
 #include <stdarg.h>
 
-#define ERR(format, ...) fprintf(stderr, "[ERR]: " format "\n", ##__VA_ARGS__);
+#include "log.h"
+#include "parser.h"
+#include "ratelimit.h"
+#include "timers.h"
+#include "trace.h"
+
+#define ERR(format, ...) LOG(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+
+#define WRN(format, ...) LOG(LOG_LEVEL_WARNING, format, ##__VA_ARGS__)
+
+#define INF(format, ...) LOG(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+
+#define DBG(format, ...) LOG(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
 
 #define MAX_BUFFER_SIZE 2048
 
@@ -19,13 +32,70 @@
 
 #define SOCKET_BACKLOG 128
 
+/* maximum number of addresses a single server listens on */
+#define MAX_LISTENERS 16
+
+/* large enough for a unix socket path with its prefix */
+#define MAX_ADDRESS_SIZE 128
+
+/* identifies the message with the listeners handed over to a new process */
+#define HANDOFF_MAGIC 0x49504b48
+
+/* how long the old process waits for the new one to confirm it took the listeners over */
+#define HANDOFF_TIMEOUT_MS 5000
+
+/* the sessions which do not finish in this time after a handoff are terminated */
+#define HANDOFF_DRAIN_TIMEOUT_MS 30000
+
 #define TCP_HELLO "HELLO\n"
 
 #define TCP_BYE "BYE\n"
 
+#define TCP_SOLVE "SOLVE "
+
+/* a batch of queries separated by spaces, answered by their results separated by spaces */
+#define TCP_SOLVEN "SOLVEN "
+
+#define TCP_RESULTN "RESULTN "
+
+/*
+ * A client greeting with this switches the session to binary frames, an opcode and the length of the payload
+ * in network order. A query is sent without any command and LF, its literals may be TCP_BIN_LITERAL followed
+ * by 8 bytes of the value in network order. A result which fits into 64 bits comes as such 8 bytes as well.
+ */
+#define TCP_HELLO_BIN "HELLO BIN\n"
+
+#define TCP_BIN_HEADER_SIZE 5
+
+#define TCP_BIN_SOLVE 0
+
+#define TCP_BIN_RESULT 1
+
+#define TCP_BIN_BYE 2
+
+#define TCP_BIN_INTEGER 3
+
+#define TCP_BIN_LITERAL 0xff
+
+/* the opcodes of the batch datagrams, a request and a response to a single query are 0 and 1 */
+#define UDP_BATCH_REQUEST 2
+#define UDP_BATCH_RESPONSE 3
+
+/* default deadlines of a TCP session in milliseconds, until HELLO, between requests and of a single request */
+#define TCP_HANDSHAKE_TIMEOUT_MS 10000
+#define TCP_IDLE_TIMEOUT_MS 300000
+#define TCP_REQUEST_TIMEOUT_MS 30000
+
+/* an expired session is interrupted again after this time until it is gone */
+#define TCP_TIMEOUT_RETRY_MS 10
+
+/* an address with this prefix is a path of a unix socket */
+#define UNIX_PREFIX "unix:"
+
 typedef enum {
 	IP_TCP,
-	IP_UDP
+	IP_UDP,
+	IP_SHM
 } protocol_type;
 
 typedef enum {
@@ -37,18 +107,84 @@ typedef enum {
 
 struct context {
 	int sock;
+	int slot;
+	pthread_t tid;
+	struct timer timer;
+	volatile int timed_out;
+	int idle;
+	int busy;
+	int binary;
+	unsigned int conn;
+	unsigned long long sojourn;
+	int limited;
+	struct ratelimit_key key;
 	conn_state state;
+	struct trace_request trace;
+	struct stream_parser parser;
+	int offset;
+	int buffered;
 	char buffer[MAX_BUFFER_SIZE];
+	char *batch;
+	int batch_len;
+	int batch_size;
+};
+
+/* a single address the server listens on and the protocol it serves there */
+struct listener {
+	protocol_type mode;
+	char address[MAX_ADDRESS_SIZE];
+	unsigned int port;
+	int sock;
 };
 
 struct server_opts {
 	const char *address;
 	unsigned int port;
 	protocol_type mode;
+	struct listener listeners[MAX_LISTENERS];
+	int listener_count;
+	const char *stats_path;
+	const char *handoff_path;
+	const char *takeover_path;
+	unsigned long long handshake_timeout;
+	unsigned long long idle_timeout;
+	unsigned long long request_timeout;
+	unsigned long long trace_threshold;
+	unsigned int pool_size;
+	const char *capture_path;
 };
 
-int handle_tcp();
+extern const char *mode_names[];
+
+/* set once the listeners were handed over, the sessions end as soon as they are idle */
+extern volatile int drain_sessions;
+
+const char *unix_path(const char *address);
+
+int unix_init_server(const char *path, int type);
+
+int tcp_init_server(const char *address, int port);
+
+void tcp_accept(int server_sock);
+
+int tcp_drain(void);
+
+void tcp_shutdown(void);
+
+int udp_init_server(const char *address, int port);
+
+void udp_handle(int server_sock);
+
+int udp_init(void);
+
+void udp_destroy(void);
+
+int handoff_init(const char *path);
+
+int handoff_send(int *handoff_sock, const char *path);
+
+int handoff_receive(const char *path);
 
-int handle_udp();
+int udp_create_response(char buffer[MAX_BUFFER_SIZE], int err, int size, int wait, struct trace_request *trace);
 
 #endif
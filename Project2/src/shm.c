@@ -0,0 +1,417 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: shm.c
+ * Desc: Shared memory transport for co-located clients
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "metrics.h"
+#include "server.h"
+#include "shm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHM_RELAX() __builtin_ia32_pause()
+#else
+#define SHM_RELAX()
+#endif
+
+extern volatile int exit_application;
+
+struct shm_session {
+	int sock;
+	int server_event;
+	int client_event;
+	int spin;
+	struct shm_region *region;
+};
+
+/* number of running sessions, the main loop waits for all of them before exiting */
+static atomic_int shm_sessions;
+
+/* returns the oldest message of a ring, NULL if it is empty */
+static struct shm_slot *
+ring_peek(struct shm_ring *ring)
+{
+	unsigned int tail;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+		return NULL;
+	}
+
+	return &ring->slots[tail & (SHM_RING_SLOTS - 1)];
+}
+
+static void
+ring_pop(struct shm_ring *ring)
+{
+	atomic_store_explicit(&ring->tail, atomic_load_explicit(&ring->tail, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/* returns the slot for a new message, NULL if the ring is full */
+static struct shm_slot *
+ring_reserve(struct shm_ring *ring)
+{
+	unsigned int head;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= SHM_RING_SLOTS) {
+		return NULL;
+	}
+
+	return &ring->slots[head & (SHM_RING_SLOTS - 1)];
+}
+
+static void
+ring_push(struct shm_ring *ring)
+{
+	atomic_store_explicit(&ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/* wakes up the other side if it is sleeping, it is called after every change of a ring */
+static void
+shm_wake(atomic_int *waiting, int event)
+{
+	uint64_t one = 1;
+
+	/* pairs with the fence in shm_sleep(), either the sleeper sees the change or this sees the flag */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(waiting, memory_order_relaxed)) {
+		return;
+	}
+
+	if ((write(event, &one, sizeof one) < 0) && (errno != EAGAIN)) {
+		ERR("Waking up the client failed (%s).", strerror(errno));
+	}
+}
+
+/* a request can be handled when there is one and its response has where to go */
+static int
+shm_ready(struct shm_region *region)
+{
+	return ring_peek(&region->requests) && ring_reserve(&region->responses);
+}
+
+/*
+ * Sleeps until the client changes one of the rings, at most a second.
+ * Returns -1 if the client disconnected, 0 otherwise.
+ */
+static int
+shm_sleep(struct shm_session *s)
+{
+	struct pollfd fds[2];
+	uint64_t value;
+	int ret = 0;
+
+	atomic_store_explicit(&s->region->server_waiting, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!shm_ready(s->region)) {
+		fds[0].fd = s->server_event;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = s->sock;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		if ((poll(fds, 2, 1000) < 0) && (errno != EINTR)) {
+			ERR("Poll failed (%s).", strerror(errno));
+			ret = -1;
+		} else if (fds[1].revents) {
+			/* nothing is ever sent over the socket, so it is readable only once the client is gone */
+			INF("Client disconnected.");
+			ret = -1;
+		} else if (fds[0].revents & POLLIN) {
+			/* just reset the counter */
+			if (read(s->server_event, &value, sizeof value) < 0) {
+				value = 0;
+			}
+		}
+	}
+
+	atomic_store_explicit(&s->region->server_waiting, 0, memory_order_relaxed);
+	return ret;
+}
+
+/* handles the oldest request of the session exactly like a UDP datagram */
+static void
+shm_handle(struct shm_session *s)
+{
+	struct shm_slot *slot;
+	struct trace_request trace;
+	char buffer[MAX_BUFFER_SIZE];
+	unsigned long long start;
+	uint32_t len;
+	int ret;
+
+	start = metrics_now();
+	memset(buffer, 0, MAX_BUFFER_SIZE);
+
+	/* the client can write into the slot at any time, so the length is read once and the request copied */
+	slot = ring_peek(&s->region->requests);
+	len = *(volatile uint32_t *)&slot->len;
+	if (len > sizeof slot->data) {
+		len = sizeof slot->data;
+	}
+	memcpy(buffer, slot->data, len);
+	ring_pop(&s->region->requests);
+	shm_wake(&s->region->client_waiting, s->client_event);
+
+	trace_begin(&trace, 1, start);
+	start = trace.stamps[TRACE_RECV] = metrics_observe(STAGE_RECV, start);
+	metrics_inc(METRIC_BYTES_RECEIVED, len);
+
+	ret = udp_parse_request(buffer, len);
+	trace.stamps[TRACE_PARSE] = metrics_observe(STAGE_PARSE, start);
+	if (ret < 0) {
+		ERR("Unexpected message (%s).", buffer);
+	} else {
+		buffer[ret + 2] = '\0';
+	}
+
+	ret = udp_create_response(buffer, ret, sizeof slot->data, 1, &trace);
+
+	/* there is room for the response, shm_ready() checked it */
+	start = metrics_now();
+	slot = ring_reserve(&s->region->responses);
+	memcpy(slot->data, buffer, ret);
+	slot->len = ret;
+	ring_push(&s->region->responses);
+	shm_wake(&s->region->client_waiting, s->client_event);
+
+	trace.stamps[TRACE_SEND] = metrics_observe(STAGE_SEND, start);
+	trace_commit(&trace);
+	metrics_inc(METRIC_BYTES_SENT, ret);
+	metrics_inc(METRIC_SHM_REQUESTS, 1);
+}
+
+static void
+shm_session_free(struct shm_session *s)
+{
+	if (s->region) {
+		munmap(s->region, sizeof *s->region);
+	}
+	if (s->server_event >= 0) {
+		close(s->server_event);
+	}
+	if (s->client_event >= 0) {
+		close(s->client_event);
+	}
+	close(s->sock);
+	free(s);
+}
+
+/* passes the shared memory and both the eventfds to the client */
+static int
+shm_send_fds(int sock, int fds[3])
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	memset(&msg, 0, sizeof msg);
+	memset(&control, 0, sizeof control);
+
+	iov.iov_base = (char *)SHM_HELLO;
+	iov.iov_len = strlen(SHM_HELLO);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)strlen(SHM_HELLO)) {
+		ERR("Sending the session to the client failed (%s).", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* creates the shared memory and the eventfds of a new session and passes them to the client */
+static struct shm_session *
+shm_session_new(int sock)
+{
+	struct shm_session *s;
+	int fds[3], memfd = -1;
+
+	s = calloc(1, sizeof *s);
+	if (!s) {
+		ERR("Memory allocation error.");
+		close(sock);
+		return NULL;
+	}
+
+	s->sock = sock;
+	s->server_event = -1;
+	s->client_event = -1;
+
+	/* spinning on a single CPU would only keep the client from running */
+	s->spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHM_SPIN : 0;
+
+	memfd = memfd_create("ipkpd-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if ((memfd < 0) || ftruncate(memfd, sizeof *s->region)) {
+		ERR("Creating shared memory failed (%s).", strerror(errno));
+		goto error;
+	}
+
+	/* the client must not be able to shrink the memory under the hands of the server */
+	if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+		ERR("Sealing shared memory failed (%s).", strerror(errno));
+		goto error;
+	}
+
+	s->region = mmap(NULL, sizeof *s->region, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (s->region == MAP_FAILED) {
+		ERR("Mapping shared memory failed (%s).", strerror(errno));
+		s->region = NULL;
+		goto error;
+	}
+	s->region->magic = SHM_MAGIC;
+	s->region->size = sizeof *s->region;
+
+	s->server_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	s->client_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if ((s->server_event < 0) || (s->client_event < 0)) {
+		ERR("Creating eventfd failed (%s).", strerror(errno));
+		goto error;
+	}
+
+	fds[0] = memfd;
+	fds[1] = s->server_event;
+	fds[2] = s->client_event;
+	if (shm_send_fds(sock, fds)) {
+		goto error;
+	}
+
+	/* the mapping keeps the memory alive */
+	close(memfd);
+	return s;
+
+error:
+	if (memfd >= 0) {
+		close(memfd);
+	}
+	shm_session_free(s);
+	return NULL;
+}
+
+/* serves a single client until it disconnects */
+static void *
+shm_session(void *arg)
+{
+	struct shm_session *s = arg;
+	int spin = 0;
+
+	while (!exit_application) {
+		if (shm_ready(s->region)) {
+			shm_handle(s);
+			spin = 0;
+		} else if (drain_sessions && !ring_peek(&s->region->requests)) {
+			INF("Ending the session, the server is draining.");
+			break;
+		} else if (spin < s->spin) {
+			SHM_RELAX();
+			spin++;
+		} else if (spin < s->spin + SHM_YIELDS) {
+			sched_yield();
+			spin++;
+		} else if (shm_sleep(s)) {
+			break;
+		}
+	}
+
+	shm_session_free(s);
+	atomic_fetch_sub(&shm_sessions, 1);
+	return NULL;
+}
+
+/* accepts a new client, passes it the shared memory and creates a thread for its session */
+void
+shm_accept(int server_sock)
+{
+	int sock;
+	unsigned long long start;
+	struct shm_session *s;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int ret;
+
+	start = metrics_now();
+	sock = accept4(server_sock, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0) {
+		return;
+	}
+
+	if (atomic_load(&shm_sessions) >= MAX_CLIENTS) {
+		ERR("Too many clients.");
+		close(sock);
+		return;
+	}
+
+	s = shm_session_new(sock);
+	if (!s) {
+		return;
+	}
+
+	metrics_observe(STAGE_ACCEPT, start);
+	metrics_inc(METRIC_CONNECTIONS, 1);
+	INF("New connection accepted.");
+
+	/* a unix socket has no incoming CPU, the session only keeps to the session CPUs */
+	pthread_attr_init(&attr);
+	affinity_session(sock, &attr);
+
+	atomic_fetch_add(&shm_sessions, 1);
+	ret = pthread_create(&tid, &attr, shm_session, s);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		ERR("Creating new thread failed.");
+		atomic_fetch_sub(&shm_sessions, 1);
+		shm_session_free(s);
+		return;
+	}
+	pthread_detach(tid);
+}
+
+/* returns the number of sessions which are still running, they notice the drain within a second */
+int
+shm_drain(void)
+{
+	return atomic_load(&shm_sessions);
+}
+
+/* waits for all the sessions, they notice the exit of the server within a second */
+void
+shm_shutdown(void)
+{
+	while (atomic_load(&shm_sessions)) {
+		usleep(1000);
+	}
+}
@@ -0,0 +1,70 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: shm.h
+ * Desc: Shared memory transport for co-located clients header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* sent to a new client along with the file descriptors of its session */
+#define SHM_HELLO "SHM\n"
+
+/* identifies the layout of the shared region, the client checks it */
+#define SHM_MAGIC 0x49504b53
+
+/* number of slots of a ring, a power of two */
+#define SHM_RING_SLOTS 64
+
+/* a slot holds a whole UDP message, which is at most 3 + 255 bytes */
+#define SHM_SLOT_SIZE 512
+
+#define SHM_CACHE_LINE 64
+
+/* number of polls of the rings before a session goes to sleep, only with more than one CPU */
+#define SHM_SPIN 4096
+
+/* then the CPU is yielded this many times, which lets the other side run without a wakeup */
+#define SHM_YIELDS 8
+
+struct shm_slot {
+	uint32_t len;
+	char data[SHM_SLOT_SIZE - sizeof(uint32_t)];
+};
+
+/*
+ * A single producer single consumer ring of messages. The head is written only by the producer,
+ * the tail only by the consumer and each of them has its own cache line.
+ */
+struct shm_ring {
+	_Alignas(SHM_CACHE_LINE) atomic_uint head;
+	_Alignas(SHM_CACHE_LINE) atomic_uint tail;
+	_Alignas(SHM_CACHE_LINE) struct shm_slot slots[SHM_RING_SLOTS];
+};
+
+/*
+ * The memory shared by the server and a single client. The requests go from the client to the server
+ * and the responses back. A side sets its waiting flag before it sleeps on its eventfd, the other side
+ * only writes to the eventfd when the flag is set.
+ */
+struct shm_region {
+	uint32_t magic;
+	uint32_t size;
+	_Alignas(SHM_CACHE_LINE) atomic_int server_waiting;
+	_Alignas(SHM_CACHE_LINE) atomic_int client_waiting;
+	struct shm_ring requests;
+	struct shm_ring responses;
+};
+
+void shm_accept(int server_sock);
+
+int shm_drain(void);
+
+void shm_shutdown(void);
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: simd.c
+ * Desc: Evaluation of the queries of the same shape across SIMD lanes
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+#include "num.h"
+#include "simd.h"
+
+/* a shape shared by fewer queries is not worth the lanes */
+#define SIMD_MIN_GROUP 2
+
+/* the slots of the shape hashes counted before grouping, a power of two above SIMD_MAX_QUERIES */
+#define SIMD_HASH_SLOTS 512
+
+/* the program of a shape pushes the next literal with this step */
+#define SIMD_PUSH 'n'
+
+/* the lanes of the 64-bit integers and of their approximations */
+typedef long long simd_vec __attribute__((vector_size(SIMD_LANES * sizeof(long long))));
+typedef unsigned long long simd_uvec __attribute__((vector_size(SIMD_LANES * sizeof(long long))));
+typedef double simd_dvec __attribute__((vector_size(SIMD_LANES * sizeof(double))));
+
+/* the kernel is built for AVX-512 and AVX2 as well, the best one the CPU supports is picked when the server starts */
+#if defined(__x86_64__)
+#define SIMD_CLONES __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+/* the operators of a query in postfix order, the literals come in the order they appear in the query */
+struct simd_shape {
+	int steps;
+	int literals;
+	char program[2 * SIMD_MAX_LITERALS];
+};
+
+/*
+ * Checks that a query fits into the lanes, that is it has few enough literals, none of them too long.
+ * Hashes the query without the digits of its literals, which is the same for all the queries of a shape.
+ */
+static int
+simd_scan(const char *query, int len, unsigned int *hash)
+{
+	int i, start, literals = 0;
+
+	*hash = 2166136261u;
+	for (i = 0; i < len; i++) {
+		if (isdigit(query[i])) {
+			start = i;
+			while ((i + 1 < len) && isdigit(query[i + 1])) {
+				i++;
+			}
+			if ((i + 1 - start > SIMD_MAX_DIGITS) || (++literals > SIMD_MAX_LITERALS)) {
+				return -1;
+			}
+		}
+
+		*hash = (*hash ^ (isdigit(query[i]) ? SIMD_PUSH : (unsigned char)query[i])) * 16777619u;
+	}
+
+	return 0;
+}
+
+/* compares two queries with their literals left out */
+static int
+simd_same_shape(const char *a, int alen, const char *b, int blen)
+{
+	int i = 0, j = 0;
+
+	while ((i < alen) && (j < blen)) {
+		if (isdigit(a[i]) && isdigit(b[j])) {
+			while ((i < alen) && isdigit(a[i])) {
+				i++;
+			}
+			while ((j < blen) && isdigit(b[j])) {
+				j++;
+			}
+		} else if (a[i++] != b[j++]) {
+			return 0;
+		}
+	}
+
+	return (i == alen) && (j == blen);
+}
+
+/* translates expr = "(" operator 2*(SP expr) ")" / 1*DIGIT into the program, the query was validated already */
+static void
+simd_compile(const char *query, int *pos, struct simd_shape *shape)
+{
+	char op;
+
+	if (isdigit(query[*pos])) {
+		while (isdigit(query[*pos])) {
+			(*pos)++;
+		}
+		shape->literals++;
+		shape->program[shape->steps++] = SIMD_PUSH;
+		return;
+	}
+
+	op = query[*pos + 1];
+	*pos += 3;
+	simd_compile(query, pos, shape);
+	(*pos)++;
+	simd_compile(query, pos, shape);
+	(*pos)++;
+	shape->program[shape->steps++] = op;
+}
+
+/* stores the literals of a query into its lane */
+static void
+simd_literals(const char *query, int len, simd_vec literals[SIMD_MAX_LITERALS], int lane)
+{
+	int i = 0, n = 0;
+	long long value;
+
+	while (i < len) {
+		if (!isdigit(query[i])) {
+			i++;
+			continue;
+		}
+
+		value = 0;
+		while ((i < len) && isdigit(query[i])) {
+			value = value * 10 + (query[i++] - '0');
+		}
+		literals[n++][lane] = value;
+	}
+}
+
+/*
+ * Runs the program of a shape on all the lanes at once. The sign bit of a lane in overflow is set once
+ * its value left 64 bits, such a lane is solved by calculate_answer() again, which gives the very same
+ * result and the same error as for any other query. A product is checked by its approximation in doubles,
+ * which may send a lane close to the limit there as well, but never lets an overflow through. There is no
+ * integer division in the vector units, a quotient is truncated from the quotient of the doubles, which
+ * is exact while both the operands are below 2^52, the lanes with greater ones are divided one by one.
+ */
+SIMD_CLONES
+static void
+simd_eval(const struct simd_shape *shape, const simd_vec literals[SIMD_MAX_LITERALS], long long values[SIMD_LANES],
+		int status[SIMD_LANES])
+{
+	simd_vec stack[SIMD_MAX_LITERALS], a, b, r, zero, big;
+	simd_vec overflow = {0}, div_zero = {0};
+	simd_dvec da, db, p;
+	const simd_dvec mul_limit = (simd_dvec){0} + 0x1p62, div_limit = (simd_dvec){0} + 0x1p52;
+	int i, lane, top = 0, literal = 0;
+
+	for (i = 0; i < shape->steps; i++) {
+		if (shape->program[i] == SIMD_PUSH) {
+			stack[top++] = literals[literal++];
+			continue;
+		}
+
+		b = stack[--top];
+		a = stack[top - 1];
+		switch (shape->program[i]) {
+		case '+':
+			r = (simd_vec)((simd_uvec)a + (simd_uvec)b);
+			overflow |= (a ^ r) & (b ^ r);
+			break;
+		case '-':
+			r = (simd_vec)((simd_uvec)a - (simd_uvec)b);
+			overflow |= (a ^ b) & (a ^ r);
+			break;
+		case '*':
+			r = (simd_vec)((simd_uvec)a * (simd_uvec)b);
+			p = __builtin_convertvector(a, simd_dvec) * __builtin_convertvector(b, simd_dvec);
+			overflow |= (p >= mul_limit) | (p <= -mul_limit);
+			break;
+		default:
+			/* a zero divisor is replaced by one, the lane fails anyway */
+			zero = (b == 0);
+			div_zero |= zero;
+			b -= zero;
+
+			da = __builtin_convertvector(a, simd_dvec);
+			db = __builtin_convertvector(b, simd_dvec);
+			big = (da >= div_limit) | (da <= -div_limit) | (db >= div_limit) | (db <= -div_limit);
+			r = __builtin_convertvector(da / db, simd_vec);
+
+			for (lane = 0; lane < SIMD_LANES; lane++) {
+				if (!big[lane]) {
+					continue;
+				} else if ((a[lane] == LLONG_MIN) && (b[lane] == -1)) {
+					overflow[lane] = -1;
+				} else {
+					r[lane] = a[lane] / b[lane];
+				}
+			}
+			break;
+		}
+		stack[top - 1] = r;
+	}
+
+	for (lane = 0; lane < SIMD_LANES; lane++) {
+		values[lane] = stack[0][lane];
+		if (overflow[lane] < 0) {
+			status[lane] = SIMD_SCALAR;
+		} else {
+			status[lane] = div_zero[lane] ? NUM_DIV_ZERO : 0;
+		}
+	}
+}
+
+/*
+ * Solves the validated queries, which share their shape with at least one other one, SIMD_LANES of them
+ * at once. Every query gets its value and its status, 0, NUM_DIV_ZERO, or SIMD_SCALAR for the queries
+ * left to calculate_answer(). At most SIMD_MAX_QUERIES queries are solved at once, nothing is allocated.
+ */
+void
+simd_solve(const char *const queries[], const int lens[], int count, long long values[], int status[])
+{
+	unsigned int hashes[SIMD_MAX_QUERIES];
+	unsigned char pending[SIMD_MAX_QUERIES], seen[SIMD_HASH_SLOTS] = {0};
+	int lanes[SIMD_LANES], lane_status[SIMD_LANES];
+	long long lane_values[SIMD_LANES];
+	simd_vec literals[SIMD_MAX_LITERALS];
+	struct simd_shape shape;
+	int i, j, n, pos;
+
+	if (count > SIMD_MAX_QUERIES) {
+		count = SIMD_MAX_QUERIES;
+	}
+
+	for (i = 0; i < count; i++) {
+		status[i] = SIMD_SCALAR;
+		pending[i] = !simd_scan(queries[i], lens[i], &hashes[i]);
+		if (pending[i] && (seen[hashes[i] & (SIMD_HASH_SLOTS - 1)] < SIMD_MIN_GROUP)) {
+			seen[hashes[i] & (SIMD_HASH_SLOTS - 1)]++;
+		}
+	}
+
+	/* a query alone in its slot has no other one of its shape, the distinct shapes are not grouped at all */
+	n = 0;
+	for (i = 0; i < count; i++) {
+		pending[i] = pending[i] && (seen[hashes[i] & (SIMD_HASH_SLOTS - 1)] >= SIMD_MIN_GROUP);
+		n += pending[i];
+	}
+	if (!n) {
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!pending[i]) {
+			continue;
+		}
+
+		/* the next queries of the same shape fill the lanes */
+		n = 0;
+		for (j = i; (j < count) && (n < SIMD_LANES); j++) {
+			if (pending[j] && (hashes[j] == hashes[i]) && simd_same_shape(queries[i], lens[i], queries[j], lens[j])) {
+				pending[j] = 0;
+				lanes[n++] = j;
+			}
+		}
+		if (n < SIMD_MIN_GROUP) {
+			continue;
+		}
+
+		memset(&shape, 0, sizeof shape);
+		pos = 0;
+		simd_compile(queries[i], &pos, &shape);
+
+		/* the unused lanes only need to stay defined */
+		for (j = 0; j < shape.literals; j++) {
+			literals[j] = (simd_vec){0} + 1;
+		}
+		for (j = 0; j < n; j++) {
+			simd_literals(queries[lanes[j]], lens[lanes[j]], literals, j);
+		}
+
+		simd_eval(&shape, literals, lane_values, lane_status);
+
+		for (j = 0; j < n; j++) {
+			values[lanes[j]] = lane_values[j];
+			status[lanes[j]] = lane_status[j];
+		}
+	}
+}
@@ -0,0 +1,29 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: simd.h
+ * Desc: Evaluation of the queries of the same shape across SIMD lanes header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+/* the queries of the same shape evaluated at once, 8 64-bit lanes fill an AVX-512 register or two AVX2 ones */
+#define SIMD_LANES 8
+
+/* a query with more literals is left to the scalar evaluation, 255 bytes hold at most 43 of them */
+#define SIMD_MAX_LITERALS 64
+
+/* a literal of more digits may not fit into a lane */
+#define SIMD_MAX_DIGITS 18
+
+/* the most queries solved at once, the count of a UDP batch is a single byte */
+#define SIMD_MAX_QUERIES 255
+
+/* the status of a query which calculate_answer() has to solve, it overflowed a lane or it has no lanes for its shape */
+#define SIMD_SCALAR 3
+
+void simd_solve(const char *const queries[], const int lens[], int count, long long values[], int status[]);
+
+#endif
@@ -9,11 +9,13 @@
 #define _GNU_SOURCE
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <stdio.h>
@@ -21,21 +23,41 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "busypoll.h"
+#include "capture.h"
+#include "flight.h"
+#include "metrics.h"
+#include "overload.h"
 #include "parser.h"
+#include "pool.h"
 #include "server.h"
 
+extern volatile int exit_application;
+
 extern struct server_opts server_opts;
 
-extern volatile int exit_application;
+/* the running sessions, the main thread interrupts them when the server is exiting */
+static struct {
+	pthread_mutex_t lock;
+	pthread_t tids[MAX_CLIENTS];
+	int used[MAX_CLIENTS];
+	int count;
+} sessions = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
 /* initializes the server */
-static int
+int
 tcp_init_server(const char *address, int port)
 {
 	int sock, ret = 0, flags;
 	struct sockaddr_in sa;
 	const int reuse_addr = 1;
 
+	/* a local socket skips the whole network stack */
+	if (unix_path(address)) {
+		return unix_init_server(unix_path(address), SOCK_STREAM);
+	}
+
 	/* create new socket */
 	sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock < 0) {
@@ -75,6 +97,7 @@ tcp_init_server(const char *address, int port)
 	if (ret) {
 		ERR("Bind failed (%s).", strerror(errno));
 		close(sock);
+		sock = -1;
 		goto cleanup;
 	}
 
@@ -83,6 +106,7 @@ tcp_init_server(const char *address, int port)
 	if (ret) {
 		ERR("Listen failed (%s).", strerror(errno));
 		close(sock);
+		sock = -1;
 		goto cleanup;
 	}
 
@@ -90,304 +114,661 @@ cleanup:
 	return sock;
 }
 
+/*
+ * Accepts the incoming connection, the main loop found the server socket readable.
+ * The key of the client is stored and limited is set if the rate limits apply to it.
+ */
 static int
-accept_new_connection(int sock)
+accept_new_connection(int sock, struct ratelimit_key *key, int *limited)
 {
     int client_sock, flags;
-    fd_set readfds;
-    struct timeval timeout;
-
-    FD_ZERO(&readfds);
-    FD_SET(sock, &readfds);
-
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-
-    /* wait for the server socket to become readable, with a timeout of one second */
-    if (select(sock + 1, &readfds, NULL, NULL, &timeout) < 0) {
-    	if (errno == EINTR) {
-    		return 0;
-    	}
-
-        ERR("Select failed (%s).", strerror(errno));
-        return -1;
-    }
-
-    /* if the server socket is readable, accept the incoming connection */
-    if (FD_ISSET(sock, &readfds)) {
-        client_sock = accept(sock, NULL, NULL);
-        if (client_sock < 0) {
+    unsigned long long start;
+    struct sockaddr_storage client_addr;
+    socklen_t addrlen = sizeof client_addr;
+
+    start = metrics_now();
+    client_sock = accept(sock, (struct sockaddr *)&client_addr, &addrlen);
+    if (client_sock < 0) {
+        if (errno != EAGAIN) {
             ERR("Accept failed (%s).", strerror(errno));
-            return -1;
         }
+        return -1;
+    }
 
-        printf("New connection accepted.\n");
+    /* a client over its limit only gets BYE, no session is created for it */
+    *limited = ratelimit_key((struct sockaddr *)&client_addr, addrlen, key);
+    if (*limited && !ratelimit_allow(key, 1, 0, 0)) {
+        DBG("Connection refused, the client is over its rate limit.");
+        send(client_sock, TCP_BYE, strlen(TCP_BYE), MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(client_sock);
+        return -1;
+    }
 
-        /* make the socket non-blocking */
-        flags = fcntl(client_sock, F_GETFL);
-        if (flags == -1) {
-            ERR("Getting socket options failed.");
-            close(client_sock);
-            return -1;
-        }
+    INF("New connection accepted.");
 
-        flags = fcntl(client_sock, F_SETFL, flags | O_NONBLOCK);
-        if (flags == -1) {
-            ERR("Setting socket options failed.");
-            close(client_sock);
-            return -1;
-        }
+    /* make the socket non-blocking */
+    flags = fcntl(client_sock, F_GETFL);
+    if (flags == -1) {
+        ERR("Getting socket options failed.");
+        close(client_sock);
+        return -1;
+    }
 
-        return client_sock;
+    flags = fcntl(client_sock, F_SETFL, flags | O_NONBLOCK);
+    if (flags == -1) {
+        ERR("Setting socket options failed.");
+        close(client_sock);
+        return -1;
     }
 
-    return -1;
+    metrics_observe(STAGE_ACCEPT, start);
+    metrics_inc(METRIC_CONNECTIONS, 1);
+
+    return client_sock;
 }
 
-/* creates new context */
+/* creates new context on the node the session is going to run on */
 static struct context *
-ctx_new(int sock)
+ctx_new(int sock, int slot, int node)
 {
 	struct context *ctx;
 
-	ctx = calloc(1, sizeof *ctx);
+	ctx = pool_alloc_node(&context_pool, node);
 	if (!ctx) {
 		ERR("Memory allocation error.");
 		return NULL;
 	}
+	memset(ctx, 0, sizeof *ctx);
 
 	ctx->sock = sock;
+	ctx->slot = slot;
+	ctx->idle = 1;
 	ctx->state = INIT;
 
 	return ctx;
 }
 
+/*
+ * Receives more data into the buffer, the unprocessed bytes are moved to its beginning first.
+ * Returns the number of received bytes, 0 if the client disconnected or -1 on error.
+ */
 static int
-tcp_init(struct context *ctx)
+tcp_recv(struct context *ctx)
 {
-	int ret = 0;
+	int ret;
+	unsigned int spin = 0;
 	fd_set readfds;
-	int already_read = 0;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		char buf[CMSG_SPACE(sizeof(struct timespec))];
+		struct cmsghdr align;
+	} control;
+
+	if (ctx->offset) {
+		memmove(ctx->buffer, ctx->buffer + ctx->offset, ctx->buffered - ctx->offset);
+		ctx->buffered -= ctx->offset;
+		ctx->offset = 0;
+	}
+
+	/* the arrival time of the data comes along with it, if the overload control is on */
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = ctx->buffer + ctx->buffered;
+	iov.iov_len = MAX_BUFFER_SIZE - ctx->buffered;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
 
 	while (1) {
+		if (ctx->timed_out) {
+			INF("Session timed out.");
+			ctx->state = TERM;
+			return 0;
+		}
+
+		/* a draining server ends the sessions which wait for a new request */
+		if (drain_sessions && ctx->idle) {
+			INF("Ending the session, the server is draining.");
+			ctx->state = TERM;
+			return 0;
+		}
+
+		/* with busy polling the non-blocking socket is read right away, it is waited for once it stays empty */
+		if (busy_poll_enabled()) {
+			msg.msg_controllen = sizeof control.buf;
+			ret = recvmsg(ctx->sock, &msg, 0);
+			if ((ret >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))) {
+				break;
+			}
+			if (busy_poll_backoff(&spin)) {
+				continue;
+			}
+		}
+
 		FD_ZERO(&readfds);
-        FD_SET(ctx->sock, &readfds);
+		FD_SET(ctx->sock, &readfds);
 
-        /* wait for incoming data from the client */
-        ret = select(ctx->sock + 1, &readfds, NULL, NULL, NULL);
-        if (ret < 0) {
-        	if (errno == EINTR) {
-    			return 0;
-    		}
+		/* wait for incoming data from the client */
+		ret = select(ctx->sock + 1, &readfds, NULL, NULL, NULL);
+		if (ret < 0) {
+			if ((errno == EINTR) && !exit_application) {
+				continue;
+			}
 
-            ERR("Select failed (%s).", strerror(errno));
-            goto cleanup;
-        }
+			ERR("Select failed (%s).", strerror(errno));
+			return -1;
+		}
 
-        /* if the client is ready, read the data */
-        if (FD_ISSET(ctx->sock, &readfds)) {
-            ret = recv(ctx->sock, ctx->buffer + already_read, MAX_BUFFER_SIZE - already_read, 0);
-            if (ret < 0) {
-                ERR("Recv failed (%s).", strerror(errno));
-                goto cleanup;
-            } else if (ret == 0) {
-                printf("Client disconnected.\n");
-                ctx->state = TERM;
-                goto cleanup;
-            } else {
-            	/* got data, check if it's just HELLO\n */
-            	if (!strchr(ctx->buffer, '\n')) {
-            		/* new line not found */
-            		already_read += ret;
-            		continue;
-            	}
-                ctx->buffer[already_read + ret] = '\0';
-                if (!strncmp(ctx->buffer, TCP_HELLO, strlen(TCP_HELLO))) {
-                	ret = send(ctx->sock, TCP_HELLO, strlen(TCP_HELLO), 0);
-                	if (ret == -1) {
-                		ERR("Sending hello message failed (%s).", strerror(errno));
-                	} else {
-                		ctx->state = READ;
-                	}
-                } else {
-                	/* expected hello, got something else */
-                	ctx->state = TERM;
-                }
-
-                goto cleanup;
-            }
-        }
-    }
+		if (FD_ISSET(ctx->sock, &readfds)) {
+			msg.msg_controllen = sizeof control.buf;
+			ret = recvmsg(ctx->sock, &msg, 0);
+			break;
+		}
+	}
 
-cleanup:
-    return ret;
+	ctx->sojourn = overload_sojourn(&msg);
+	if (ret < 0) {
+		ERR("Recv failed (%s).", strerror(errno));
+		return -1;
+	} else if (ret == 0) {
+		INF("Client disconnected.");
+		ctx->state = TERM;
+		return 0;
+	}
+
+	metrics_inc(METRIC_BYTES_RECEIVED, ret);
+	capture_data(IP_TCP, ctx->conn, ctx->buffer + ctx->buffered, ret);
+	ctx->buffered += ret;
+
+	if (ctx->limited && !ratelimit_allow(&ctx->key, 0, 0, ret)) {
+		DBG("Terminating the session, the client is over its rate limit.");
+		ctx->state = TERM;
+		return 0;
+	}
+	return ret;
 }
 
-/* checks the query */
 static int
-tcp_check_message(struct context *ctx)
+tcp_init(struct context *ctx)
 {
-	int ret = 0;
+	int ret = 0, binary;
+	char *lf;
 
-	/* check length of shortest possible valid message */
-	if (strlen(ctx->buffer) < strlen("SOLVE (+ 1 1)\n")) {
-		ERR("Invalid message.\n");
-		ret = 1;
-		ctx->state = TERM;
-		goto cleanup;
+	/* wait for the whole first line */
+	while (!(lf = memchr(ctx->buffer, '\n', ctx->buffered))) {
+		if (ctx->buffered == MAX_BUFFER_SIZE) {
+			/* the line can not be a hello */
+			ctx->state = TERM;
+			goto cleanup;
+		}
+
+		ret = tcp_recv(ctx);
+		if (ret <= 0) {
+			goto cleanup;
+		}
 	}
 
-	/* parse the message */
-	ret = tcp_parse_query(ctx->buffer);
-	if (ret) {
-		ERR("Unexpected message (%s).", ctx->buffer);
+	/* the binary frames are chosen by the hello */
+	binary = (lf + 1 - ctx->buffer == (int)strlen(TCP_HELLO_BIN)) && !strncmp(ctx->buffer, TCP_HELLO_BIN, strlen(TCP_HELLO_BIN));
+
+	if (binary ||
+			((lf + 1 - ctx->buffer == (int)strlen(TCP_HELLO)) && !strncmp(ctx->buffer, TCP_HELLO, strlen(TCP_HELLO)))) {
+		/* an overloaded server takes no new sessions, the client gets BYE before it sends any request */
+		if (overload_active()) {
+			DBG("Refusing the session, the server is overloaded.");
+			metrics_inc(METRIC_SHED, 1);
+			ctx->state = TERM;
+			goto cleanup;
+		}
+
+		ret = send(ctx->sock, binary ? TCP_HELLO_BIN : TCP_HELLO, lf + 1 - ctx->buffer, 0);
+		if (ret == -1) {
+			ERR("Sending hello message failed (%s).", strerror(errno));
+			goto cleanup;
+		}
+		ctx->binary = binary;
+
+		/* the client may have already sent its first requests */
+		timer_arm(&ctx->timer, server_opts.idle_timeout);
+		ctx->offset = lf + 1 - ctx->buffer;
+		ctx->idle = 0;
+		ctx->state = READ;
+		ret = 0;
+	} else {
+		/* expected hello, got something else */
 		ctx->state = TERM;
-		goto cleanup;
 	}
 
 cleanup:
 	return ret;
 }
 
-/* read logic */
+/* appends the result in the parser to the response of a batch, the last one ends the line */
 static int
-tcp_read(struct context *ctx)
+tcp_batch_add(struct context *ctx, int last)
 {
-	int ret = 0;
-	fd_set readfds;
-	int already_read = 0;
+	int len, size;
+	char *batch;
+
+	/* the prefix or the separator and the result, whose terminator leaves room for the LF */
+	len = (ctx->batch_len ? 1 : (int)strlen(TCP_RESULTN)) + num_str_size(&ctx->parser.result);
+	if (ctx->batch_len + len > ctx->batch_size) {
+		/* the responses of the usual batches fit into a buffer of the pool */
+		size = ctx->batch_size ? ctx->batch_size * 2 : MAX_BUFFER_SIZE;
+		while (size < ctx->batch_len + len) {
+			size *= 2;
+		}
+
+		batch = (size == MAX_BUFFER_SIZE) ? pool_alloc(&buffer_pool) : malloc(size);
+		if (!batch) {
+			ERR("Memory allocation error.");
+			return -1;
+		}
+		memcpy(batch, ctx->batch, ctx->batch_len);
+		pool_free(&buffer_pool, ctx->batch);
+		ctx->batch = batch;
+		ctx->batch_size = size;
+	}
 
-	/* reset the buffer */
-	memset(ctx->buffer, 0, MAX_BUFFER_SIZE);
+	if (ctx->batch_len) {
+		ctx->batch[ctx->batch_len++] = ' ';
+	} else {
+		memcpy(ctx->batch, TCP_RESULTN, strlen(TCP_RESULTN));
+		ctx->batch_len = strlen(TCP_RESULTN);
+	}
 
+	len = num_to_str(&ctx->parser.result, ctx->batch + ctx->batch_len);
+	if (len < 0) {
+		ERR("Memory allocation error.");
+		return -1;
+	}
+	ctx->batch_len += len;
+
+	if (last) {
+		ctx->batch[ctx->batch_len++] = '\n';
+	}
+	metrics_inc(METRIC_BATCH_ITEMS, 1);
+	return 0;
+}
+
+/* returns the buffer of the batch responses */
+static void
+tcp_batch_free(struct context *ctx)
+{
+	pool_free(&buffer_pool, ctx->batch);
+	ctx->batch = NULL;
+	ctx->batch_len = 0;
+	ctx->batch_size = 0;
+}
+
+/*
+ * Feeds the query of a binary frame to the parser. The length of the frame is known from its header,
+ * so the query ends with the frame and its bytes are never searched for the LF.
+ * Returns 1 once the parser got the whole frame, otherwise what tcp_recv() returned.
+ */
+static int
+tcp_feed_frame(struct context *ctx, unsigned long long *chunk)
+{
+	uint32_t left;
+	int ret, len, consumed;
+	unsigned char opcode;
+
+	/* the header may be split as well */
+	while (ctx->buffered - ctx->offset < TCP_BIN_HEADER_SIZE) {
+		ret = tcp_recv(ctx);
+		if (ret <= 0) {
+			return ret;
+		}
+		*chunk = metrics_now();
+	}
+
+	opcode = ctx->buffer[ctx->offset];
+	memcpy(&left, ctx->buffer + ctx->offset + 1, sizeof left);
+	left = ntohl(left);
+	ctx->offset += TCP_BIN_HEADER_SIZE;
+
+	if (opcode == TCP_BIN_BYE) {
+		ctx->parser.state = STREAM_BYE;
+		return 1;
+	} else if (opcode != TCP_BIN_SOLVE) {
+		ctx->parser.state = STREAM_ERROR;
+		return 1;
+	}
+
+	stream_query(&ctx->parser);
 	while (1) {
-		FD_ZERO(&readfds);
-        FD_SET(ctx->sock, &readfds);
+		len = ctx->buffered - ctx->offset;
+		if ((uint32_t)len > left) {
+			len = left;
+		}
 
-        /* wait for incoming data from the client */
-        ret = select(ctx->sock + 1, &readfds, NULL, NULL, NULL);
-        if (ret < 0) {
-            ERR("Select failed (%s).", strerror(errno));
-            goto cleanup;
-        }
+		consumed = stream_feed(&ctx->parser, ctx->buffer + ctx->offset, len);
+		ctx->offset += consumed;
+		left -= consumed;
 
-        /* if the client is ready, read the data */
-        if (FD_ISSET(ctx->sock, &readfds)) {
-            ret = recv(ctx->sock, ctx->buffer + already_read, MAX_BUFFER_SIZE - already_read, 0);
-            if (ret < 0) {
-                ERR("Recv failed (%s).", strerror(errno));
-                goto cleanup;
-            } else if (ret == 0) {
-                printf("Client disconnected.\n");
-                ctx->state = TERM;
-                goto cleanup;
-            } else {
-            	if (!strchr(ctx->buffer, '\n')) {
-            		/* new line not found */
-            		already_read += ret;
-            		continue;
-            	}
-                ctx->buffer[already_read + ret] = '\0';
-                if (!strncmp(ctx->buffer, TCP_BYE, strlen(TCP_BYE))) {
-                	ctx->state = TERM;
-                	ret = 0;
-                	printf("Sending BYE to client.\n");
-                	goto cleanup;
-                }
-
-                ret = tcp_check_message(ctx);
-                if (!ret) {
-                	/* set state to write */
-                	ctx->state = WRITE;
-                }
-
-                goto cleanup;
-            }
-        }
-    }
+		if (!left) {
+			stream_end(&ctx->parser);
+		}
 
-cleanup:
-    return ret;
+		if (ctx->parser.state == STREAM_ERROR) {
+			return 1;
+		}
+
+		/* the query has to end exactly with the frame */
+		if (!left || (ctx->parser.state == STREAM_SOLVE)) {
+			if (left || (ctx->parser.state != STREAM_SOLVE)) {
+				ctx->parser.state = STREAM_ERROR;
+			}
+			return 1;
+		}
+
+		ret = tcp_recv(ctx);
+		if (ret <= 0) {
+			return ret;
+		}
+		*chunk = metrics_now();
+	}
 }
 
+/*
+ * Puts the query of a whole SOLVE line in the buffer in flight, or takes the result of an identical query
+ * in flight, the line is consumed then. A line not received whole, a batch and a frame are never coalesced.
+ * Returns 1 if the result was shared.
+ */
 static int
-tcp_get_answer(struct context *ctx, int *answer)
+tcp_flight_join(struct context *ctx, struct flight *flight)
 {
-	int ret = 0;
-	const char *expression;
-	struct node *tree = NULL;
+	const char *query = ctx->buffer + ctx->offset + strlen(TCP_SOLVE), *lf;
+	int ret;
 
-	expression = ctx->buffer + strlen("SOLVE ");
-	ret = new_tree(expression, &tree);
-	if (ret) {
+	if (!flight_enabled() || (ctx->buffered - ctx->offset <= (int)strlen(TCP_SOLVE)) ||
+			strncmp(ctx->buffer + ctx->offset, TCP_SOLVE, strlen(TCP_SOLVE))) {
+		return 0;
+	}
+
+	lf = memchr(query, '\n', ctx->buffer + ctx->buffered - query);
+	if (!lf || (flight_join(flight, query, lf - query, 1, &ctx->parser.result, &ret) != FLIGHT_SHARED)) {
+		return 0;
+	}
+
+	ctx->offset = lf + 1 - ctx->buffer;
+	ctx->parser.error = ret;
+	ctx->parser.state = ret ? STREAM_ERROR : STREAM_SOLVE;
+	return 1;
+}
+
+/* shares the result of a query put in flight, a syntax error is left for every query to find on its own */
+static void
+tcp_flight_leave(struct context *ctx, struct flight *flight)
+{
+	int ret = FLIGHT_UNSHARED;
+
+	if (ctx->parser.state == STREAM_SOLVE) {
+		ret = 0;
+	} else if ((ctx->parser.state == STREAM_ERROR) && ctx->parser.error) {
+		ret = ctx->parser.error;
+	}
+
+	flight_leave(flight, ret, &ctx->parser.result);
+}
+
+/*
+ * Read logic, the request is parsed and evaluated chunk by chunk as it arrives,
+ * so its length is not limited by the size of the buffer.
+ */
+static int
+tcp_read(struct context *ctx)
+{
+	int ret = 0, consumed, shared = 0;
+	unsigned long long start, chunk;
+	struct flight flight = {.key = NULL};
+
+	stream_reset(&ctx->parser);
+
+	/* the request starts with its first received bytes, until then the session is idle */
+	if (ctx->offset == ctx->buffered) {
+		ctx->idle = 1;
+		ret = tcp_recv(ctx);
+		ctx->idle = 0;
+		if (ret <= 0) {
+			goto cleanup;
+		}
+
+		/* how long the request waited in the socket before this session got to it */
+		overload_record(ctx->sojourn);
+	}
+
+	if (ctx->limited && !ratelimit_allow(&ctx->key, 0, 1, 0)) {
+		DBG("Terminating the session, the client is over its rate limit.");
+		ctx->state = TERM;
 		goto cleanup;
 	}
+	overload_enter();
+	ctx->busy = 1;
+	timer_arm(&ctx->timer, server_opts.request_timeout);
+	start = chunk = metrics_now();
+	trace_begin(&ctx->trace, 0, start);
+
+	/* a binary frame tells its length, a line is parsed until its LF, unless an identical query was solved meanwhile */
+	if (ctx->binary) {
+		ret = tcp_feed_frame(ctx, &chunk);
+		if (ret <= 0) {
+			goto cleanup;
+		}
+	} else {
+		shared = tcp_flight_join(ctx, &flight);
+	}
+
+	while (!ctx->binary && !shared) {
+		consumed = stream_feed(&ctx->parser, ctx->buffer + ctx->offset, ctx->buffered - ctx->offset);
+		ctx->offset += consumed;
+
+		if (ctx->parser.state == STREAM_NEXT) {
+			/* a query of a batch, its result is kept until the whole batch is solved */
+			if (num_sign(&ctx->parser.result) < 0) {
+				break;
+			}
+			if (tcp_batch_add(ctx, 0)) {
+				ctx->parser.error = NUM_NO_MEMORY;
+				break;
+			}
+			continue;
+		}
+
+		if ((ctx->parser.state == STREAM_SOLVE) || (ctx->parser.state == STREAM_BYE) ||
+				(ctx->parser.state == STREAM_ERROR)) {
+			break;
+		}
 
-	*answer = calculate_answer(tree);
-	if (*answer == INT_MIN) {
+		/* the whole buffer was consumed, wait for the rest of the request */
+		ret = tcp_recv(ctx);
+		if (ret <= 0) {
+			goto cleanup;
+		}
+		chunk = metrics_now();
+	}
+	tcp_flight_leave(ctx, &flight);
+	ret = 0;
+
+	/*
+	 * The receive stage lasts until the last chunk arrived and includes parsing of the previous ones,
+	 * the parse stage is the evaluation of the last chunk.
+	 */
+	ctx->trace.stamps[TRACE_RECV] = chunk;
+	metrics_record(STAGE_RECV, chunk - start);
+	ctx->trace.stamps[TRACE_PARSE] = metrics_observe(STAGE_PARSE, chunk);
+
+	if (ctx->parser.state == STREAM_BYE) {
+		ctx->state = TERM;
+		INF("Sending BYE to client.");
+		goto cleanup;
+	}
+
+	if (ctx->parser.error == NUM_DIV_ZERO) {
 		ERR("Calculation failed (0 division).");
 		ret = 1;
-		goto cleanup;
-	} else if (*answer < 0) {
+	} else if (ctx->parser.error == NUM_TOO_LARGE) {
+		ERR("Calculation failed (number too large).");
+		ret = 1;
+	} else if (ctx->parser.error == NUM_NO_MEMORY) {
+		ERR("Memory allocation error.");
+		ret = 1;
+	} else if (ctx->parser.state == STREAM_ERROR) {
+		ERR("Unexpected message.");
+		ret = 1;
+	} else if (num_sign(&ctx->parser.result) < 0) {
 		ERR("Calculation failed (negative result).");
 		ret = 1;
+	}
+
+	if (ret) {
+		metrics_inc(METRIC_ERRORS, 1);
+		trace_commit(&ctx->trace);
+		ctx->state = TERM;
 		goto cleanup;
 	}
 
+	/* set state to write, the result stays in the parser */
+	ctx->state = WRITE;
+
 cleanup:
-	del_tree(tree);
+	/* the waiters for the query must never be left behind */
+	tcp_flight_leave(ctx, &flight);
 	return ret;
 }
 
 static int
 tcp_write(struct context *ctx)
 {
-	int ret = 0, answer = 0;
+	int ret = 0, len, head, sent = 0, ready;
 	fd_set writefds;
+	unsigned long long start;
+	uint64_t value;
+	uint32_t length;
+	char small[64], *response = small;
+
+	if (ctx->parser.batch) {
+		/* the results of a batch were collected as it was solved, only the last one is missing */
+		if (tcp_batch_add(ctx, 1)) {
+			ret = -1;
+			goto cleanup;
+		}
+		response = ctx->batch;
+		len = ctx->batch_len;
+	} else if (ctx->binary && !ctx->parser.result.big) {
+		/* a result in a machine word is sent as it is, without any formatting */
+		value = htobe64(ctx->parser.result.small);
+		response[0] = TCP_BIN_INTEGER;
+		length = htonl(sizeof value);
+		memcpy(response + 1, &length, sizeof length);
+		memcpy(response + TCP_BIN_HEADER_SIZE, &value, sizeof value);
+		len = TCP_BIN_HEADER_SIZE + sizeof value;
+	} else {
+		/* the buffer may hold the following requests, the answer has its own, only a huge one comes from the heap */
+		head = ctx->binary ? TCP_BIN_HEADER_SIZE : (int)strlen("RESULT ");
+		len = head + num_str_size(&ctx->parser.result) + 1;
+		if (len > MAX_BUFFER_SIZE) {
+			response = malloc(len);
+		} else if (len > (int)sizeof small) {
+			response = pool_alloc(&buffer_pool);
+		}
+		if (!response) {
+			ERR("Memory allocation error.");
+			ret = -1;
+			goto cleanup;
+		}
 
-	/* get the answer to the query */
-	ret = tcp_get_answer(ctx, &answer);
-	if (ret) {
-		ERR("Getting answer failed.");
-		ctx->state = TERM;
-		goto cleanup;
+		len = num_to_str(&ctx->parser.result, response + head);
+		if (len < 0) {
+			ERR("Memory allocation error.");
+			ret = -1;
+			goto cleanup;
+		}
+
+		if (ctx->binary) {
+			/* a result too large for a machine word comes in decimal */
+			response[0] = TCP_BIN_RESULT;
+			length = htonl(len);
+			memcpy(response + 1, &length, sizeof length);
+			len += head;
+		} else {
+			memcpy(response, "RESULT ", strlen("RESULT "));
+			len += head;
+			response[len++] = '\n';
+		}
 	}
 
-	/* reset the buffer and set it to the answer */
-	memset(ctx->buffer, 0, MAX_BUFFER_SIZE);
-	sprintf(ctx->buffer, "RESULT %d\n", answer);
+	start = metrics_now();
+
+	/* with busy polling the response is sent right away, the socket is waited for only once it is full */
+	ready = busy_poll_enabled();
 
 	while (1) {
-		FD_ZERO(&writefds);
-        FD_SET(ctx->sock, &writefds);
-
-        /* wait for the client to be ready for writing */
-        ret = select(ctx->sock + 1, NULL, &writefds, NULL, NULL);
-        if (ret < 0) {
-            ERR("Select failed (%s).", strerror(errno));
-            goto cleanup;
-        }
+		/* a client which does not read its response must not hold the session forever */
+		if (ctx->timed_out) {
+			INF("Session timed out.");
+			ctx->state = TERM;
+			ret = 0;
+			goto cleanup;
+		}
 
-        /* if the client socket is writeable, write answer */
-        if (FD_ISSET(ctx->sock, &writefds)) {
-            ret = send(ctx->sock, ctx->buffer, MAX_BUFFER_SIZE, 0);
-            if (ret < 0) {
-                ERR("Send failed (%s).", strerror(errno));
-                goto cleanup;
-            } else if (ret == 0) {
-                printf("Client disconnected.\n");
-                ctx->state = TERM;
-                goto cleanup;
-            } else {
-            	ctx->state = READ;
-            	ret = 0;
-                goto cleanup;
-            }
-        }
-    }
+		if (!ready) {
+			FD_ZERO(&writefds);
+			FD_SET(ctx->sock, &writefds);
+
+			/* wait for the client to be ready for writing */
+			ret = select(ctx->sock + 1, NULL, &writefds, NULL, NULL);
+			if (ret < 0) {
+				if ((errno == EINTR) && !exit_application) {
+					/* woken up by a drain or a timeout, the response is finished first unless the deadline passed */
+					continue;
+				}
+
+				ERR("Select failed (%s).", strerror(errno));
+				goto cleanup;
+			}
+			ready = FD_ISSET(ctx->sock, &writefds);
+		}
+
+		/* if the client socket is writeable, write answer, a large one may take more sends */
+		if (ready) {
+			ret = send(ctx->sock, response + sent, len - sent, 0);
+			if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+				/* the socket buffer is full */
+				ready = 0;
+				continue;
+			} else if (ret < 0) {
+				ERR("Send failed (%s).", strerror(errno));
+				goto cleanup;
+			} else if (ret == 0) {
+				INF("Client disconnected.");
+				ctx->state = TERM;
+				goto cleanup;
+			}
+
+			metrics_inc(METRIC_BYTES_SENT, ret);
+			sent += ret;
+			if (sent == len) {
+				ctx->trace.stamps[TRACE_SEND] = metrics_observe(STAGE_SEND, start);
+				trace_commit(&ctx->trace);
+				overload_leave();
+				ctx->busy = 0;
+				timer_arm(&ctx->timer, server_opts.idle_timeout);
+				metrics_inc(METRIC_TCP_REQUESTS, 1);
+				ctx->state = READ;
+				ret = 0;
+				goto cleanup;
+			}
+		}
+	}
 
 cleanup:
-    return ret;
+	if (ctx->parser.batch) {
+		tcp_batch_free(ctx);
+	} else if (response != small) {
+		pool_free(&buffer_pool, response);
+	}
+	return ret;
 }
 
 /* terminates the connection and the underlying thread */
@@ -395,19 +776,50 @@ static void
 tcp_term(struct context *ctx)
 {
 	int ret;
+	const char bye[TCP_BIN_HEADER_SIZE] = {TCP_BIN_BYE};
 
-	ret = send(ctx->sock, TCP_BYE, strlen(TCP_BYE), 0);
+	if (ctx->binary) {
+		ret = send(ctx->sock, bye, sizeof bye, 0);
+	} else {
+		ret = send(ctx->sock, TCP_BYE, strlen(TCP_BYE), 0);
+	}
 	if (ret == -1) {
 		ERR("Sending bye message failed (%s).", strerror(errno));
 	}
 
+	/* the timer must not fire once the context is gone */
+	timer_cancel(&ctx->timer);
+
+	capture_close(ctx->conn);
 	close(ctx->sock);
 	ctx->sock = -1;
-	free(ctx);
+	stream_free(&ctx->parser);
+	tcp_batch_free(ctx);
+	if (ctx->busy) {
+		overload_leave();
+	}
 
+	/* from now on the main thread does not interrupt this thread */
+	pthread_mutex_lock(&sessions.lock);
+	sessions.used[ctx->slot] = 0;
+	sessions.count--;
+	pthread_mutex_unlock(&sessions.lock);
+
+	pool_free(&context_pool, ctx);
 	pthread_exit(NULL);
 }
 
+/* the deadline of a session passed, it is interrupted until it notices */
+static unsigned long long
+tcp_timeout(struct timer *timer)
+{
+	struct context *ctx = (struct context *)((char *)timer - offsetof(struct context, timer));
+
+	ctx->timed_out = 1;
+	pthread_kill(ctx->tid, SIGUSR2);
+	return TCP_TIMEOUT_RETRY_MS;
+}
+
 /* logic for a TCP session */
 static void *
 tcp_session(void *arg)
@@ -415,6 +827,11 @@ tcp_session(void *arg)
 	int ret = 0;
 	struct context *ctx = arg;
 
+	/* the client has to say HELLO in time */
+	ctx->tid = pthread_self();
+	ctx->timer.expire = tcp_timeout;
+	timer_arm(&ctx->timer, server_opts.handshake_timeout);
+
 	while (1) {
 		/* get current state */
 		switch (ctx->state) {
@@ -442,54 +859,93 @@ tcp_session(void *arg)
 	return NULL;
 }
 
-/* the main thread keeps executing this function and creates new threads here for each session */
-int
-handle_tcp()
+/* accepts a new client and creates a new thread for its session */
+void
+tcp_accept(int server_sock)
 {
-	int ret, server_sock, sock, i, j;
-	pthread_t tids[MAX_CLIENTS];
+	int sock, slot, limited, node;
 	struct context *ctx;
+	struct ratelimit_key key;
+	pthread_attr_t attr;
 
-	/* initialize the server */
-	server_sock = tcp_init_server(server_opts.address, server_opts.port);
-	if (server_sock < 0) {
-		ERR("Initializing TCP server failed.");
-		return -1;
+	sock = accept_new_connection(server_sock, &key, &limited);
+	if (sock < 0) {
+		return;
 	}
 
-	i = 0;
-	while(!exit_application) {
-		sock = accept_new_connection(server_sock);
-		if (sock > 0) {
-			/* new connection accepted, create new context for a new thread */
-			ctx = ctx_new(sock);
-			if (!ctx) {
-				ERR("Creating new context failed.");
-				goto cleanup;
-			}
+	/* the session runs close to the CPU, which receives its packets */
+	pthread_attr_init(&attr);
+	node = affinity_session(sock, &attr);
 
-			/* create new thread for the session */
-			ret = pthread_create(&tids[i++], NULL, tcp_session, ctx);
-			if (ret) {
-				ERR("Creating new thread failed.");
-				close(sock);
-				goto cleanup;
-			}
-		}
+	pthread_mutex_lock(&sessions.lock);
 
-		usleep(100);
+	for (slot = 0; (slot < MAX_CLIENTS) && sessions.used[slot]; slot++);
+	if (slot == MAX_CLIENTS) {
+		ERR("Too many clients.");
+		close(sock);
+		goto cleanup;
 	}
 
-cleanup:
-	/* send interrupt signal to all threads */
-	for (j = 0; j < i; j++) {
-		pthread_kill(tids[j], SIGINT);
+	/* new connection accepted, create new context for a new thread */
+	ctx = ctx_new(sock, slot, node);
+	if (!ctx) {
+		ERR("Creating new context failed.");
+		close(sock);
+		goto cleanup;
 	}
+	ctx->key = key;
+	ctx->limited = limited;
+	ctx->conn = capture_open();
+
+	/* create new thread for the session, it can not finish before the lock is released */
+	if (pthread_create(&sessions.tids[slot], &attr, tcp_session, ctx)) {
+		ERR("Creating new thread failed.");
+		capture_close(ctx->conn);
+		close(sock);
+		pool_free(&context_pool, ctx);
+		goto cleanup;
+	}
+	pthread_detach(sessions.tids[slot]);
+
+	sessions.used[slot] = 1;
+	sessions.count++;
+
+cleanup:
+	pthread_mutex_unlock(&sessions.lock);
+	pthread_attr_destroy(&attr);
+}
+
+/* sends a signal to all the sessions, returns the number of them */
+static int
+tcp_signal(int signum)
+{
+	int i, count;
 
-	/* join the threads */
-	for (j = 0; j < i; j++) {
-		pthread_join(tids[j], NULL);
+	pthread_mutex_lock(&sessions.lock);
+	count = sessions.count;
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (sessions.used[i]) {
+			pthread_kill(sessions.tids[i], signum);
+		}
 	}
+	pthread_mutex_unlock(&sessions.lock);
 
-	return ret;
+	return count;
+}
+
+/* wakes up the sessions, so that the idle ones notice the drain, returns the number of sessions left */
+int
+tcp_drain(void)
+{
+	return tcp_signal(SIGUSR2);
+}
+
+/* interrupts all the sessions and waits until they terminate */
+void
+tcp_shutdown(void)
+{
+	/* a session may be just about to block, so it is interrupted until it is gone */
+	while (tcp_signal(SIGINT)) {
+		usleep(10000);
+	}
 }
@@ -0,0 +1,218 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: timers.c
+ * Desc: Hierarchical timer wheel for the session deadlines
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "server.h"
+#include "timers.h"
+
+/*
+ * The slots of level 0 hold the timers which expire within the next TIMER_SLOTS ticks, one slot per tick.
+ * A slot of level l holds the timers of TIMER_SLOTS^l ticks, they are moved a level down once the current
+ * tick gets to their slot. Arming and cancelling is O(1), a tick is O(1) plus the moved and the expired timers.
+ */
+static struct {
+	pthread_mutex_t lock;
+	unsigned long long tick;
+	struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+	pthread_t tid;
+	int running;
+} wheel = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static unsigned long long
+timers_now(void)
+{
+	return metrics_now() / (TIMER_TICK_MS * 1000000ULL);
+}
+
+static void
+timer_unlink(struct timer *timer)
+{
+	if (!timer->pprev) {
+		return;
+	}
+
+	*timer->pprev = timer->next;
+	if (timer->next) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/* puts a timer into the slot of the lowest level, which covers its expiration */
+static void
+timer_link(struct timer *timer)
+{
+	unsigned long long delta, expires = timer->expires;
+	struct timer **slot;
+	int level;
+
+	/* a timer moved down from a higher level may be due right in the current tick */
+	if (expires < wheel.tick) {
+		expires = wheel.tick;
+	}
+
+	delta = expires - wheel.tick;
+	for (level = 0; level < TIMER_LEVELS - 1; level++) {
+		if (delta < (1ULL << ((level + 1) * TIMER_SLOT_BITS))) {
+			break;
+		}
+	}
+
+	/* the last level wraps around, a timer too far away just gets moved down later than it should */
+	slot = &wheel.slots[level][(expires >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1)];
+
+	timer->next = *slot;
+	if (timer->next) {
+		timer->next->pprev = &timer->next;
+	}
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+/* arms a timer to expire after the given number of milliseconds, an armed one is moved, 0 cancels it */
+void
+timer_arm(struct timer *timer, unsigned long long ms)
+{
+	pthread_mutex_lock(&wheel.lock);
+
+	timer_unlink(timer);
+	if (ms && wheel.running) {
+		timer->expires = timers_now() + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+		timer_link(timer);
+	}
+
+	pthread_mutex_unlock(&wheel.lock);
+}
+
+/* once this returns the expire callback of the timer is not running and it will not run */
+void
+timer_cancel(struct timer *timer)
+{
+	timer_arm(timer, 0);
+}
+
+/* moves all the timers of a slot a level down */
+static void
+timers_cascade(int level, int index)
+{
+	struct timer *timer, *next;
+
+	timer = wheel.slots[level][index];
+	wheel.slots[level][index] = NULL;
+
+	for (; timer; timer = next) {
+		next = timer->next;
+		timer->next = NULL;
+		timer->pprev = NULL;
+		timer_link(timer);
+	}
+}
+
+static void
+timers_tick(void)
+{
+	struct timer *timer;
+	unsigned long long again;
+	int level, index;
+
+	wheel.tick++;
+
+	/* the higher levels are moved down when the lower ones wrap around */
+	for (level = 1; level < TIMER_LEVELS; level++) {
+		if (wheel.tick & ((1ULL << (level * TIMER_SLOT_BITS)) - 1)) {
+			break;
+		}
+		timers_cascade(level, (wheel.tick >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1));
+	}
+
+	index = wheel.tick & (TIMER_SLOTS - 1);
+	while ((timer = wheel.slots[0][index])) {
+		timer_unlink(timer);
+		if (timer->expires > wheel.tick) {
+			/* wrapped around the last level */
+			timer_link(timer);
+			continue;
+		}
+
+		again = timer->expire(timer);
+		if (again) {
+			timer->expires = wheel.tick + (again + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+			timer_link(timer);
+		}
+	}
+}
+
+static void *
+timers_thread(void *arg)
+{
+	struct timespec ts;
+	unsigned long long now;
+
+	(void) arg;
+
+	while (1) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = TIMER_TICK_MS * 1000000L;
+		nanosleep(&ts, NULL);
+
+		pthread_mutex_lock(&wheel.lock);
+		if (!wheel.running) {
+			pthread_mutex_unlock(&wheel.lock);
+			break;
+		}
+
+		/* catch up with all the ticks the thread overslept */
+		now = timers_now();
+		while (wheel.tick < now) {
+			timers_tick();
+		}
+		pthread_mutex_unlock(&wheel.lock);
+	}
+
+	return NULL;
+}
+
+/* starts the thread which runs the expired timers */
+int
+timers_init(void)
+{
+	wheel.tick = timers_now();
+	wheel.running = 1;
+
+	if (pthread_create(&wheel.tid, NULL, timers_thread, NULL)) {
+		ERR("Creating the timer thread failed.");
+		wheel.running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* stops the timer thread, the timers still armed never expire */
+void
+timers_destroy(void)
+{
+	pthread_mutex_lock(&wheel.lock);
+	if (!wheel.running) {
+		pthread_mutex_unlock(&wheel.lock);
+		return;
+	}
+	wheel.running = 0;
+	pthread_mutex_unlock(&wheel.lock);
+
+	pthread_join(wheel.tid, NULL);
+}
@@ -0,0 +1,40 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: timers.h
+ * Desc: Hierarchical timer wheel for the session deadlines header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _TIMERS_H_
+#define _TIMERS_H_
+
+/* resolution of the wheel */
+#define TIMER_TICK_MS 10
+
+/* every level has 2^TIMER_SLOT_BITS slots, a slot of a level spans all the slots of the level below */
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+
+/*
+ * A timer lives inside the object it belongs to, so arming and cancelling it allocates nothing.
+ * The expire callback runs in the timer thread and returns the number of milliseconds, after which
+ * it should run again, or 0. It must not arm or cancel any timer itself.
+ */
+struct timer {
+	struct timer *next;
+	struct timer **pprev;
+	unsigned long long expires;
+	unsigned long long (*expire)(struct timer *timer);
+};
+
+void timer_arm(struct timer *timer, unsigned long long ms);
+
+void timer_cancel(struct timer *timer);
+
+int timers_init(void);
+
+void timers_destroy(void);
+
+#endif
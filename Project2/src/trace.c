@@ -0,0 +1,248 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: trace.c
+ * Desc: Per-request tracing of stage timestamps into per-thread rings
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "trace.h"
+
+static const char *point_names[TRACE_POINTS] = {
+	"start",
+	"recv",
+	"parse",
+	"tree",
+	"eval",
+	"send"
+};
+
+/* list of all the per-thread rings, rings are never freed, only reused */
+static _Atomic(struct trace_ring *) trace_rings;
+
+static atomic_uint trace_ring_count;
+
+static _Thread_local struct trace_ring *thread_ring;
+
+static pthread_key_t trace_key;
+
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+/* requests slower than this are printed right away, 0 disables it */
+static unsigned long long trace_threshold_ns;
+
+static volatile sig_atomic_t dump_requested;
+
+static void
+trace_ring_release(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	atomic_store_explicit(&ring->in_use, 0, memory_order_release);
+}
+
+static void
+trace_key_create(void)
+{
+	pthread_key_create(&trace_key, trace_ring_release);
+}
+
+/* allocates a ring and adds it to the list */
+static struct trace_ring *
+trace_ring_new(int in_use)
+{
+	struct trace_ring *ring;
+
+	ring = calloc(1, sizeof *ring);
+	if (!ring) {
+		return NULL;
+	}
+
+	atomic_init(&ring->in_use, in_use);
+	ring->index = atomic_fetch_add(&trace_ring_count, 1);
+	ring->next = atomic_load(&trace_rings);
+	while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring));
+
+	return ring;
+}
+
+/* preallocates the rings of the given number of threads, so that the new threads do not allocate them */
+int
+trace_init(unsigned int rings)
+{
+	while (atomic_load(&trace_ring_count) < rings) {
+		if (!trace_ring_new(0)) {
+			ERR("Memory allocation error.");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* gets the ring of the calling thread, the first call per thread finds a free one or allocates it */
+static struct trace_ring *
+trace_ring_get(void)
+{
+	struct trace_ring *ring;
+	int expected;
+
+	if (thread_ring) {
+		return thread_ring;
+	}
+
+	pthread_once(&trace_key_once, trace_key_create);
+
+	for (ring = atomic_load(&trace_rings); ring; ring = ring->next) {
+		expected = 0;
+		if (atomic_compare_exchange_strong(&ring->in_use, &expected, 1)) {
+			break;
+		}
+	}
+
+	if (!ring) {
+		ring = trace_ring_new(1);
+		if (!ring) {
+			return NULL;
+		}
+	}
+
+	pthread_setspecific(trace_key, ring);
+	thread_ring = ring;
+	return ring;
+}
+
+/* formats a single record, the stage durations are relative to the previous reached point */
+static void
+trace_format(char line[LOG_LINE_SIZE], const char *reason, unsigned long long id, const struct trace_request *req)
+{
+	int len, i;
+	unsigned long long prev, last;
+
+	len = snprintf(line, LOG_LINE_SIZE, "%s %s id=%llx", reason, req->udp ? "udp" : "tcp", id);
+
+	prev = last = req->stamps[TRACE_START];
+	for (i = TRACE_RECV; i < TRACE_POINTS; i++) {
+		if (!req->stamps[i]) {
+			continue;
+		}
+
+		len += snprintf(line + len, LOG_LINE_SIZE - len, " %s=%.3fus", point_names[i], (req->stamps[i] - prev) / 1e3);
+		prev = last = req->stamps[i];
+	}
+
+	snprintf(line + len, LOG_LINE_SIZE - len, " total=%.3fus", (last - req->stamps[TRACE_START]) / 1e3);
+}
+
+void
+trace_begin(struct trace_request *req, int udp, unsigned long long start)
+{
+	memset(req, 0, sizeof *req);
+	req->udp = udp;
+	req->stamps[TRACE_START] = start;
+}
+
+/* stores the finished request into the ring of this thread */
+void
+trace_commit(struct trace_request *req)
+{
+	struct trace_ring *ring;
+	struct trace_record *rec;
+	unsigned long long head, last;
+	unsigned int seq;
+	int i;
+	char line[LOG_LINE_SIZE];
+
+	ring = trace_ring_get();
+	if (!ring || !req->stamps[TRACE_START]) {
+		return;
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+
+	/* an odd sequence number tells the readers that the record is being written */
+	seq = atomic_load_explicit(&rec->seq, memory_order_relaxed);
+	atomic_store_explicit(&rec->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	rec->id = ((unsigned long long)ring->index << 40) | head;
+	rec->req = *req;
+
+	atomic_store_explicit(&rec->seq, seq + 2, memory_order_release);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	if (!trace_threshold_ns) {
+		return;
+	}
+
+	for (i = TRACE_POINTS - 1, last = 0; (i > TRACE_START) && !last; i--) {
+		last = req->stamps[i];
+	}
+
+	if (last && (last - req->stamps[TRACE_START] > trace_threshold_ns)) {
+		trace_format(line, "slow", rec->id, req);
+		WRN("%s", line);
+	}
+}
+
+void
+trace_set_threshold(unsigned long long threshold_us)
+{
+	trace_threshold_ns = threshold_us * 1000;
+}
+
+/* async-signal-safe, the dump itself is done by trace_dump_pending() */
+void
+trace_request_dump(void)
+{
+	dump_requested = 1;
+}
+
+/* dumps all the rings if it was requested */
+void
+trace_dump_pending(void)
+{
+	struct trace_ring *ring;
+	struct trace_record *rec;
+	struct trace_request req;
+	unsigned long long head, i, id;
+	unsigned int seq;
+	char line[LOG_LINE_SIZE];
+
+	if (!dump_requested) {
+		return;
+	}
+	dump_requested = 0;
+
+	for (ring = atomic_load(&trace_rings); ring; ring = ring->next) {
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		i = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+
+		for (; i < head; i++) {
+			rec = &ring->records[i & (TRACE_RING_SIZE - 1)];
+
+			/* copy the record and skip it if the owner was writing into it meanwhile */
+			seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+			id = rec->id;
+			req = rec->req;
+			atomic_thread_fence(memory_order_acquire);
+			if ((seq & 1) || (seq != atomic_load_explicit(&rec->seq, memory_order_relaxed))) {
+				continue;
+			}
+
+			/* the dump does not go through the log rings, it would not fit */
+			trace_format(line, "dump", id, &req);
+			fprintf(stderr, "[TRACE]: %s\n", line);
+		}
+	}
+}
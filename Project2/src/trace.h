@@ -0,0 +1,64 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: trace.h
+ * Desc: Per-request tracing of stage timestamps header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdatomic.h>
+
+/* number of records kept per thread, must be a power of two */
+#define TRACE_RING_SIZE 256
+
+/* rings preallocated above the number of sessions, for the main thread and the sessions still exiting */
+#define TRACE_RINGS_SPARE 8
+
+/* the points in time recorded for every request */
+typedef enum {
+	TRACE_START,
+	TRACE_RECV,
+	TRACE_PARSE,
+	TRACE_TREE,
+	TRACE_EVAL,
+	TRACE_SEND,
+	TRACE_POINTS
+} trace_point;
+
+/* timeline of a single request, stamps are monotonic nanoseconds, 0 if the point was not reached */
+struct trace_request {
+	int udp;
+	unsigned long long stamps[TRACE_POINTS];
+};
+
+struct trace_record {
+	atomic_uint seq;
+	unsigned long long id;
+	struct trace_request req;
+};
+
+/* per-thread ring of the last requests, written only by the thread which owns it */
+struct trace_ring {
+	atomic_ullong head;
+	unsigned int index;
+	atomic_int in_use;
+	struct trace_record records[TRACE_RING_SIZE];
+	struct trace_ring *next;
+};
+
+int trace_init(unsigned int rings);
+
+void trace_begin(struct trace_request *req, int udp, unsigned long long start);
+
+void trace_commit(struct trace_request *req);
+
+void trace_set_threshold(unsigned long long threshold_us);
+
+void trace_request_dump(void);
+
+void trace_dump_pending(void);
+
+#endif
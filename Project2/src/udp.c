@@ -12,28 +12,51 @@
 #include <errno.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "flight.h"
+#include "metrics.h"
+#include "overload.h"
 #include "server.h"
 #include "parser.h"
+#include "simd.h"
+#include "workers.h"
+
+/* a datagram handed over to the compute workers, with everything needed to respond to it */
+struct udp_work {
+	struct work work;
+	int sock;
+	int ret;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct trace_request trace;
+	struct udp_work *next;
+	char buffer[MAX_BUFFER_SIZE];
+};
 
-extern struct server_opts server_opts;
-
-extern volatile int exit_application;
+/* the free pieces of work, used only by the main loop, there are as many as may be in flight */
+static struct udp_work *udp_works;
+static struct udp_work *udp_free;
 
 /* initialize the UDP server */
-static int
+int
 udp_init_server(const char *address, int port)
 {
 	int sock, ret = 0;
 	struct sockaddr_in sa;
 	const int reuse_addr = 1;
 
+	/* a local socket skips the whole network stack */
+	if (unix_path(address)) {
+		return unix_init_server(unix_path(address), SOCK_DGRAM);
+	}
+
 	/* create new socket */
 	sock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sock < 0) {
@@ -58,6 +81,7 @@ udp_init_server(const char *address, int port)
 	if (ret) {
 		ERR("Bind failed (%s).", strerror(errno));
 		close(sock);
+		sock = -1;
 		goto cleanup;
 	}
 
@@ -65,160 +89,412 @@ cleanup:
 	return sock;
 }
 
-/* make a response to an udp request */
+/* writes an error into an item of a response, its message is cut to the room left for it */
 static int
-udp_create_response(char buffer[MAX_BUFFER_SIZE], int err)
+udp_item_error(char *item, int size, const char *message)
+{
+	int len = strlen(message);
+
+	if (len > size - 2) {
+		len = size - 2;
+	}
+
+	item[0] = 1;
+	item[1] = len;
+	memcpy(item + 2, message, len);
+	return len + 2;
+}
+
+/*
+ * Writes the answer to a query, or the error of its calculation, into an item of a response, which is its status,
+ * the length of its payload and the payload, the result or an error message. Returns the length of the item.
+ */
+static int
+udp_answer(int ret, const struct num *answer, char *item, int size)
+{
+	int len;
+
+	if (ret == NUM_DIV_ZERO) {
+		/* division by zero */
+		ERR("Calculation failed (division by zero).");
+		return udp_item_error(item, size, "Calculation failed (division by zero).\n");
+	} else if (ret) {
+		/* too large for the arithmetic or out of memory */
+		ERR("Calculation failed (%s).", (ret == NUM_TOO_LARGE) ? "number too large" : "memory allocation error");
+		return udp_item_error(item, size, "Calculation failed.\n");
+	} else if (num_sign(answer) < 0) {
+		/* negative result */
+		ERR("Calculation failed (negative result).");
+		return udp_item_error(item, size, "Calculation failed (negative result).\n");
+	}
+
+	/* convert the answer right into the response, the payload length is a single byte */
+	len = -1;
+	if (num_str_size(answer) <= size - 2) {
+		len = num_to_str(answer, item + 2);
+	}
+	if ((len < 0) || (len > UCHAR_MAX)) {
+		ERR("Result does not fit into a response.");
+		memset(item, 0, size);
+		return udp_item_error(item, size, "Result too long.\n");
+	}
+
+	/* everything went well, prepare answer */
+	item[0] = 0;
+	item[1] = len;
+	return len + 2;
+}
+
+/*
+ * Solves a single query into an item of a response, returns the length of the item, at most size.
+ * Unless it may wait, it never waits for an identical query solved by another thread.
+ */
+static int
+udp_solve(const char *query, char *item, int size, int wait, struct trace_request *trace)
 {
 	int ret = 0;
 	struct node *tree = NULL;
-	char *ans = NULL;
+	struct num answer;
+	struct flight flight;
 	int len;
-	char copy[MAX_BUFFER_SIZE];
+	unsigned long long start;
 
-	/* create a copy and reset the buffer, since it will store the response */
-	memcpy(copy, buffer, MAX_BUFFER_SIZE);
-	memset(buffer, 0, MAX_BUFFER_SIZE);
+	num_init(&answer);
+	start = metrics_now();
 
-	if (err < 0) {
-		/* create error response */
-		buffer[0] = 1;
-		buffer[1] = 1;
-		buffer[2] = strlen("Invalid request.\n");
-		strcpy(buffer + 3, "Invalid request.\n");
-		len = strlen("Invalid request.\n");
+	/* an identical query solved at the same time is waited for instead, the wait is the evaluation then */
+	if (flight_join(&flight, query, strlen(query), wait, &answer, &ret) == FLIGHT_SHARED) {
+		trace->stamps[TRACE_TREE] = start;
+		trace->stamps[TRACE_EVAL] = metrics_observe(STAGE_EVAL, start);
+		len = udp_answer(ret, &answer, item, size);
 		goto cleanup;
 	}
 
 	/* create new tree for calculation of the answer */
-	ret = new_tree(copy + 2, &tree);
+	ret = new_tree(query, &tree);
+	start = trace->stamps[TRACE_TREE] = metrics_observe(STAGE_TREE, start);
 	if (ret) {
 		ERR("Creating new tree failed.");
-		buffer[0] = 1;
-		buffer[1] = 1;
-		buffer[2] = strlen("Internal error.\n");
-		strcpy(buffer + 3, "Internal error.\n");
-		len = strlen("Internal error.\n");
+		flight_leave(&flight, FLIGHT_UNSHARED, NULL);
+		len = udp_item_error(item, size, "Internal error.\n");
 		goto cleanup;
 	}
 
 	/* get the answer */
-	ret = calculate_answer(tree);
-	if (ret == INT_MIN) {
-		/* division by zero */
-		ERR("Calculation failed (division by zero).");
-		buffer[0] = 1;
-		buffer[1] = 1;
-		buffer[2] = strlen("Calculation failed (division by zero).\n");
-		strcpy(buffer + 3, "Calculation failed (division by zero).\n");
-		len = strlen("Calculation failed (division by zero).\n");
-		goto cleanup;
-	} else if (ret < 0) {
-		/* negative result */
-		ERR("Calculation failed (negative result).");
-		buffer[0] = 1;
-		buffer[1] = 1;
-		buffer[2] = strlen("Calculation failed (negative result).\n");
-		strcpy(buffer + 3, "Calculation failed (negative result).\n");
-		len = strlen("Calculation failed (negative result).\n");
-		goto cleanup;
+	ret = calculate_answer(tree, &answer);
+	flight_leave(&flight, ret, &answer);
+	trace->stamps[TRACE_EVAL] = metrics_observe(STAGE_EVAL, start);
+	len = udp_answer(ret, &answer, item, size);
+
+cleanup:
+	num_free(&answer);
+	del_tree(tree);
+	return len;
+}
+
+/*
+ * Solves the queries of a batch, a failed one gets its own error. The valid queries, which share their shape,
+ * are solved together across the SIMD lanes first, the rest of them one by one.
+ */
+static int
+udp_solve_batch(const char *request, char *buffer, int size, int wait, struct trace_request *trace)
+{
+	int count, i, pos = 2, len = 2, query_len, room;
+	char query[UCHAR_MAX + 1], *item;
+	const char *queries[SIMD_MAX_QUERIES];
+	int lens[SIMD_MAX_QUERIES], status[SIMD_MAX_QUERIES], valid[SIMD_MAX_QUERIES], solved = 0;
+	long long values[SIMD_MAX_QUERIES];
+	unsigned long long start;
+	struct num answer;
+
+	count = (unsigned char)request[1];
+	buffer[0] = UDP_BATCH_RESPONSE;
+	buffer[1] = count;
+
+	for (i = 0; i < count; i++) {
+		lens[i] = (unsigned char)request[pos++];
+		queries[i] = request + pos;
+		pos += lens[i];
+
+		valid[i] = !udp_parse_item(queries[i], lens[i]);
+		if (valid[i]) {
+			/* the invalid ones are not solved at all */
+			queries[solved] = queries[i];
+			lens[solved++] = lens[i];
+		}
 	}
 
-	/* convert the answer to a string */
-	asprintf(&ans, "%d", ret);
-	if (!ans) {
-		ERR("Memory allocation error.");
-		buffer[0] = 1;
-		buffer[1] = 1;
-		buffer[2] = strlen("Internal error.\n");
-		strcpy(buffer + 3, "Internal error.\n");
-		len = strlen("Internal error.\n");
-		goto cleanup;
+	start = metrics_now();
+	simd_solve(queries, lens, solved, values, status);
+	trace->stamps[TRACE_EVAL] = metrics_observe(STAGE_EVAL, start);
+
+	num_init(&answer);
+	solved = 0;
+	for (i = 0, pos = 2; i < count; i++) {
+		query_len = (unsigned char)request[pos++];
+		memcpy(query, request + pos, query_len);
+		query[query_len] = '\0';
+		pos += query_len;
+
+		/* the items which follow need at least their status and length, the request had as much for them */
+		item = buffer + len;
+		room = size - len - 2 * (count - i - 1);
+		if (!valid[i]) {
+			ERR("Unexpected batch query (%s).", query);
+			len += udp_item_error(item, room, "Invalid request.\n");
+		} else if (status[solved] == SIMD_SCALAR) {
+			len += udp_solve(query, item, room, wait, trace);
+		} else {
+			num_set_int(&answer, values[solved]);
+			len += udp_answer(status[solved], &answer, item, room);
+		}
+		solved += valid[i];
+
+		if (item[0]) {
+			metrics_inc(METRIC_ERRORS, 1);
+		}
+	}
+
+	num_free(&answer);
+	metrics_inc(METRIC_BATCH_ITEMS, count);
+	return len;
+}
+
+/*
+ * Make a response of at most size bytes to an udp request, the shared memory transport uses it as well.
+ * The main loop must not wait for a query solved by another thread, only the workers and the sessions may.
+ */
+int
+udp_create_response(char buffer[MAX_BUFFER_SIZE], int err, int size, int wait, struct trace_request *trace)
+{
+	int len;
+	char copy[MAX_BUFFER_SIZE];
+
+	/* create a copy and reset the buffer, since it will store the response */
+	memcpy(copy, buffer, MAX_BUFFER_SIZE);
+	memset(buffer, 0, MAX_BUFFER_SIZE);
+
+	if ((err >= 0) && (copy[0] == UDP_BATCH_REQUEST)) {
+		return udp_solve_batch(copy, buffer, size, wait, trace);
 	}
 
-	/* everything went well, prepare answer */
 	buffer[0] = 1;
-	buffer[1] = 0;
-	len = strlen(ans);
-	buffer[2] = len;
-	strcpy(buffer + 3, ans);
-	free(ans);
+	if (err < 0) {
+		/* create error response */
+		len = udp_item_error(buffer + 1, size - 1, "Invalid request.\n");
+	} else {
+		len = udp_solve(copy + 2, buffer + 1, size - 1, wait, trace);
+	}
 
-cleanup:
-	del_tree(tree);
-	return len + 3;
+	if (buffer[1]) {
+		metrics_inc(METRIC_ERRORS, 1);
+	}
+	return len + 1;
+}
+
+/* sends a response, the request has left the overload control already */
+static void
+udp_respond(int server_sock, const char *buffer, int len, struct sockaddr_storage *client_addr, socklen_t addrlen,
+		struct trace_request *trace)
+{
+	unsigned long long start;
+
+	/* an unbound unix socket has no address to answer to */
+	if (addrlen <= sizeof(sa_family_t)) {
+		ERR("Client has no address to respond to.");
+		return;
+	}
+
+	start = metrics_now();
+	if (sendto(server_sock, buffer, len, 0, (struct sockaddr *)client_addr, addrlen) < 0) {
+		/* a local client may be gone already, which must not stop the server */
+		ERR("Sendto failed (%s).", strerror(errno));
+		return;
+	}
+	trace->stamps[TRACE_SEND] = metrics_observe(STAGE_SEND, start);
+	trace_commit(trace);
+	metrics_inc(METRIC_BYTES_SENT, len);
+	metrics_inc(METRIC_UDP_REQUESTS, 1);
+}
+
+/* solves a request in a compute worker */
+static void
+udp_work_run(struct work *work)
+{
+	struct udp_work *w = (struct udp_work *)((char *)work - offsetof(struct udp_work, work));
+
+	w->ret = udp_create_response(w->buffer, w->ret, MAX_BUFFER_SIZE, 1, &w->trace);
+}
+
+/* sends the response computed by a worker from the main loop and frees the piece of work */
+static void
+udp_work_done(struct work *work)
+{
+	struct udp_work *w = (struct udp_work *)((char *)work - offsetof(struct udp_work, work));
+
+	overload_leave();
+	udp_respond(w->sock, w->buffer, w->ret, &w->addr, w->addrlen, &w->trace);
+
+	w->next = udp_free;
+	udp_free = w;
+}
+
+/* hands a parsed request over to the workers, returns -1 if there is no room for it */
+static int
+udp_submit(int server_sock, const char *buffer, int ret, struct sockaddr_storage *client_addr, socklen_t addrlen,
+		struct trace_request *trace)
+{
+	struct udp_work *w = udp_free;
+
+	if (!w) {
+		return -1;
+	}
+
+	w->sock = server_sock;
+	w->ret = ret;
+	memcpy(&w->addr, client_addr, addrlen);
+	w->addrlen = addrlen;
+	w->trace = *trace;
+	memcpy(w->buffer, buffer, MAX_BUFFER_SIZE);
+
+	if (workers_submit(&w->work)) {
+		return -1;
+	}
+	udp_free = w->next;
+	return 0;
 }
 
-/* main UDP loop */
+/* preallocates the pieces of work, only if there are workers to compute them */
 int
-handle_udp()
+udp_init(void)
 {
-	int ret, server_sock;
+	int i;
+
+	if (!workers_count()) {
+		return 0;
+	}
+
+	udp_works = calloc(WORKERS_QUEUE_DEPTH, sizeof *udp_works);
+	if (!udp_works) {
+		ERR("Memory allocation error.");
+		return -1;
+	}
+
+	for (i = WORKERS_QUEUE_DEPTH - 1; i >= 0; i--) {
+		udp_works[i].work.run = udp_work_run;
+		udp_works[i].work.done = udp_work_done;
+		udp_works[i].next = udp_free;
+		udp_free = &udp_works[i];
+	}
+
+	return 0;
+}
+
+void
+udp_destroy(void)
+{
+	free(udp_works);
+	udp_works = NULL;
+	udp_free = NULL;
+}
+
+/*
+ * Handles a single datagram, the main loop found the server socket readable. With the workers the main loop
+ * only receives and parses the request, a worker solves it and the main loop then sends the response, so
+ * an expensive request does not hold back the cheap ones. When too many requests are in flight already,
+ * the request is rejected like by the overload control.
+ */
+void
+udp_handle(int server_sock)
+{
+	int ret;
 	char buffer[MAX_BUFFER_SIZE];
-	int client_socks[MAX_CLIENTS];
-	struct sockaddr_in client_addr;
-	int addrlen;
-	fd_set readfds;
+	struct sockaddr_storage client_addr;
+	socklen_t addrlen;
 	ssize_t bytes;
+	unsigned long long start;
+	struct trace_request trace;
+	struct ratelimit_key key;
+	struct msghdr msg;
+	struct iovec iov;
+	const char *rejected;
+	union {
+		char buf[CMSG_SPACE(sizeof(struct timespec))];
+		struct cmsghdr align;
+	} control;
+
+	/* reset the buffer */
+	memset(buffer, 0, MAX_BUFFER_SIZE);
 
-	/* initialize the server */
-	server_sock = udp_init_server(server_opts.address, server_opts.port);
-	if (server_sock < 0) {
-		ERR("Initializing UDP server failed.");
-		return -1;
+	/* the arrival time of the datagram comes along with it, if the overload control is on */
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = buffer;
+	/* room for the terminator of the payload */
+	iov.iov_len = MAX_BUFFER_SIZE - 1;
+	msg.msg_name = &client_addr;
+	msg.msg_namelen = sizeof client_addr;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+
+	start = metrics_now();
+	bytes = recvmsg(server_sock, &msg, MSG_DONTWAIT);
+	addrlen = msg.msg_namelen;
+	if (bytes < 0) {
+		/* a failure of a single datagram must not stop the other listeners */
+		if (errno != EAGAIN) {
+			ERR("Recvfrom failed (%s).", strerror(errno));
+		}
+		return;
 	}
+	metrics_inc(METRIC_BYTES_RECEIVED, bytes);
+	capture_data(IP_UDP, capture_address((struct sockaddr *)&client_addr, addrlen), buffer, bytes);
 
-	addrlen = sizeof client_addr;
-	memset(&client_socks, 0, sizeof client_socks);
+	/* a client over its limits is dropped before any parsing */
+	if (ratelimit_key((struct sockaddr *)&client_addr, addrlen, &key) && !ratelimit_allow(&key, 0, 1, bytes)) {
+		return;
+	}
 
-	while(!exit_application) {
-		/* reset the buffer */
-		memset(buffer, 0, MAX_BUFFER_SIZE);
+	/* a request which waited too long gets the prepared error right away, which drains the queue quickly */
+	if (!overload_admit(overload_sojourn(&msg))) {
+		if (addrlen > sizeof(sa_family_t)) {
+			ret = overload_response(&rejected);
+			sendto(server_sock, rejected, ret, MSG_DONTWAIT, (struct sockaddr *)&client_addr, addrlen);
+		}
+		return;
+	}
+	overload_enter();
 
-		FD_ZERO(&readfds);
-		FD_SET(server_sock, &readfds);
+	trace_begin(&trace, 1, start);
+	start = trace.stamps[TRACE_RECV] = metrics_observe(STAGE_RECV, start);
 
-		/* wait for the server socket to be ready */
-		ret = select(server_sock + 1, &readfds, NULL, NULL, NULL);
-		if (ret < 0) {
-			if (errno == EINTR) {
-    			ret = 0;
-    			goto cleanup;
-    		}
+	/* parse the request and get the length of it */
+	ret = udp_parse_request(buffer, bytes);
+	trace.stamps[TRACE_PARSE] = metrics_observe(STAGE_PARSE, start);
+	if (ret < 0) {
+		ERR("Unexpected message (%s).", buffer);
+	} else {
+		buffer[ret + 2] = '\0';
+	}
 
-			ERR("Select failed (%s).", strerror(errno));
-			ret = 1;
-			goto cleanup;
+	if (workers_count()) {
+		if (!udp_submit(server_sock, buffer, ret, &client_addr, addrlen, &trace)) {
+			return;
 		}
 
-		/* check for new connection */
-		if (FD_ISSET(server_sock, &readfds)) {
-			bytes = recvfrom(server_sock, buffer, MAX_BUFFER_SIZE, 0, (struct sockaddr *) &client_addr, (socklen_t *) &addrlen);
-			if (bytes < 0) {
-				ERR("Recvfrom failed (%s).", strerror(errno));
-				ret = 1;
-				goto cleanup;
-			}
-
-			/* parse the request and get the length of it */
-			ret = udp_parse_request(buffer, bytes);
-			if (ret < 0) {
-				ERR("Unexpected message (%s).", buffer);
-			} else {
-				buffer[ret + 2] = '\0';
-			}
-
-			/* creates the response, which reflects the result of parsing */
-			ret = udp_create_response(buffer, ret);
-
-			if (sendto(server_sock, buffer, ret, 0, (struct sockaddr *)&client_addr, addrlen) < 0) {
-                ERR("Sendto failed (%s).", strerror(errno));
-                ret = 1;
-                goto cleanup;
-            }
+		overload_leave();
+		metrics_inc(METRIC_SHED, 1);
+		if (addrlen > sizeof(sa_family_t)) {
+			ret = overload_response(&rejected);
+			sendto(server_sock, rejected, ret, MSG_DONTWAIT, (struct sockaddr *)&client_addr, addrlen);
 		}
+		return;
 	}
 
-cleanup:
-	return ret;
-}
+	/* creates the response, which reflects the result of parsing */
+	ret = udp_create_response(buffer, ret, MAX_BUFFER_SIZE, 0, &trace);
 
+	overload_leave();
+	udp_respond(server_sock, buffer, ret, &client_addr, addrlen, &trace);
+}
@@ -0,0 +1,261 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: workers.c
+ * Desc: Pool of compute workers fed by the main loop
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "busypoll.h"
+#include "metrics.h"
+#include "queue.h"
+#include "server.h"
+#include "workers.h"
+
+/*
+ * The main loop pushes the work into the requests queue and posts the semaphore, on which the idle workers
+ * sleep. A worker pushes the finished work into the completions queue and writes to the eventfd, which
+ * the main loop selects on, only if no write is pending yet. The number of the pieces in flight is capped
+ * by the depth of the queues, so the completions queue never fills up.
+ */
+static struct {
+	unsigned int count;
+	unsigned int started;
+	pthread_t tids[WORKERS_MAX];
+	struct queue requests;
+	struct queue completions;
+	sem_t pending;
+	int event;
+	atomic_int signalled;
+	atomic_int stopping;
+	/* only the main loop submits and completes the work */
+	unsigned int inflight;
+} workers = {.event = -1};
+
+/* the depths of the queues, read when the metrics are served */
+static unsigned long long
+workers_requests_depth(void)
+{
+	return queue_depth(&workers.requests);
+}
+
+static unsigned long long
+workers_completions_depth(void)
+{
+	return queue_depth(&workers.completions);
+}
+
+/* sets the number of the workers, 0 lets the main loop compute everything itself */
+void
+workers_set(unsigned int count)
+{
+	workers.count = count;
+}
+
+unsigned int
+workers_count(void)
+{
+	return workers.count;
+}
+
+/* waits for the next piece of work, spins for a while first with busy polling, returns 0 once stopping */
+static struct work *
+workers_next(void)
+{
+	struct work *work;
+	unsigned int spin = 0;
+
+	for (;;) {
+		if (!sem_trywait(&workers.pending)) {
+			break;
+		} else if (busy_poll_backoff(&spin)) {
+			continue;
+		} else if (!sem_wait(&workers.pending)) {
+			break;
+		} else if (errno != EINTR) {
+			ERR("Waiting for work failed (%s).", strerror(errno));
+			return NULL;
+		}
+	}
+
+	/* every post stands for one piece of work, or for one worker to stop once the queue is empty */
+	work = queue_pop(&workers.requests);
+	if (!work && !atomic_load(&workers.stopping)) {
+		ERR("Work queue is inconsistent.");
+	}
+	return work;
+}
+
+static void *
+workers_run(void *arg)
+{
+	struct work *work;
+	const uint64_t one = 1;
+
+	(void) arg;
+
+	/* the metrics block of the worker is taken now, not while serving the first request */
+	metrics_inc(METRIC_ERRORS, 0);
+
+	while ((work = workers_next())) {
+		metrics_observe(STAGE_QUEUE, work->queued);
+		work->run(work);
+
+		queue_push(&workers.completions, work);
+		if (!atomic_exchange(&workers.signalled, 1) && (write(workers.event, &one, sizeof one) < 0)) {
+			ERR("Waking up the main loop failed (%s).", strerror(errno));
+		}
+	}
+
+	return NULL;
+}
+
+/* starts the workers, if there are any */
+int
+workers_init(void)
+{
+	unsigned int i;
+	int ret;
+
+	if (!workers.count) {
+		return 0;
+	}
+
+	if (workers.count > WORKERS_MAX) {
+		ERR("At most %d workers are supported.", WORKERS_MAX);
+		return -1;
+	}
+
+	if (queue_init(&workers.requests, WORKERS_QUEUE_DEPTH) || queue_init(&workers.completions, WORKERS_QUEUE_DEPTH)) {
+		goto error;
+	}
+
+	if (sem_init(&workers.pending, 0, 0)) {
+		ERR("Creating the semaphore failed (%s).", strerror(errno));
+		goto error;
+	}
+
+	workers.event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (workers.event < 0) {
+		ERR("Creating the eventfd failed (%s).", strerror(errno));
+		sem_destroy(&workers.pending);
+		goto error;
+	}
+
+	for (i = 0; i < workers.count; i++) {
+		ret = pthread_create(&workers.tids[i], NULL, workers_run, NULL);
+		if (ret) {
+			ERR("Creating a worker failed (%s).", strerror(ret));
+			workers_drain();
+			workers_destroy();
+			return -1;
+		}
+		workers.started++;
+	}
+
+	metrics_gauge(GAUGE_WORK_QUEUE, workers_requests_depth);
+	metrics_gauge(GAUGE_COMPLETION_QUEUE, workers_completions_depth);
+	INF("Computing on %u workers.", workers.count);
+	return 0;
+
+error:
+	queue_destroy(&workers.requests);
+	queue_destroy(&workers.completions);
+	workers.count = 0;
+	return -1;
+}
+
+/* hands a piece of work over to the workers, returns -1 if too much work is in flight already */
+int
+workers_submit(struct work *work)
+{
+	if (workers.inflight == WORKERS_QUEUE_DEPTH) {
+		return -1;
+	}
+
+	work->queued = metrics_now();
+	if (queue_push(&workers.requests, work)) {
+		return -1;
+	}
+	workers.inflight++;
+
+	sem_post(&workers.pending);
+	return 0;
+}
+
+/* the eventfd the main loop selects on for the finished work, -1 without workers */
+int
+workers_fd(void)
+{
+	return workers.event;
+}
+
+/* runs the done callbacks of all the finished work, called by the main loop */
+void
+workers_complete(void)
+{
+	struct work *work;
+	uint64_t value;
+
+	/* the flag is cleared before the queue is emptied, so a piece pushed meanwhile writes to the eventfd again */
+	if ((read(workers.event, &value, sizeof value) < 0) && (errno != EAGAIN)) {
+		ERR("Reading the eventfd failed (%s).", strerror(errno));
+	}
+	atomic_store(&workers.signalled, 0);
+
+	while ((work = queue_pop(&workers.completions))) {
+		workers.inflight--;
+		work->done(work);
+	}
+}
+
+/* lets the workers finish the queued work and stop, then completes it, the listeners are still open */
+void
+workers_drain(void)
+{
+	unsigned int i;
+
+	if (workers.event < 0) {
+		return;
+	}
+
+	atomic_store(&workers.stopping, 1);
+	for (i = 0; i < workers.started; i++) {
+		sem_post(&workers.pending);
+	}
+	for (i = 0; i < workers.started; i++) {
+		pthread_join(workers.tids[i], NULL);
+	}
+	workers.started = 0;
+
+	workers_complete();
+}
+
+/* safe to call when the workers were not started, e.g. when the server failed to initialize */
+void
+workers_destroy(void)
+{
+	if (workers.event < 0) {
+		return;
+	}
+
+	metrics_gauge(GAUGE_WORK_QUEUE, NULL);
+	metrics_gauge(GAUGE_COMPLETION_QUEUE, NULL);
+
+	close(workers.event);
+	workers.event = -1;
+	sem_destroy(&workers.pending);
+	queue_destroy(&workers.requests);
+	queue_destroy(&workers.completions);
+	workers.count = 0;
+}
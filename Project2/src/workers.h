@@ -0,0 +1,43 @@
+/*
+ * IPK - Project 2 (IOTA)
+ * File: workers.h
+ * Desc: Pool of compute workers fed by the main loop header
+ * Author: Roman Janota
+ * Login: xjanot04
+*/
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+/* the most workers and the most pieces of work in flight at once, a power of two */
+#define WORKERS_MAX 64
+#define WORKERS_QUEUE_DEPTH 1024
+
+/*
+ * A piece of work lives inside the object it belongs to, like a timer, so handing it over allocates nothing.
+ * The run callback is called by a compute worker, the done callback afterwards by the main loop, which owns
+ * the object again. Neither of them may submit any work itself.
+ */
+struct work {
+	void (*run)(struct work *work);
+	void (*done)(struct work *work);
+	unsigned long long queued;
+};
+
+void workers_set(unsigned int count);
+
+unsigned int workers_count(void);
+
+int workers_init(void);
+
+void workers_destroy(void);
+
+int workers_submit(struct work *work);
+
+int workers_fd(void);
+
+void workers_complete(void);
+
+void workers_drain(void);
+
+#endif